@@ -0,0 +1,206 @@
+/*
+ * The disk request queue, between the block cache (fs.c) and the disk
+ * driver (bdev: ide.c or virtio.c).
+ *
+ * Requests wait in order of their first sector and go to the disk in
+ * C-LOOK order: the next command is the first request at or past where
+ * the last one started, and after the highest one the queue starts
+ * over at the lowest.  Requests in the same direction that are next to
+ * each other on the disk go out as one command, up to 256 sectors.
+ * The driver says how many commands the device can have going at
+ * once: one for IDE, several for virtio.  The device interrupts when a
+ * command is done, and diskq_intr completes its requests and starts
+ * the next command, so the fs server can do other work while the disk
+ * is busy.  A device may do the commands it has in any order, so a
+ * command that overlaps one under way waits for it if either writes.
+ *
+ * With a driver that cannot do that (IDE without bus-master DMA), each
+ * request is a transfer that is done by the time diskq_submit returns.
+ */
+
+#include "fs.h"
+
+// Requests waiting for the disk, in order of dr_secno
+static struct DiskReq *diskq_head;
+// Commands the disk is working on
+static int diskq_ncmds;
+// Their sectors, and whether they write, in the first diskq_ncmds
+// entries
+#define DISKQ_MAXCMDS	16
+static struct DiskCmd {
+	struct DiskReq *dc_reqs;	// Requests, as given to bd_start
+	uint32_t dc_secno;
+	uint32_t dc_nsecs;
+} diskq_cmds[DISKQ_MAXCMDS];
+// First sector of the last command started
+static uint32_t diskq_pos;
+
+static void
+diskq_complete(struct DiskReq *dr, int result)
+{
+	dr->dr_result = result;
+	dr->dr_done = 1;
+	if (dr->dr_callback)
+		dr->dr_callback(dr);
+}
+
+// Whether a command for 'nsecs' sectors from 'secno' must wait for
+// one under way: they overlap, and one of them writes.
+static bool
+diskq_conflict(uint32_t secno, uint32_t nsecs, bool write)
+{
+	struct DiskCmd *dc;
+
+	for (dc = diskq_cmds; dc < diskq_cmds + diskq_ncmds; dc++)
+		if ((write || dc->dc_reqs->dr_write)
+		    && secno < dc->dc_secno + dc->dc_nsecs
+		    && dc->dc_secno < secno + nsecs)
+			return 1;
+	return 0;
+}
+
+// While the disk can take more commands, pick the next request in
+// C-LOOK order, take it and the requests that continue it off the
+// queue, and start them as one command.  Stop at one that must wait
+// for a command under way, or that the driver has no room for yet.
+static void
+diskq_start(void)
+{
+	struct DiskReq **pdr, *dr, *last;
+	uint32_t nsecs;
+	int nreqs, r;
+
+	while (diskq_ncmds < MIN(bdev->bd_maxcmds, DISKQ_MAXCMDS)
+	       && diskq_head) {
+		for (pdr = &diskq_head; *pdr; pdr = &(*pdr)->dr_next)
+			if ((*pdr)->dr_secno >= diskq_pos)
+				break;
+		if (!*pdr)
+			pdr = &diskq_head;
+
+		dr = last = *pdr;
+		nsecs = dr->dr_nsecs;
+		for (nreqs = 1; nreqs < bdev->bd_maxreqs; nreqs++) {
+			if (!last->dr_next
+			    || last->dr_next->dr_write != dr->dr_write
+			    || last->dr_next->dr_secno != dr->dr_secno + nsecs
+			    || nsecs + last->dr_next->dr_nsecs > 256)
+				break;
+			last = last->dr_next;
+			nsecs += last->dr_nsecs;
+		}
+
+		if (diskq_conflict(dr->dr_secno, nsecs, dr->dr_write))
+			break;
+
+		*pdr = last->dr_next;
+		last->dr_next = NULL;
+		if ((r = bdev->bd_start(dr, nsecs)) == -E_NO_MEM
+		    && diskq_ncmds > 0) {
+			last->dr_next = *pdr;
+			*pdr = dr;
+			break;
+		}
+		if (r < 0)
+			panic("diskq: %s: sector %d: %e", bdev->bd_name,
+			      dr->dr_secno, r);
+		diskq_cmds[diskq_ncmds].dc_reqs = dr;
+		diskq_cmds[diskq_ncmds].dc_secno = dr->dr_secno;
+		diskq_cmds[diskq_ncmds].dc_nsecs = nsecs;
+		diskq_ncmds++;
+		diskq_pos = dr->dr_secno;
+	}
+}
+
+// Forget the command under way for the requests 'dr'.
+static void
+diskq_finish(struct DiskReq *dr)
+{
+	int i;
+
+	for (i = 0; i < diskq_ncmds; i++)
+		if (diskq_cmds[i].dc_reqs == dr) {
+			diskq_cmds[i] = diskq_cmds[--diskq_ncmds];
+			return;
+		}
+	panic("diskq: %s finished a command it was not given", bdev->bd_name);
+}
+
+// Queue 'dr' for the disk.  dr_secno, dr_nsecs, dr_buf, dr_write and
+// dr_callback must be set; dr_callback, if not null, is called once
+// the request is done, with dr_result set to 0 or to the error.
+// dr_buf must stay mapped until then.
+void
+diskq_submit(struct DiskReq *dr)
+{
+	struct DiskReq **pdr;
+	int r;
+
+	assert(dr->dr_nsecs > 0 && dr->dr_nsecs <= 256);
+	dr->dr_done = 0;
+	dr->dr_result = 0;
+
+	if (!bdev->bd_maxcmds) {
+		if (dr->dr_write)
+			r = bdev->bd_write(dr->dr_secno, dr->dr_buf, dr->dr_nsecs);
+		else
+			r = bdev->bd_read(dr->dr_secno, dr->dr_buf, dr->dr_nsecs);
+		diskq_complete(dr, r);
+		return;
+	}
+
+	// after any requests for the same sector, so they stay in order
+	for (pdr = &diskq_head; *pdr; pdr = &(*pdr)->dr_next)
+		if ((*pdr)->dr_secno > dr->dr_secno)
+			break;
+	dr->dr_next = *pdr;
+	*pdr = dr;
+	diskq_start();
+}
+
+// Call when the disk's IRQ comes in.  For each command the disk is
+// done with, start the next one and complete the requests in the old.
+void
+diskq_intr(void)
+{
+	struct DiskReq *dr, *next;
+	int r;
+
+	while (diskq_ncmds > 0 && (dr = bdev->bd_done(&r)) != NULL) {
+		diskq_finish(dr);
+		diskq_start();
+
+		for (; dr; dr = next) {
+			next = dr->dr_next;
+			diskq_complete(dr, r);
+		}
+	}
+}
+
+// Wait for request 'dr' to be done.
+// Returns its result: 0 on success, < 0 on error.
+int
+diskq_wait(struct DiskReq *dr)
+{
+	int r;
+
+	while (!dr->dr_done) {
+		if ((r = sys_irq_wait()) < 0)
+			panic("diskq_wait: %e", r);
+		diskq_intr();
+	}
+	return dr->dr_result;
+}
+
+// Wait for every queued request to be done.
+void
+diskq_drain(void)
+{
+	int r;
+
+	while (diskq_ncmds > 0) {
+		if ((r = sys_irq_wait()) < 0)
+			panic("diskq_drain: %e", r);
+		diskq_intr();
+	}
+}
@@ -1,12 +1,105 @@
+#include <inc/x86.h>
 #include <inc/string.h>
 
 #include "fs.h"
 
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+struct Bdev *bdev;		// disk driver
+
+// Where the last search for free blocks left off (see alloc_block_run)
+static uint32_t alloc_next;
+// Files have extents (FS_MAGIC), not block pointers (FS_MAGIC_BLKPTR)
+static bool fs_extents;
 
 void file_flush(struct File *f);
+int file_map_block(struct File *f, uint32_t filebno, uint32_t *diskbno, bool alloc);
 bool block_is_free(uint32_t blockno);
+void write_block(uint32_t blockno);
+static int read_block(uint32_t blockno, char **blk);
+
+// The block cache.
+// Blocks come into memory at their DISKMAP address when they are read,
+// and at most bc_capacity of them stay there.  Making room for another
+// evicts one by the CLOCK algorithm: the hand sweeps bc_blocks[],
+// giving each block whose PTE_A bit is set a second chance (and
+// clearing the bit), and evicts the first one that has not been used
+// since the last sweep, writing it back first if it is dirty.
+// Blocks that other environments have mapped stay, since they and we
+// must see the same page.
+//
+// Remapping a page to clear PTE_A clears PTE_D too, so PTE_DIRTY
+// remembers that the block was dirty.
+#define PTE_DIRTY	0x200	// one of the PTE_AVAIL bits
+
+// Blocks whose page went out as a snapshot (see block_snapshot) are
+// marked PTE_SNAP: whoever has the page keeps its contents, so the
+// block gets a page of its own before it can change.
+#define PTE_SNAP	0x800	// another of the PTE_AVAIL bits
+
+static uint32_t bc_blocks[BCACHE_NBLOCKS];	// Blocks on the clock
+static int bc_nblocks;				// Entries in bc_blocks
+static int bc_hand;				// Next entry to look at
+static int bc_capacity = BCACHE_NBLOCKS;
+
+// Dirty blocks, in increasing order, so that syncing costs time in
+// proportion to their number and writes go out in disk order.
+// Blocks get here when we dirty them on purpose (map_block,
+// file_dirty, the bitmap), and when dirty_harvest finds PTE_D set by
+// writes made through pointers; write_block takes them out.  Only
+// blocks in memory can be dirty, so the set never holds more than the
+// cache.  dirty_since[] holds when each block got into the set, for
+// fs_writeback, and dirty_files[] the file whose data it is, if we
+// know, for file_flush.
+#define NDIRTY_MAX	(BCACHE_NBLOCKS + 2 + DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+static uint32_t dirty_blocks[NDIRTY_MAX];
+static uint32_t dirty_since[NDIRTY_MAX];	// In ms, see now_ms()
+static struct File *dirty_files[NDIRTY_MAX];
+static int ndirty;
+
+// Blocks that may have been written through pointers since
+// dirty_harvest last looked, in increasing order: those read_block
+// brought in or handed out, and those holding a File that changed
+// (see file_touch).  Pointers into other blocks do not outlive the
+// request that got them, so dirty_harvest looks at these blocks and
+// the superblock, not the whole cache.  touched_files[] is like
+// dirty_files[].
+static uint32_t touched_blocks[NDIRTY_MAX];
+static struct File *touched_files[NDIRTY_MAX];
+static int ntouched;
+
+// When fs_writeback last ran, in ms
+static uint32_t wb_last;
+
+// Block I/O in flight.  Each Bio is a disk request (see diskq.c) for
+// a run of consecutive blocks, with a window of BLKIO_MAXBLOCKS pages
+// of its own that holds the run's pages until the disk is done.
+// A block being read stays unmapped at its DISKMAP address until the
+// data is in, so touching it faults and waits (see bc_pgfault).
+// A block being written stays mapped, and the window's reference to
+// its page keeps bc_evict away from it.
+struct Bio {
+	struct DiskReq b_req;		// Must be first
+	uint32_t b_blockno;		// First block
+	uint32_t b_nblocks;		// Blocks, 0 if the Bio is free
+};
+
+#define NBIO		16
+#define BIOVA		(DISKMAP - PTSIZE)	// Windows, one after another
+#define bio_va(b)	((char *) BIOVA + ((b) - bios) * BLKIO_MAXBLOCKS * BLKSIZE)
+
+static struct Bio bios[NBIO];
+
+// Milliseconds since boot
+static uint32_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 // Return the virtual address of this disk block.
 char*
@@ -36,7 +129,7 @@ block_is_mapped(uint32_t blockno)
 bool
 va_is_dirty(void *va)
 {
-	return (vpt[VPN(va)] & PTE_D) != 0;
+	return (vpt[VPN(va)] & (PTE_D | PTE_DIRTY)) != 0;
 }
 
 // Is this block dirty?
@@ -47,13 +140,476 @@ block_is_dirty(uint32_t blockno)
 	return va_is_mapped(va) && va_is_dirty(va);
 }
 
-// Allocate a page to hold the disk block
+// Number of blocks before the first data block: the boot block,
+// the superblock and the bitmap.
+static uint32_t
+nreserved_blocks(void)
+{
+	return 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+}
+
+// The boot block, superblock and bitmap stay in memory for good;
+// 'super' and 'bitmap' point at them, and the block cache uses them.
+static bool
+block_is_pinned(uint32_t blockno)
+{
+	return super == 0 || blockno < nreserved_blocks();
+}
+
+// Return the index of the first of the 'n' sorted block numbers in
+// 'set' that is not less than 'blockno'.
+static int
+blockset_search(const uint32_t *set, int n, uint32_t blockno)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (set[mid] < blockno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Return the index of the first entry in dirty_blocks[] that is
+// not less than 'blockno'.
+static int
+dirty_search(uint32_t blockno)
+{
+	return blockset_search(dirty_blocks, ndirty, blockno);
+}
+
+static bool
+dirty_contains(uint32_t blockno)
+{
+	int i = dirty_search(blockno);
+
+	return i < ndirty && dirty_blocks[i] == blockno;
+}
+
+// Add 'blockno' to the set, as a block of file 'f' unless f is NULL.
+static void
+dirty_add(uint32_t blockno, struct File *f)
+{
+	int i = dirty_search(blockno);
+
+	if (i < ndirty && dirty_blocks[i] == blockno) {
+		if (f)
+			dirty_files[i] = f;
+		return;
+	}
+	if (ndirty == NDIRTY_MAX)
+		panic("too many dirty blocks");
+	memmove(&dirty_blocks[i + 1], &dirty_blocks[i],
+		(ndirty - i) * sizeof(dirty_blocks[0]));
+	memmove(&dirty_since[i + 1], &dirty_since[i],
+		(ndirty - i) * sizeof(dirty_since[0]));
+	memmove(&dirty_files[i + 1], &dirty_files[i],
+		(ndirty - i) * sizeof(dirty_files[0]));
+	dirty_blocks[i] = blockno;
+	dirty_since[i] = now_ms();
+	dirty_files[i] = f;
+	ndirty++;
+}
+
+// Take blocks blockno through blockno + nblocks - 1 out of the set.
+static void
+dirty_remove_range(uint32_t blockno, uint32_t nblocks)
+{
+	int i, j;
+
+	i = dirty_search(blockno);
+	j = dirty_search(blockno + nblocks);
+	if (i == j)
+		return;
+	memmove(&dirty_blocks[i], &dirty_blocks[j],
+		(ndirty - j) * sizeof(dirty_blocks[0]));
+	memmove(&dirty_since[i], &dirty_since[j],
+		(ndirty - j) * sizeof(dirty_since[0]));
+	memmove(&dirty_files[i], &dirty_files[j],
+		(ndirty - j) * sizeof(dirty_files[0]));
+	ndirty -= j - i;
+}
+
+static void
+dirty_remove(uint32_t blockno)
+{
+	dirty_remove_range(blockno, 1);
+}
+
+// Note that the dirty ones among blocks blockno through
+// blockno + nblocks - 1 are data of file 'f'.
+static void
+dirty_claim(uint32_t blockno, uint32_t nblocks, struct File *f)
+{
+	int i;
+
+	for (i = dirty_search(blockno);
+	     i < ndirty && dirty_blocks[i] < blockno + nblocks; i++)
+		dirty_files[i] = f;
+}
+
+// Return the number of entries from dirty_blocks[i] on that are
+// consecutive blocks, up to what one disk command can take.
+static int
+dirty_run(int i)
+{
+	int n;
+
+	for (n = 1; i + n < ndirty && n < BLKIO_MAXBLOCKS; n++)
+		if (dirty_blocks[i + n] != dirty_blocks[i] + n)
+			break;
+	return n;
+}
+
+// Note that block 'blockno', of file 'f' unless f is NULL, may be
+// written through a pointer (see touched_blocks).
+static void
+touched_add(uint32_t blockno, struct File *f)
+{
+	int i = blockset_search(touched_blocks, ntouched, blockno);
+
+	if (i < ntouched && touched_blocks[i] == blockno) {
+		if (f)
+			touched_files[i] = f;
+		return;
+	}
+	if (ntouched == NDIRTY_MAX)
+		panic("too many touched blocks");
+	memmove(&touched_blocks[i + 1], &touched_blocks[i],
+		(ntouched - i) * sizeof(touched_blocks[0]));
+	memmove(&touched_files[i + 1], &touched_files[i],
+		(ntouched - i) * sizeof(touched_files[0]));
+	touched_blocks[i] = blockno;
+	touched_files[i] = f;
+	ntouched++;
+}
+
+// Forget block 'blockno', which is leaving memory.
+static void
+touched_remove(uint32_t blockno)
+{
+	int i = blockset_search(touched_blocks, ntouched, blockno);
+
+	if (i == ntouched || touched_blocks[i] != blockno)
+		return;
+	memmove(&touched_blocks[i], &touched_blocks[i + 1],
+		(ntouched - i - 1) * sizeof(touched_blocks[0]));
+	memmove(&touched_files[i], &touched_files[i + 1],
+		(ntouched - i - 1) * sizeof(touched_files[0]));
+	ntouched--;
+}
+
+// Add the blocks whose pages were written through pointers since we
+// last looked to the dirty set.  This looks at the touched blocks and
+// the superblock, which holds the root directory, only.
+static void
+dirty_harvest(void)
+{
+	int i;
+
+	if (block_is_dirty(1))
+		dirty_add(1, NULL);
+	for (i = 0; i < ntouched; i++)
+		if (block_is_dirty(touched_blocks[i]))
+			dirty_add(touched_blocks[i], touched_files[i]);
+	ntouched = 0;
+}
+
+// Evict a block from the clock.
+// Returns the index of the entry it used in bc_blocks[],
+// or -E_NO_MEM if every block there is in use by another environment.
+static int
+bc_evict(void)
+{
+	uint32_t blockno;
+	char *va;
+	pte_t pte;
+	int i, r, slot;
+
+	// The first sweep clears every PTE_A, so two are enough.
+	for (i = 0; i <= 2 * bc_nblocks; i++) {
+		slot = bc_hand;
+		bc_hand = (bc_hand + 1) % bc_nblocks;
+		blockno = bc_blocks[slot];
+		va = diskaddr(blockno);
+
+		// already gone (see unmap_block), or on its way in
+		if (!va_is_mapped(va)) {
+			if (block_is_busy(blockno))
+				continue;
+			return slot;
+		}
+		if (pageref(va) > 1)
+			continue;
+
+		pte = vpt[VPN(va)];
+		if (pte & PTE_A) {
+			if (pte & PTE_D)
+				pte |= PTE_DIRTY;
+			if ((r = sys_page_map(0, va, 0, va, pte & PTE_USER)) < 0)
+				panic("bc_evict: sys_page_map: %e", r);
+			continue;
+		}
+
+		// the write holds on to the page until the disk has it
+		if (block_is_dirty(blockno) && !block_is_free(blockno))
+			write_blocks_start(blockno, 1);
+		dirty_remove(blockno);
+		touched_remove(blockno);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("bc_evict: sys_page_unmap: %e", r);
+		return slot;
+	}
+	return -E_NO_MEM;
+}
+
+// Put block 'blockno', which is about to be mapped, on the clock,
+// evicting another block if the cache is full.  A block that replaces
+// an evicted one takes its entry, just behind the hand, so it is the
+// last one the hand gets to.
+// Returns 0 on success, < 0 on error.
+static int
+bc_admit(uint32_t blockno)
+{
+	int slot;
+
+	if (block_is_pinned(blockno))
+		return 0;
+	if (bc_nblocks < bc_capacity)
+		slot = bc_nblocks++;
+	else if ((slot = bc_evict()) < 0)
+		return slot;
+	bc_blocks[slot] = blockno;
+	return 0;
+}
+
+// Set the number of blocks the block cache keeps in memory,
+// evicting blocks if there are more than that now.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if nblocks is not between 1 and BCACHE_NBLOCKS.
+//	-E_NO_MEM if too many blocks are in use by other environments.
+int
+bc_set_capacity(int nblocks)
+{
+	int slot;
+
+	if (nblocks < 1 || nblocks > BCACHE_NBLOCKS)
+		return -E_INVAL;
+	bc_capacity = nblocks;
+	while (bc_nblocks > bc_capacity) {
+		if ((slot = bc_evict()) < 0)
+			return slot;
+		bc_blocks[slot] = bc_blocks[--bc_nblocks];
+		bc_hand %= bc_nblocks;
+	}
+	return 0;
+}
+
+// Read in a block that is not in memory when something touches
+// its address.
+static void
+bc_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t addr = utf->utf_fault_va;
+	int r;
+
+	if (addr < DISKMAP || addr >= DISKMAP + DISKSIZE)
+		panic("page fault in fs: va %08x, eip %08x, err %04x",
+		      addr, utf->utf_eip, utf->utf_err);
+	if ((r = read_block((addr - DISKMAP) / BLKSIZE, NULL)) < 0)
+		panic("cannot read block %08x: %e", (addr - DISKMAP) / BLKSIZE, r);
+}
+
+// Allocate a page to hold the disk block.
+// The page starts out dirty, so that the block is written as zeros
+// if it is evicted before anybody writes to it.
 int
 map_block(uint32_t blockno)
 {
+	char *va;
+	int r;
+
 	if (block_is_mapped(blockno))
 		return 0;
-	return sys_page_alloc(0, diskaddr(blockno), PTE_U|PTE_P|PTE_W|PTE_SHARE);
+	if ((r = bc_admit(blockno)) < 0)
+		return r;
+	va = diskaddr(blockno);
+	if ((r = sys_page_alloc(0, va, PTE_U|PTE_P|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	*(volatile char *) va = 0;
+	dirty_add(blockno, NULL);
+	return 0;
+}
+
+// Take a free Bio, waiting for the disk if there is none.
+static struct Bio *
+bio_alloc(void)
+{
+	struct Bio *b;
+
+	while (1) {
+		for (b = bios; b < bios + NBIO; b++)
+			if (b->b_nblocks == 0)
+				return b;
+		diskq_drain();
+	}
+}
+
+// Return the Bio that has block 'blockno' in flight, or NULL if none.
+static struct Bio *
+bio_lookup(uint32_t blockno)
+{
+	struct Bio *b;
+
+	for (b = bios; b < bios + NBIO; b++)
+		if (b->b_nblocks && blockno >= b->b_blockno
+		    && blockno < b->b_blockno + b->b_nblocks)
+			return b;
+	return NULL;
+}
+
+// Is block 'blockno' on its way to or from the disk?
+bool
+block_is_busy(uint32_t blockno)
+{
+	return bio_lookup(blockno) != NULL;
+}
+
+// A read is done: move the pages from the window to their DISKMAP
+// addresses, unless the read failed, or the block was freed or
+// mapped afresh (see map_block) in the meantime.
+static void
+bio_read_done(struct DiskReq *dr)
+{
+	struct Bio *b = (struct Bio *) dr;
+	uint32_t i, blockno;
+	char *va;
+	int r;
+
+	va = bio_va(b);
+	for (i = 0; i < b->b_nblocks; i++, va += BLKSIZE) {
+		blockno = b->b_blockno + i;
+		if (dr->dr_result == 0 && !block_is_mapped(blockno)
+		    && !(bitmap && block_is_free(blockno)))
+			ring_page_map(0, va, 0, diskaddr(blockno),
+				      PTE_U|PTE_P|PTE_W|PTE_SHARE);
+		ring_page_unmap(0, va);
+	}
+	if ((r = ring_flush()) < 0)
+		panic("bio_read_done: %e", r);
+	b->b_nblocks = 0;
+}
+
+// A write is done: let go of the pages.
+static void
+bio_write_done(struct DiskReq *dr)
+{
+	struct Bio *b = (struct Bio *) dr;
+	uint32_t i;
+	int r;
+
+	if (dr->dr_result < 0)
+		panic("ide write error: %e", dr->dr_result);
+	for (i = 0; i < b->b_nblocks; i++)
+		ring_page_unmap(0, bio_va(b) + i * BLKSIZE);
+	if ((r = ring_flush()) < 0)
+		panic("bio_write_done: %e", r);
+	b->b_nblocks = 0;
+}
+
+// Start reading the run of 'n' consecutive disk blocks from 'blockno',
+// none of them in memory or in flight, with a single disk request.
+// Starts fewer if making room for them in the cache fails part way.
+// Returns the number of blocks started, or < 0 on error.
+static int
+read_run(uint32_t blockno, int n)
+{
+	struct Bio *b;
+	char *va;
+	int i;
+
+	// Claim the blocks first, so that bc_evict leaves the cache
+	// entries we take for them alone.
+	b = bio_alloc();
+	b->b_blockno = blockno;
+	b->b_nblocks = n;
+	va = bio_va(b);
+	for (i = 0; i < n; i++)
+		if (bc_admit(blockno + i) < 0
+		    || sys_page_alloc(0, va + i * BLKSIZE, PTE_U|PTE_P|PTE_W) < 0)
+			break;
+	if ((b->b_nblocks = i) == 0)
+		return -E_NO_MEM;
+
+	b->b_req.dr_secno = blockno * BLKSECTS;
+	b->b_req.dr_nsecs = i * BLKSECTS;
+	b->b_req.dr_buf = va;
+	b->b_req.dr_write = 0;
+	b->b_req.dr_callback = bio_read_done;
+	diskq_submit(&b->b_req);
+	return i;
+}
+
+// Start reading the blocks from blockno through blockno + nblocks - 1
+// that are neither in memory nor in flight, with one disk request per
+// run of them of up to BLKIO_MAXBLOCKS blocks, instead of one per
+// block.  Does not wait for them.
+// Returns 0 on success, < 0 on error.
+int
+read_blocks_start(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t endbno = blockno + nblocks;
+	int n, r;
+
+	while (blockno < endbno) {
+		if (block_is_mapped(blockno) || block_is_busy(blockno)) {
+			blockno++;
+			continue;
+		}
+		for (n = 1; blockno + n < endbno && n < BLKIO_MAXBLOCKS; n++)
+			if (block_is_mapped(blockno + n)
+			    || block_is_busy(blockno + n))
+				break;
+		if ((r = read_run(blockno, n)) < 0)
+			return r;
+		blockno += r;
+	}
+	return 0;
+}
+
+// Make sure blocks blockno through blockno + nblocks - 1 are in
+// memory, reading them as read_blocks_start does and waiting for them.
+// A block on its way out to the disk is read back once it is there.
+// Returns 0 on success, < 0 on error.
+int
+read_blocks(uint32_t blockno, uint32_t nblocks)
+{
+	struct Bio *b;
+	uint32_t i;
+	int r;
+
+	if ((r = read_blocks_start(blockno, nblocks)) < 0)
+		return r;
+	for (i = blockno; i < blockno + nblocks; i++)
+		while (!block_is_mapped(i)) {
+			if ((b = bio_lookup(i)) != NULL) {
+				if ((r = diskq_wait(&b->b_req)) < 0
+				    && !b->b_req.dr_write)
+					return r;
+				continue;
+			}
+			if ((r = read_blocks_start(i, blockno + nblocks - i)) < 0)
+				return r;
+			// a read that is already over failed
+			if (!block_is_mapped(i) && !block_is_busy(i))
+				return -E_UNSPECIFIED;
+		}
+	return 0;
 }
 
 // Make sure a particular disk block is loaded into memory.
@@ -76,23 +632,12 @@ read_block(uint32_t blockno, char **blk)
 
 	addr = diskaddr(blockno);
 
-	// the block has already been read
-	if (block_is_mapped(blockno)) {
-		if (blk)
-			*blk = addr;
-		return 0;
-	}
-
-	// otherwise, allocate a new page,
-	// and read it into memory
-	r = sys_page_alloc(0, addr, PTE_U| PTE_P| PTE_W |PTE_SHARE);
-	if (r < 0)
-		return r;
-
-	r = ide_read(blockno * BLKSECTS, addr, BLKSECTS);
-	if (r < 0)
+	// unless it is there already, make room in the cache and read
+	// it into memory
+	if (!block_is_mapped(blockno) && (r = read_blocks(blockno, 1)) < 0)
 		return r;
 
+	touched_add(blockno, NULL);
 	if (blk)
 		*blk = addr;
 
@@ -100,28 +645,77 @@ read_block(uint32_t blockno, char **blk)
 }
 
 // Copy the current contents of the block out to disk.
-// Then clear the PTE_D bit using sys_page_map.
+// Then clear the PTE_D and PTE_DIRTY bits using sys_page_map.
 // Hint: Use ide_write.
 // Hint: Use the PTE_USER constant when calling sys_page_map.
 void
 write_block(uint32_t blockno)
 {
-	char *addr;
-	int r;
-
-	if (!block_is_mapped(blockno))
-		panic("write unmapped block %08x", blockno);
-	
 	// Write the disk block and clear PTE_D.
 	// LAB 5: Your code here.
-	addr = diskaddr(blockno);
-	if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
-		panic("ide write error: %e", r);
-	if ((r = sys_page_map(0, addr, 0, addr, PTE_USER)) < 0)
-		panic("sys page map error: %e", r);
+	write_blocks(blockno, 1);
+}
+
+// Start copying blocks blockno through blockno + nblocks - 1, which
+// must all be in memory, out to disk, with one disk request for each
+// BLKIO_MAXBLOCKS of them, and mark them clean.  Does not wait for
+// the disk: a block written to after this is dirty again, and goes
+// out again later.
+void
+write_blocks_start(uint32_t blockno, uint32_t nblocks)
+{
+	char *addr = diskaddr(blockno), *va;
+	struct Bio *b;
+	uint32_t i, j, n;
+	int r;
+
+	for (i = 0; i < nblocks; i++)
+		if (!va_is_mapped(addr + i * BLKSIZE))
+			panic("write unmapped block %08x", blockno + i);
+
+	for (i = 0; i < nblocks; i += n) {
+		n = MIN(nblocks - i, BLKIO_MAXBLOCKS);
+		b = bio_alloc();
+		va = bio_va(b);
+
+		// clear PTE_D and PTE_DIRTY, and hold on to the pages in
+		// the window, in one trip to the kernel
+		for (j = 0; j < n; j++, addr += BLKSIZE) {
+			ring_page_map(0, addr, 0, addr,
+				      vpt[VPN(addr)] & PTE_USER & ~PTE_DIRTY);
+			ring_page_map(0, addr, 0, va + j * BLKSIZE, PTE_U|PTE_P);
+		}
+		if ((r = ring_flush()) < 0)
+			panic("sys page map error: %e", r);
+
+		b->b_blockno = blockno + i;
+		b->b_nblocks = n;
+		b->b_req.dr_secno = (blockno + i) * BLKSECTS;
+		b->b_req.dr_nsecs = n * BLKSECTS;
+		b->b_req.dr_buf = va;
+		b->b_req.dr_write = 1;
+		b->b_req.dr_callback = bio_write_done;
+		diskq_submit(&b->b_req);
+	}
+	dirty_remove_range(blockno, nblocks);
+}
+
+// Copy blocks blockno through blockno + nblocks - 1, which must all be
+// in memory, out to disk, mark them clean, and wait for the disk.
+void
+write_blocks(uint32_t blockno, uint32_t nblocks)
+{
+	struct Bio *b;
+	uint32_t i;
+
+	write_blocks_start(blockno, nblocks);
+	for (i = blockno; i < blockno + nblocks; i++)
+		while ((b = bio_lookup(i)) != NULL)
+			diskq_wait(&b->b_req);
 }
 
 // Make sure this block is unmapped.
+// Its entry on the clock stays behind, and bc_evict reuses it.
 void
 unmap_block(uint32_t blockno)
 {
@@ -132,11 +726,59 @@ unmap_block(uint32_t blockno)
 
 	assert(block_is_free(blockno) || !block_is_dirty(blockno));
 
+	dirty_remove(blockno);
+	touched_remove(blockno);
 	if ((r = sys_page_unmap(0, diskaddr(blockno))) < 0)
 		panic("unmap_block: sys_mem_unmap: %e", r);
 	assert(!block_is_mapped(blockno));
 }
 
+// Mark the page of block 'blockno', which must be in memory, as a
+// snapshot that other environments may hold on to (see block_unshare).
+// Returns 0 on success, < 0 on error.
+int
+block_snapshot(uint32_t blockno)
+{
+	char *va = diskaddr(blockno);
+	pte_t pte;
+
+	assert(va_is_mapped(va));
+	pte = vpt[VPN(va)];
+	if (pte & PTE_SNAP)
+		return 0;
+	if (pte & PTE_D)
+		pte |= PTE_DIRTY;
+	return sys_page_map(0, va, 0, va, (pte & PTE_USER) | PTE_SNAP);
+}
+
+// Give block 'blockno' a page of its own if its page went out as a
+// snapshot, so that writing the block leaves the snapshot as it was.
+// Anyone else who mapped the block before keeps the old page too.
+// Returns 0 on success, < 0 on error.
+int
+block_unshare(uint32_t blockno)
+{
+	char *va = diskaddr(blockno);
+	pte_t pte;
+	int r;
+
+	if (!va_is_mapped(va) || !(vpt[VPN(va)] & PTE_SNAP))
+		return 0;
+	pte = vpt[VPN(va)];
+	if (pte & PTE_D)
+		pte |= PTE_DIRTY;
+	pte = pte & PTE_USER & ~PTE_SNAP;
+	if (pageref(va) == 1)
+		return sys_page_map(0, va, 0, va, pte);
+
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(UTEMP, va, BLKSIZE);
+	r = sys_page_map(0, UTEMP, 0, va, pte);
+	sys_page_unmap(0, UTEMP);
+	return r;
+}
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -157,26 +799,105 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	dirty_add(2 + blockno / BLKBITSIZE, NULL);
+	// whatever it held need not go to disk any more
+	dirty_remove(blockno);
+	// and a snapshot of it must not be handed out again as the block
+	// that replaces it
+	if (block_is_mapped(blockno)
+	    && (vpt[VPN(diskaddr(blockno))] & PTE_SNAP))
+		unmap_block(blockno);
+}
+
+// Word 'w' of the bitmap, without the bits past the end of the disk
+static uint32_t
+bitmap_word(uint32_t w)
+{
+	if (w == super->s_nblocks / 32)
+		return bitmap[w] & ((1 << (super->s_nblocks % 32)) - 1);
+	return bitmap[w];
+}
+
+// Find the first free block at or after block 'hint', going on from
+// the start of the disk after the end, and allocate it along with the
+// free blocks right after it, up to 'n' blocks in all.  The bitmap is
+// searched a word, or 32 blocks, at a time.  Its blocks only change in
+// memory, and join the dirty set; they go out with the other dirty
+// blocks.
+// Stores the first block in *bno_store.
+// Returns the number of blocks allocated, -E_NO_DISK if none are free.
+int
+alloc_block_run(uint32_t hint, uint32_t n, uint32_t *bno_store)
+{
+	uint32_t nwords, w, i, bits, bno, count;
+
+	if (hint >= super->s_nblocks)
+		hint = 0;
+	nwords = ROUNDUP(super->s_nblocks, 32) / 32;
+
+	// The hint's word goes first, without the blocks before the hint,
+	// and last, with them.
+	w = hint / 32;
+	bits = bitmap_word(w) & (~0U << (hint % 32));
+	for (i = 0; bits == 0; i++) {
+		if (i == nwords)
+			return -E_NO_DISK;
+		w = (w + 1) % nwords;
+		bits = bitmap_word(w);
+	}
+
+	bno = w * 32 + bsf(bits);
+	for (count = 0; count < n && block_is_free(bno + count); count++) {
+		bitmap[(bno + count) / 32] &= ~(1 << ((bno + count) % 32));
+		dirty_add(2 + (bno + count) / BLKBITSIZE, NULL);
+	}
+	alloc_next = bno + count;
+	*bno_store = bno;
+	return count;
 }
 
 // Search the bitmap for a free block and allocate it.
+// The search goes on from where the last one left off.
 // 
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
 int
 alloc_block_num(void)
 {
-	// LAB 5: Your code here.
-	int i;
+	uint32_t bno;
+	int r;
 
-	for (i = 0; i < super->s_nblocks; i++) {
-		if (block_is_free(i)) {
-			bitmap[i / 32] &= ~(1 << (i % 32));
-			write_block(i / BLKBITSIZE + 2);
-			return i;
-		}
-	}
-	return -E_NO_DISK;
+	if ((r = alloc_block_run(alloc_next, 1, &bno)) < 0)
+		return r;
+	return bno;
+}
+
+// Allocate up to 'n' consecutive blocks, starting with the first free
+// one at or after 'hint', and map them into memory (see
+// alloc_block_run).
+// Stores the first block in *bno_store.
+// Returns the number of blocks allocated, or < 0 on error.
+static int
+alloc_blocks(uint32_t hint, uint32_t n, uint32_t *bno_store)
+{
+	uint32_t bno;
+	int r, i, j, count;
+
+	if ((count = alloc_block_run(hint, n, &bno)) < 0)
+		return count;
+
+	r = 0;
+	for (i = 0; i < count; i++)
+		if ((r = map_block(bno + i)) < 0)
+			break;
+	// give back the blocks we could not map
+	for (j = i; j < count; j++)
+		free_block(bno + j);
+	if (i == 0)
+		return r;
+
+	*bno_store = bno;
+	return i;
 }
 
 // Allocate a block -- first find a free block in the bitmap,
@@ -184,16 +905,11 @@ alloc_block_num(void)
 int
 alloc_block(void)
 {
-	int r, bno;
-
-	if ((r = alloc_block_num()) < 0)
-		return r;
-	bno = r;
+	uint32_t bno;
+	int r;
 
-	if ((r = map_block(bno)) < 0) {
-		free_block(bno);
+	if ((r = alloc_blocks(alloc_next, 1, &bno)) < 0)
 		return r;
-	}
 	return bno;
 }
 
@@ -208,7 +924,9 @@ read_super(void)
 		panic("cannot read superblock: %e", r);
 
 	super = (struct Super*) blk;
-	if (super->s_magic != FS_MAGIC)
+	if (super->s_magic == FS_MAGIC)
+		fs_extents = 1;
+	else if (super->s_magic != FS_MAGIC_BLKPTR)
 		panic("bad file system magic number");
 
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
@@ -234,7 +952,6 @@ read_bitmap(void)
 {
 	int r;
 	uint32_t i, n;
-	char *blk;
 
 	// Read the bitmap into memory.
 	// The bitmap consists of one or more blocks.  A single bitmap block
@@ -244,12 +961,11 @@ read_bitmap(void)
 	// Hint: Use read_block.
 
 	// LAB 5: Your code here.
-	n = super->s_nblocks / BLKBITSIZE;
+	n = nreserved_blocks() - 2;
 	cprintf("read the nblocks: %d.\n", n);
-	read_block(2, &blk);
-	bitmap = (uint32_t *)blk;
-	for (i = 1; i < n; i++)
-		read_block(i + 2, NULL);
+	if ((r = read_blocks(2, n)) < 0)
+		panic("read_bitmap: %e", r);
+	bitmap = (uint32_t *) diskaddr(2);
 
 	// Make sure the reserved and root blocks are marked in-use.
 	assert(!block_is_free(0));
@@ -302,11 +1018,22 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
-	if (ide_probe_disk1())
-		ide_set_disk(1);
-	else
-		ide_set_disk(0);
+	// Blocks evicted from the cache come back when touched.
+	set_pgfault_handler(bc_pgfault);
+
+	// Find a JOS disk.  Use a virtio block device if there is one,
+	// since it is the cheapest for an emulator, or else the second
+	// IDE disk (number 1) if available.
+	if (virtio_blk_init() == 0)
+		bdev = &bdev_virtio;
+	else {
+		if (ide_probe_disk1())
+			ide_set_disk(1);
+		else
+			ide_set_disk(0);
+		ide_dma_init();
+		bdev = &bdev_ide;
+	}
 	
 	read_super();
 	check_write_block();
@@ -329,6 +1056,7 @@ fs_init(void)
 //	-E_INVAL if filebno is out of range (it's >= NINDIRECT).
 //
 // Analogy: This is like pgdir_walk for files.  
+// Only for file systems with block pointers; see ext_lookup for extents.
 int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
@@ -360,6 +1088,328 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 	return 0;
 }
 
+// In the 'n' extents at 'ext', find the last one that starts at or
+// before file block 'filebno'.  Returns NULL if there is none.
+static struct Extent *
+ext_find(struct Extent *ext, uint32_t n, uint32_t filebno)
+{
+	uint32_t lo, hi, mid;
+
+	// binary search for the first extent that starts past filebno
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ext[mid].e_fileblk <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 ? &ext[lo - 1] : NULL;
+}
+
+// Copy the extents of file 'f' out to 'ext', which has room for
+// NEXTENT, and return how many are in use.  The File is packed, so
+// the ext_* functions work on such a copy, not on f->f_extents.
+static uint32_t
+ext_get(struct File *f, struct Extent *ext)
+{
+	memmove(ext, f->f_extents, sizeof(f->f_extents));
+	return f->f_nextents;
+}
+
+// Copy the 'n' extents at 'ext' back into file 'f'.
+static void
+ext_put(struct File *f, const struct Extent *ext, uint32_t n)
+{
+	memmove(f->f_extents, ext, sizeof(f->f_extents));
+	f->f_nextents = n;
+}
+
+// Find the extent of file 'f' that holds its 'filebno'th block, reading
+// the extent block it is in if need be, and copy it to '*pe'.
+// Returns 0 on success, -E_NOT_FOUND if the block is not allocated,
+// or another error reading the extent block.
+static int
+ext_lookup(struct File *f, uint32_t filebno, struct Extent *pe)
+{
+	struct Extent fext[NEXTENT], *e;
+	char *blk;
+	int r;
+
+	e = ext_find(fext, ext_get(f, fext), filebno);
+	if (e && f->f_extdepth > 0) {
+		if ((r = read_block(e->e_diskblk, &blk)) < 0)
+			return r;
+		e = ext_find((struct Extent *) blk, e->e_nblocks, filebno);
+	}
+	if (!e || filebno >= e->e_fileblk + e->e_nblocks)
+		return -E_NOT_FOUND;
+	*pe = *e;
+	return 0;
+}
+
+// Add the run of 'n' blocks from disk block 'diskbno' as file blocks
+// 'filebno' on to the '*cnt' sorted extents at 'ext', which can hold
+// 'max'.  A run that continues an extent before or after it, both in
+// the file and on disk, grows that extent instead of taking a new one.
+// Returns 0 on success, -E_NO_DISK if a new extent is needed and there
+// is no room for it.
+static int
+ext_insert(struct Extent *ext, uint32_t *cnt, uint32_t max,
+	   uint32_t filebno, uint32_t diskbno, uint32_t n)
+{
+	struct Extent *prev, *next;
+	int i;
+
+	for (i = *cnt; i > 0 && ext[i - 1].e_fileblk > filebno; i--)
+		;
+	prev = i > 0 ? &ext[i - 1] : NULL;
+	next = i < *cnt ? &ext[i] : NULL;
+	if (next && (filebno + n != next->e_fileblk
+		     || diskbno + n != next->e_diskblk))
+		next = NULL;
+
+	if (prev && prev->e_fileblk + prev->e_nblocks == filebno
+	    && prev->e_diskblk + prev->e_nblocks == diskbno) {
+		prev->e_nblocks += n;
+		if (next) {
+			prev->e_nblocks += next->e_nblocks;
+			memmove(next, next + 1, (ext + *cnt - (next + 1)) * sizeof(*next));
+			(*cnt)--;
+		}
+		return 0;
+	}
+	if (next) {
+		next->e_fileblk = filebno;
+		next->e_diskblk = diskbno;
+		next->e_nblocks += n;
+		return 0;
+	}
+
+	if (*cnt == max)
+		return -E_NO_DISK;
+	memmove(&ext[i + 1], &ext[i], (*cnt - i) * sizeof(*ext));
+	ext[i].e_fileblk = filebno;
+	ext[i].e_diskblk = diskbno;
+	ext[i].e_nblocks = n;
+	(*cnt)++;
+	return 0;
+}
+
+// Allocate a block for extents and set '*pext' to point at it.
+// Returns the block number, or < 0 on error.
+static int
+ext_alloc_block(struct Extent **pext)
+{
+	char *blk;
+	int bno, r;
+
+	if ((bno = alloc_block()) < 0)
+		return bno;
+	if ((r = read_block(bno, &blk)) < 0) {
+		free_block(bno);
+		return r;
+	}
+	*pext = (struct Extent *) blk;
+	return bno;
+}
+
+// Record that file blocks 'filebno' through 'filebno + n - 1' of 'f',
+// which have none yet, are the 'n' disk blocks from 'diskbno' on.
+// Once f->f_extents is full, the extents move to an extent block, and
+// an extent block that fills up is split in two.
+// Returns 0 on success, -E_NO_DISK if there is no room for another
+// extent, or another error allocating or reading an extent block.
+static int
+ext_add(struct File *f, uint32_t filebno, uint32_t diskbno, uint32_t n)
+{
+	struct Extent fext[NEXTENT], *idx, *ext, *newext;
+	uint32_t nidx;
+	int bno, r;
+
+	nidx = ext_get(f, fext);
+	if (f->f_extdepth == 0) {
+		if (ext_insert(fext, &nidx, NEXTENT, filebno, diskbno, n) == 0) {
+			ext_put(f, fext, nidx);
+			return 0;
+		}
+		if ((bno = ext_alloc_block(&newext)) < 0)
+			return bno;
+		memmove(newext, fext, sizeof(fext));
+		fext[0].e_diskblk = bno;
+		fext[0].e_nblocks = nidx;
+		nidx = 1;
+		ext_put(f, fext, nidx);
+		f->f_extdepth = 1;
+	}
+
+	// the extent block whose extents the run goes among
+	if ((idx = ext_find(fext, nidx, filebno)) == NULL)
+		idx = &fext[0];
+	if ((r = read_block(idx->e_diskblk, (char **) &ext)) < 0)
+		return r;
+	if (ext_insert(ext, &idx->e_nblocks, NBLKEXTENT,
+		       filebno, diskbno, n) == 0) {
+		idx->e_fileblk = ext[0].e_fileblk;
+		ext_put(f, fext, nidx);
+		return 0;
+	}
+
+	// move the upper half of the full block to a new one after it
+	if (nidx == NEXTENT)
+		return -E_NO_DISK;
+	if ((bno = ext_alloc_block(&newext)) < 0)
+		return bno;
+	memmove(newext, &ext[NBLKEXTENT / 2],
+		(NBLKEXTENT - NBLKEXTENT / 2) * sizeof(*ext));
+	memmove(idx + 2, idx + 1, (fext + nidx - (idx + 1)) * sizeof(*idx));
+	nidx++;
+	idx->e_nblocks = NBLKEXTENT / 2;
+	idx[1].e_fileblk = newext[0].e_fileblk;
+	idx[1].e_diskblk = bno;
+	idx[1].e_nblocks = NBLKEXTENT - NBLKEXTENT / 2;
+	ext_put(f, fext, nidx);
+	return ext_add(f, filebno, diskbno, n);
+}
+
+// Free the blocks from file block 'nblocks' on in the '*cnt' extents at
+// 'ext', and drop the extents that are left with none.
+static void
+ext_trim(struct Extent *ext, uint32_t *cnt, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t keep, i;
+
+	while (*cnt > 0) {
+		e = &ext[*cnt - 1];
+		keep = 0;
+		if (e->e_fileblk < nblocks)
+			keep = MIN(e->e_nblocks, nblocks - e->e_fileblk);
+		for (i = keep; i < e->e_nblocks; i++)
+			free_block(e->e_diskblk + i);
+		e->e_nblocks = keep;
+		if (keep > 0)
+			break;
+		(*cnt)--;
+	}
+}
+
+// Free the blocks of file 'f' from file block 'nblocks' on, along with
+// the extent blocks that are left empty.  Extents that fit in the File
+// again move back into it.
+static void
+ext_truncate(struct File *f, uint32_t nblocks)
+{
+	struct Extent fext[NEXTENT], *idx;
+	uint32_t nidx, bno, n;
+	char *blk;
+	int r;
+
+	nidx = ext_get(f, fext);
+	if (f->f_extdepth == 0) {
+		ext_trim(fext, &nidx, nblocks);
+		ext_put(f, fext, nidx);
+		return;
+	}
+
+	while (nidx > 0) {
+		idx = &fext[nidx - 1];
+		if ((r = read_block(idx->e_diskblk, &blk)) < 0)
+			panic("ext_truncate: read extent block %d: %e",
+			      idx->e_diskblk, r);
+		ext_trim((struct Extent *) blk, &idx->e_nblocks, nblocks);
+		if (idx->e_nblocks > 0)
+			break;
+		free_block(idx->e_diskblk);
+		nidx--;
+	}
+
+	if (nidx == 1 && fext[0].e_nblocks <= NEXTENT) {
+		bno = fext[0].e_diskblk;
+		n = fext[0].e_nblocks;
+		if ((r = read_block(bno, &blk)) < 0)
+			panic("ext_truncate: read extent block %d: %e", bno, r);
+		memmove(fext, blk, n * sizeof(struct Extent));
+		nidx = n;
+		free_block(bno);
+	} else if (nidx > 0) {
+		ext_put(f, fext, nidx);
+		return;
+	}
+	ext_put(f, fext, nidx);
+	f->f_extdepth = 0;
+}
+
+// Is file block 'filebno' of 'f' one that could have a disk block,
+// but has none yet?
+static bool
+file_block_missing(struct File *f, uint32_t filebno)
+{
+	struct Extent e;
+	uint32_t *ptr;
+
+	if (fs_extents)
+		return ext_lookup(f, filebno, &e) == -E_NOT_FOUND;
+	return file_block_walk(f, filebno, &ptr, 0) == 0 && *ptr == 0;
+}
+
+// Note that file 'f' itself changed, so that dirty_harvest looks at
+// the block holding it, which is data of f's directory (or the
+// superblock, for the root).
+static void
+file_touch(struct File *f)
+{
+	touched_add(((uintptr_t) f - DISKMAP) / BLKSIZE, f->f_dir);
+}
+
+// Allocate the filebno'th block of file 'f', which has none yet, in
+// one go with the blocks after it that are inside the file and have
+// none either, up to BLKIO_MAXBLOCKS in all.  They go right after the
+// block before them in the file if there is room, so that a file
+// written from start to end ends up in consecutive blocks, which
+// with extents means in one extent.
+// With block pointers, the slot of the filebno'th block must be there
+// already.
+// Returns 0 on success, < 0 on error.
+static int
+file_alloc_blocks(struct File *f, uint32_t filebno)
+{
+	uint32_t *ptr, hint, bno, endbno, n;
+	int r, i;
+
+	hint = alloc_next;
+	if (filebno > 0 && file_map_block(f, filebno - 1, &bno, 0) == 0)
+		hint = bno + 1;
+
+	endbno = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+	for (n = 1; n < BLKIO_MAXBLOCKS && filebno + n < endbno; n++)
+		if (!file_block_missing(f, filebno + n))
+			break;
+
+	if ((r = alloc_blocks(hint, n, &bno)) < 0)
+		return r;
+	if (fs_extents) {
+		if ((i = ext_add(f, filebno, bno, r)) < 0) {
+			while (r-- > 0)
+				free_block(bno + r);
+			return i;
+		}
+	} else {
+		// Mapping the new blocks may have evicted the indirect
+		// block, so look up each slot again.
+		for (i = 0; i < r; i++) {
+			if (file_block_walk(f, filebno + i, &ptr, 0) < 0)
+				panic("file_alloc_blocks: lost block %d",
+				      filebno + i);
+			*ptr = bno + i;
+		}
+	}
+	dirty_claim(bno, r, f);
+	file_touch(f);
+	return 0;
+}
+
 // Set '*diskbno' to the disk block number for the 'filebno'th block
 // in file 'f'.
 // If 'alloc' is set and the block does not exist, allocate it.
@@ -374,21 +1424,36 @@ file_map_block(struct File *f, uint32_t filebno, uint32_t *diskbno, bool alloc)
 {
 	int r;
 	uint32_t *ptr;
+	struct Extent e;
+
+	if (fs_extents) {
+		if (filebno >= MAXFILESIZE / BLKSIZE)
+			return -E_INVAL;
+		if ((r = ext_lookup(f, filebno, &e)) == -E_NOT_FOUND && alloc) {
+			if ((r = file_alloc_blocks(f, filebno)) < 0)
+				return r;
+			r = ext_lookup(f, filebno, &e);
+		}
+		if (r < 0)
+			return r;
+		*diskbno = e.e_diskblk + (filebno - e.e_fileblk);
+		return 0;
+	}
 
 	if ((r = file_block_walk(f, filebno, &ptr, alloc)) < 0)
 		return r;
 	if (*ptr == 0) {
 		if (alloc == 0)
 			return -E_NOT_FOUND;
-		if ((r = alloc_block()) < 0)
+		if ((r = file_alloc_blocks(f, filebno)) < 0)
 			return r;
-		*ptr = r;
 	}
 	*diskbno = *ptr;
 	return 0;
 }
 
 // Remove a block from file f.  If it's not there, just silently succeed.
+// Only for file systems with block pointers.
 // Returns 0 on success, < 0 on error.
 int
 file_clear_block(struct File *f, uint32_t filebno)
@@ -421,9 +1486,59 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 		return r;
 	if ((r = read_block(diskbno, blk)) < 0)
 		return r;
+	touched_add(diskbno, f);
+	return 0;
+}
+
+// Bring blocks filebno through filebno + n - 1 of file 'f' into the
+// cache, ahead of their use, so that a sequential reader does not wait
+// on the disk for each block.  Blocks already in memory and holes are
+// skipped; the rest go in through read_blocks_start, one call per run
+// of blocks that are consecutive on disk.  Reads at most half the
+// cache, and does not wait for the disk.
+// Returns 0 on success, < 0 on error.
+int
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t endbno, diskbno, runbno;
+	int r, runlen;
+
+	endbno = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+	n = MIN(n, (uint32_t) MAX(bc_capacity / 2, 1));
+	if (filebno >= endbno)
+		return 0;
+	endbno = MIN(endbno, filebno + n);
+
+	runbno = runlen = 0;
+	for (; filebno <= endbno; filebno++) {
+		if (filebno == endbno
+		    || file_map_block(f, filebno, &diskbno, 0) < 0)
+			diskbno = 0;
+		if (runlen > 0 && diskbno != runbno + runlen) {
+			if ((r = read_blocks_start(runbno, runlen)) < 0)
+				return r;
+			runlen = 0;
+		}
+		if (diskbno == 0)
+			continue;
+		if (runlen++ == 0)
+			runbno = diskbno;
+	}
 	return 0;
 }
 
+// Is the filebno'th block of file 'f' on its way in from the disk,
+// so that file_get_block would wait for it?
+bool
+file_block_pending(struct File *f, uint32_t filebno)
+{
+	uint32_t diskbno;
+
+	if (file_map_block(f, filebno, &diskbno, 0) < 0)
+		return 0;
+	return !block_is_mapped(diskbno) && block_is_busy(diskbno);
+}
+
 // Mark the offset/BLKSIZE'th block dirty in file f
 // by writing its first word to itself.  
 int
@@ -435,6 +1550,7 @@ file_dirty(struct File *f, off_t offset)
 	if ((r = file_get_block(f, offset/BLKSIZE, &blk)) < 0)
 		return r;
 	*(volatile char*)blk = *(volatile char*)blk;
+	dirty_add(((uintptr_t) blk - DISKMAP) / BLKSIZE, f);
 	return 0;
 }
 
@@ -606,6 +1722,7 @@ file_open(const char *path, struct File **pf)
 // been allocated (f->f_indirect != 0), then free the indirect block too.
 // (Remember to clear the f->f_indirect pointer so you'll know
 // whether it's valid!)
+// With extents, ext_truncate does all of that.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
@@ -621,6 +1738,10 @@ file_truncate_blocks(struct File *f, off_t newsize)
 		;
 	new_nblocks /= BLKSIZE;
 	cprintf("truncate from %d[%d] -> %d[%d].\n", f->f_size, new_nblocks, f->f_size, old_nblocks);
+	if (fs_extents) {
+		ext_truncate(f, new_nblocks);
+		return;
+	}
 	for (bno = new_nblocks; bno <= old_nblocks; bno++)
 		if ((r = file_clear_block(f, bno)) < 0)
 			panic("file clear block error: %e\n", r);
@@ -639,45 +1760,108 @@ file_truncate_blocks(struct File *f, off_t newsize)
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	if (newsize > (fs_extents ? MAXFILESIZE : MAXBLKPTRSIZE))
+		return -E_NO_DISK;
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
+	file_touch(f);
 	if (f->f_dir)
 		file_flush(f->f_dir);
 	return 0;
 }
 
 // Flush the contents of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
-//
-// Hint: use file_map_block, block_is_dirty, and write_block.
+// Walk the dirty set and write out the blocks that are f's data, with
+// one disk request per run of them that is consecutive on disk, so the
+// cost goes with the number of dirty blocks, not the size of the file.
+// The file's indirect block or extent blocks go too, if they are
+// dirty, and so do the bitmap blocks, if allocating blocks changed
+// them, so the disk never has a file using a block that is free in its
+// bitmap.  The writes all go to the disk queue at once, and then we
+// wait for it.
 void
 file_flush(struct File *f)
 {
 	// LAB 5: Your code here.
-	int i, n, r;
-	uint32_t diskbno;
-
-	for (i = 0; i < f->f_size; i += BLKSIZE) {
-		if ((r = file_map_block(f, i/BLKSIZE, &diskbno, 0)) < 0)
-			panic("file map block error: %e", r);
-		if (block_is_dirty(diskbno))
-			write_block(diskbno);
-		//if (f->f_indirect && block_is_dirty(f->f_indirect))
-			//write_block(f->f_indirect);
+	int i, n;
+	uint32_t nreserved;
+
+	dirty_harvest();
+	// write_blocks_start takes the run out of the set, and the
+	// next entry moves up to i
+	i = 0;
+	while (i < ndirty) {
+		if (dirty_files[i] != f) {
+			i++;
+			continue;
+		}
+		for (n = 1; i + n < ndirty && n < BLKIO_MAXBLOCKS
+			     && dirty_files[i + n] == f
+			     && dirty_blocks[i + n] == dirty_blocks[i] + n; n++)
+			/* do nothing */;
+		write_blocks_start(dirty_blocks[i], n);
 	}
+	if (fs_extents) {
+		for (i = 0; f->f_extdepth > 0 && i < f->f_nextents; i++)
+			if (dirty_contains(f->f_extents[i].e_diskblk))
+				write_blocks_start(f->f_extents[i].e_diskblk, 1);
+	} else if (f->f_indirect && dirty_contains(f->f_indirect))
+		write_blocks_start(f->f_indirect, 1);
+
+	nreserved = nreserved_blocks();
+	while ((i = dirty_search(2)) < ndirty && dirty_blocks[i] < nreserved)
+		write_blocks_start(dirty_blocks[i],
+				   MIN(dirty_run(i), nreserved - dirty_blocks[i]));
+	diskq_drain();
 }
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system: write out every dirty block,
+// in disk order, with one disk request per run of consecutive blocks,
+// and wait for the disk.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 0; i < super->s_nblocks; i++)
-		if (block_is_dirty(i))
-			write_block(i);
+	dirty_harvest();
+	while (ndirty > 0)
+		write_blocks_start(dirty_blocks[0], dirty_run(0));
+	diskq_drain();
+}
+
+// Is it time for fs_writeback to run again?
+bool
+fs_writeback_due(void)
+{
+	return now_ms() - wb_last >= WB_INTERVAL;
+}
+
+// Write back dirty blocks in the background, so that they do not stay
+// in memory only for long.  The server calls this every WB_INTERVAL ms
+// or so.  Every run of consecutive dirty blocks with a block that has
+// been dirty for WB_MAXAGE ms or more goes out, and all dirty blocks
+// go out if there are more than WB_MAXDIRTY of them.  Nothing waits
+// for the writes.
+void
+fs_writeback(void)
+{
+	uint32_t now;
+	int i, j, n;
+	bool old;
+
+	dirty_harvest();
+	now = wb_last = now_ms();
+
+	i = 0;
+	while (i < ndirty) {
+		n = dirty_run(i);
+		old = ndirty > WB_MAXDIRTY;
+		for (j = i; j < i + n && !old; j++)
+			old = now - dirty_since[j] >= WB_MAXAGE;
+		if (old)
+			write_blocks_start(dirty_blocks[i], n);
+		else
+			i += n;
+	}
 }
 
 // Close a file.
@@ -702,6 +1886,7 @@ file_remove(const char *path)
 	file_truncate_blocks(f, 0);
 	f->f_name[0] = '\0';
 	f->f_size = 0;
+	file_touch(f);
 	if (f->f_dir)
 		file_flush(f->f_dir);
 
@@ -3,24 +3,125 @@
 
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
+#define BLKIO_MAXBLOCKS	(256 / BLKSECTS)	// most blocks one disk command moves
 
 /* Disk block n, when in memory, is mapped into the file system
- * server's address space at DISKMAP + (n*BLKSIZE). */
+ * server's address space at DISKMAP + (n*BLKSIZE).
+ * Touching the address of a block that is not in memory reads it in,
+ * so code can use blocks through pointers as if all of them were. */
 #define DISKMAP		0x10000000
 
+/* Blocks the block cache keeps in memory at once, by default and at
+ * most.  The boot block, superblock and bitmap do not count. */
+#define BCACHE_NBLOCKS	256
+
+/* Background write-back of dirty blocks (see fs_writeback) */
+#define WB_INTERVAL	500		// ms between write-backs
+#define WB_MAXAGE	3000		// ms a block may stay dirty
+#define WB_MAXDIRTY	(BCACHE_NBLOCKS / 4) // more dirty blocks go out now
+
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* PCI configuration space registers and fields (see pci.c) */
+#define PCI_ID		0x00		// Vendor and device ID
+#define PCI_COMMAND	0x04		// Command and status
+#define PCI_CLASSREG	0x08		// Class, subclass, prog. if, revision
+#define PCI_BHLC	0x0C		// BIST, header type, latency, cache line
+#define PCI_BAR(n)	(0x10 + 4 * (n))	// Base address register n
+#define PCI_INTR	0x3C		// Interrupt pin and line
+
+#define PCI_VENDOR(id)		((id) & 0xFFFF)
+#define PCI_DEVICE(id)		((id) >> 16)
+#define PCI_CLASS(cr)		((cr) >> 24)
+#define PCI_SUBCLASS(cr)	(((cr) >> 16) & 0xFF)
+#define PCI_PROGIF(cr)		(((cr) >> 8) & 0xFF)
+#define PCI_HDR_MULTIFN(bhlc)	((bhlc) & 0x00800000)
+#define PCI_INTR_LINE(ir)	((ir) & 0xFF)
+
+#define PCI_COMMAND_IO		0x1	// Respond to I/O space accesses
+#define PCI_COMMAND_MASTER	0x4	// Bus mastering
+
+#define PCI_CLASS_STORAGE	0x01
+#define PCI_SUBCLASS_IDE	0x01
+
+struct PciFunc {
+	uint32_t pf_bus;
+	uint32_t pf_dev;
+	uint32_t pf_func;
+	uint16_t pf_vendor;
+	uint16_t pf_device;
+	uint8_t pf_progif;
+};
+
+/* pci.c */
+uint32_t pci_conf_read(const struct PciFunc *f, uint32_t off);
+void	pci_conf_write(const struct PciFunc *f, uint32_t off, uint32_t v);
+int	pci_find_class(uint8_t class, uint8_t subclass, struct PciFunc *f);
+int	pci_find_device(uint16_t vendor, uint16_t device, struct PciFunc *f);
+
+/* A request in the disk request queue (see diskq.c) */
+struct DiskReq {
+	uint32_t dr_secno;		// First sector
+	uint32_t dr_nsecs;		// Sectors, at most 256
+	void *dr_buf;			// Buffer, dr_nsecs * SECTSIZE bytes
+	bool dr_write;			// Write to the disk, not read from it
+	void (*dr_callback)(struct DiskReq *dr); // Called when done, or NULL
+	bool dr_done;			// Done
+	int dr_result;			// 0 or error, once done
+	struct DiskReq *dr_next;	// Next in the queue or command
+};
+
+/* A disk driver, as the disk request queue sees it.
+ * A driver with bd_maxcmds == 0 only moves sectors with bd_read and
+ * bd_write, which are done when they return.  Otherwise bd_start
+ * starts a command for a chain of requests, linked by dr_next, for
+ * consecutive sectors in the same direction, 256 at most; the device
+ * interrupts on IRQ bd_irq when it is done, and then bd_done hands
+ * back the chain of each finished command. */
+struct Bdev {
+	const char *bd_name;
+	int bd_irq;		// IRQ the device interrupts on
+	int bd_maxcmds;		// Commands it can have going at once
+	int bd_maxreqs;		// Requests one command can take
+	int (*bd_read)(uint32_t secno, void *dst, size_t nsecs);
+	int (*bd_write)(uint32_t secno, const void *src, size_t nsecs);
+	// Returns 0 on success, -E_INVAL if a buffer is not mapped,
+	// -E_NO_MEM if there is no room for the command until one of
+	// those under way is done
+	int (*bd_start)(struct DiskReq *dr, uint32_t nsecs);
+	// Returns NULL if no more commands are done; otherwise sets
+	// *result to 0 or the error for the whole command
+	struct DiskReq *(*bd_done)(int *result);
+};
+
+// The disk the file system is on (see fs_init)
+extern struct Bdev *bdev;
+
 /* ide.c */
+extern struct Bdev bdev_ide;
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+bool	ide_dma_init(void);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* virtio.c */
+extern struct Bdev bdev_virtio;
+int	virtio_blk_init(void);
+
+/* diskq.c */
+void	diskq_submit(struct DiskReq *dr);
+void	diskq_intr(void);
+int	diskq_wait(struct DiskReq *dr);
+void	diskq_drain(void);
+
 /* fs.c */
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_readahead(struct File *f, uint32_t file_blockno, uint32_t n);
+bool	file_block_pending(struct File *f, uint32_t file_blockno);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 void	file_close(struct File *f);
@@ -28,10 +129,43 @@ int	file_remove(const char *path);
 void	fs_init(void);
 int	file_dirty(struct File *f, off_t offset);
 void	fs_sync(void);
+bool	fs_writeback_due(void);
+void	fs_writeback(void);
 
+extern struct Super *super;
 extern uint32_t *bitmap;
 int	map_block(uint32_t);
 int	alloc_block(void);
+int	alloc_block_run(uint32_t hint, uint32_t n, uint32_t *bno_store);
+int	bc_set_capacity(int nblocks);
+bool	va_is_mapped(void *va);
+bool	block_is_mapped(uint32_t blockno);
+int	read_blocks(uint32_t blockno, uint32_t nblocks);
+int	read_blocks_start(uint32_t blockno, uint32_t nblocks);
+void	write_blocks(uint32_t blockno, uint32_t nblocks);
+void	write_blocks_start(uint32_t blockno, uint32_t nblocks);
+bool	block_is_busy(uint32_t blockno);
+int	block_snapshot(uint32_t blockno);
+int	block_unshare(uint32_t blockno);
+
+/* serv.c */
+struct OpenFile {
+	uint32_t o_fileid;	// file id
+	struct File *o_file;	// mapped descriptor for open file
+	int o_mode;		// open mode
+	struct Fd *o_fd;	// Fd page
+	uint32_t o_ra_next;	// block a sequential reader maps next
+	uint32_t o_ra_window;	// blocks to read ahead, 0 if not sequential
+};
+
+// What serve_map returns for a request it parked: there is nothing
+// to reply yet.
+#define SERVE_PARKED	1
+
+int	openfile_alloc(struct OpenFile **o);
+int	serve_map(envid_t envid, struct Fsreq_map *rq, struct IpcSeg *segs,
+		  int *nsegs_store);
+int	serve_unpark(void);
 
 /* test.c */
 void	fs_test(void);
@@ -105,9 +105,13 @@ swizzlefile(struct File *f)
 		return;
 	swizzle((uint32_t*) &f->f_size);
 	swizzle(&f->f_type);
-	for (i = 0; i < NDIRECT; i++)
-		swizzle(&f->f_direct[i]);
-	swizzle(&f->f_indirect);
+	swizzle(&f->f_nextents);
+	swizzle(&f->f_extdepth);
+	for (i = 0; i < NEXTENT; i++) {
+		swizzle(&f->f_extents[i].e_fileblk);
+		swizzle(&f->f_extents[i].e_diskblk);
+		swizzle(&f->f_extents[i].e_nblocks);
+	}
 }
 
 void
@@ -251,24 +255,103 @@ opendisk(const char *name)
 	strcpy(super.s_root.f_name, "/");
 }
 
+// Add block bno, the next block of a file, to the *n extents at ext:
+// grow the last extent if bno follows it on disk, or start a new one.
+// Returns 0, or -1 if that takes more than max extents.
+int
+extappend(struct Extent *ext, uint32_t *n, uint32_t max, int nblk, uint32_t bno)
+{
+	struct Extent *e;
+
+	if (*n > 0) {
+		e = &ext[*n - 1];
+		if (e->e_diskblk + e->e_nblocks == bno) {
+			e->e_nblocks++;
+			return 0;
+		}
+	}
+	if (*n == max)
+		return -1;
+	e = &ext[(*n)++];
+	e->e_fileblk = nblk;
+	e->e_diskblk = bno;
+	e->e_nblocks = 1;
+	return 0;
+}
+
+// Store b as block nblk of f, which has blocks 0 through nblk - 1.
+// Once the File has no room for another extent, its extents move to
+// an extent block (see struct File).
+// The File is packed, so this works on a copy of its extents.
 void
 storeblk(struct File *f, struct Block *b, int nblk)
 {
-	if (nblk < NDIRECT)
-		f->f_direct[nblk] = b->bno;
-	else if (nblk < NINDIRECT) {
-		struct Block *bindir;
-		if (f->f_indirect == 0) {
-			bindir = getblk(nextb++, 1, BLOCK_BITS);
-			f->f_indirect = bindir->bno;
-		} else
-			bindir = getblk(f->f_indirect, 0, BLOCK_BITS);
-		((uint32_t*)bindir->buf)[nblk] = b->bno;
-		putblk(bindir);
-	} else {
-		fprintf(stderr, "file too large\n");
-		abort();
+	struct Block *bext;
+	struct Extent ext[NEXTENT], *e;
+	uint32_t n;
+
+	memmove(ext, f->f_extents, sizeof(ext));
+	n = f->f_nextents;
+	if (f->f_extdepth == 0) {
+		if (extappend(ext, &n, NEXTENT, nblk, b->bno) == 0)
+			goto out;
+		bext = getblk(nextb++, 1, BLOCK_BITS);
+		memmove(bext->buf, ext, sizeof(ext));
+		ext[0].e_diskblk = bext->bno;
+		ext[0].e_nblocks = n;
+		n = 1;
+		f->f_extdepth = 1;
+		putblk(bext);
+	}
+
+	e = &ext[n - 1];
+	bext = getblk(e->e_diskblk, 0, BLOCK_BITS);
+	if (extappend((struct Extent *) bext->buf, &e->e_nblocks, NBLKEXTENT,
+		      nblk, b->bno) < 0) {
+		putblk(bext);
+		if (n == NEXTENT) {
+			fprintf(stderr, "file too fragmented\n");
+			abort();
+		}
+		bext = getblk(nextb++, 1, BLOCK_BITS);
+		e = &ext[n++];
+		e->e_fileblk = nblk;
+		e->e_diskblk = bext->bno;
+		e->e_nblocks = 0;
+		extappend((struct Extent *) bext->buf, &e->e_nblocks, NBLKEXTENT,
+			  nblk, b->bno);
+	}
+	putblk(bext);
+out:
+	memmove(f->f_extents, ext, sizeof(ext));
+	f->f_nextents = n;
+}
+
+// Return the disk block of block nblk of f.
+uint32_t
+lookupblk(struct File *f, int nblk)
+{
+	struct Block *bext;
+	struct Extent fext[NEXTENT], *ext;
+	uint32_t i, n, bno;
+
+	memmove(fext, f->f_extents, sizeof(fext));
+	ext = fext;
+	n = f->f_nextents;
+	bext = NULL;
+	if (f->f_extdepth > 0) {
+		for (i = n - 1; i > 0 && f->f_extents[i].e_fileblk > nblk; i--)
+			;
+		bext = getblk(f->f_extents[i].e_diskblk, 0, BLOCK_BITS);
+		ext = (struct Extent *) bext->buf;
+		n = f->f_extents[i].e_nblocks;
 	}
+	for (i = n - 1; i > 0 && ext[i].e_fileblk > nblk; i--)
+		;
+	bno = ext[i].e_diskblk + (nblk - ext[i].e_fileblk);
+	if (bext)
+		putblk(bext);
+	return bno;
 }
 
 struct File *
@@ -278,12 +361,8 @@ allocfile(struct File *dirf, const char *name, struct Block **dirb)
 	int nblk, i;
 
 	nblk = (int)((dirf->f_size + BLKSIZE - 1) / BLKSIZE) - 1;
-	if (nblk >= NDIRECT) {
-		struct Block *idirb = getblk(dirf->f_indirect, 0, BLOCK_BITS);
-		*dirb = getblk(((uint32_t*)idirb->buf) [nblk], 0, BLOCK_DIR);
-		putblk(idirb);
-	} else if (nblk >= 0)
-		*dirb = getblk(dirf->f_direct[nblk], 0, BLOCK_DIR);
+	if (nblk >= 0)
+		*dirb = getblk(lookupblk(dirf, nblk), 0, BLOCK_DIR);
 	else
 		goto new_dirb;
 
@@ -1,5 +1,6 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code: PIO, or bus-master DMA with interrupt
+ * completion when the controller supports it (see ide_dma_init).
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +13,61 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// Bus-master IDE registers (PIIX and compatibles), as offsets from
+// the I/O base in BAR 4.  These are the primary channel's.
+#define BM_CMD		0	// Command
+#define BM_STATUS	2	// Status
+#define BM_PRDT		4	// Physical address of the PRD table
+
+#define BM_CMD_START	0x01	// Start the transfer
+#define BM_CMD_READ	0x08	// Transfer from the disk to memory
+#define BM_STATUS_ERR	0x02	// Transfer failed; write 1 to clear
+#define BM_STATUS_INTR	0x04	// Drive interrupted; write 1 to clear
+
+// A physical region descriptor: one piece of a DMA buffer.
+// The PRD table lists them, and must not cross a 64KB boundary,
+// so it has a page of its own.
+struct IdePrd {
+	uint32_t prd_addr;	// Physical address
+	uint16_t prd_len;	// Bytes, 0 for 64KB
+	uint16_t prd_flags;	// PRD_EOT on the last entry
+};
+
+#define PRD_EOT		0x8000
+#define NPRD		(PGSIZE / sizeof(struct IdePrd))
+
+// The PRD table lives just below the page serv.c receives requests in.
+#define PRDVA		((struct IdePrd *) (DISKMAP - 2 * PGSIZE))
+
 static int diskno = 1;
 
+// Bus-master I/O base, 0 to use PIO
+static uint16_t bm_base;
+// Physical address of the PRD table
+static physaddr_t prd_pa;
+// ATA command of the DMA transfer going on, 0 if none
+static uint8_t dma_cmd;
+// Requests in that transfer, if the disk request queue started it
+static struct DiskReq *dma_reqs;
+
+static int ide_start(struct DiskReq *dr, uint32_t nsecs);
+static struct DiskReq *ide_done(int *result);
+
+struct Bdev bdev_ide =
+{
+	.bd_name =	"ide",
+	.bd_irq =	IRQ_IDE,
+	.bd_maxcmds =	0,		// 1 with DMA (see ide_dma_init)
+	.bd_maxreqs =	64,
+	.bd_read =	ide_read,
+	.bd_write =	ide_write,
+	.bd_start =	ide_start,
+	.bd_done =	ide_done
+};
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -57,6 +111,151 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+// Look for a bus-master IDE controller in compatibility mode (ports
+// 0x1F0 and IRQ 14 for the primary channel) and, if there is one, do
+// all transfers on the primary channel by DMA from now on.
+// Returns 1 if transfers go by DMA, 0 if they stay PIO.
+bool
+ide_dma_init(void)
+{
+	struct PciFunc f;
+	uint32_t bar;
+
+	if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &f) < 0)
+		return 0;
+	// prog. if bit 0: primary channel in native mode; bit 7: bus master
+	bar = pci_conf_read(&f, PCI_BAR(4));
+	if ((f.pf_progif & 0x01) || !(f.pf_progif & 0x80) || !(bar & 1))
+		return 0;
+
+	if (sys_page_alloc(0, PRDVA, PTE_P|PTE_U|PTE_W) < 0)
+		return 0;
+	if (sys_irq_attach(IRQ_IDE) < 0) {
+		sys_page_unmap(0, PRDVA);
+		return 0;
+	}
+
+	pci_conf_write(&f, PCI_COMMAND, pci_conf_read(&f, PCI_COMMAND)
+		       | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+	prd_pa = PTE_ADDR(vpt[VPN(PRDVA)]);
+	bm_base = bar & 0xFFFC;
+
+	// let the drive interrupt (nIEN clear in the device control register)
+	outb(0x3F6, 0);
+
+	bdev_ide.bd_maxcmds = 1;
+	cprintf("ide: bus-master DMA, %04x:%04x at port 0x%x\n",
+		f.pf_vendor, f.pf_device, bm_base);
+	return 1;
+}
+
+// Fill in PRD table entries for the 'nsecs' sectors at 'buf', one
+// entry for each page or part of one, starting with entry 'i'.
+// The physical addresses come from our page table.
+// Returns the index of the next free entry, or -E_INVAL if part of buf
+// is not mapped or the table is full.
+static int
+ide_prd_add(int i, const void *buf, size_t nsecs)
+{
+	struct IdePrd *prd = PRDVA;
+	uintptr_t va, end;
+	uint32_t n;
+
+	va = (uintptr_t) buf;
+	end = va + nsecs * SECTSIZE;
+	for (; va < end; va += n, i++) {
+		if (i == NPRD || !(vpd[PDX(va)] & PTE_P)
+		    || !(vpt[VPN(va)] & PTE_P))
+			return -E_INVAL;
+		n = MIN(end - va, PGSIZE - va % PGSIZE);
+		prd[i].prd_addr = PTE_ADDR(vpt[VPN(va)]) + va % PGSIZE;
+		prd[i].prd_len = n;
+		prd[i].prd_flags = 0;
+	}
+	return i;
+}
+
+// Start moving 'nsecs' sectors between the disk, from sector 'secno'
+// on, and the buffers in the first 'nprd' entries of the PRD table.
+// The drive interrupts when it is done; then call ide_dma_done.
+static void
+ide_dma_start(uint32_t secno, size_t nsecs, bool write, int nprd)
+{
+	assert(nsecs <= 256 && nprd > 0 && !dma_cmd);
+
+	PRDVA[nprd - 1].prd_flags = PRD_EOT;
+	dma_cmd = write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA;
+
+	ide_wait_ready(0);
+
+	outl(bm_base + BM_PRDT, prd_pa);
+	outb(bm_base + BM_CMD, write ? 0 : BM_CMD_READ);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, dma_cmd);
+	outb(bm_base + BM_CMD, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+}
+
+// Check on the transfer ide_dma_start started, and finish it if it
+// is done.  An IRQ left over from before can make us look too early.
+// Returns 0 if it is still going, 1 if it is done, < 0 if it failed.
+static int
+ide_dma_done(void)
+{
+	uint8_t status, cmd;
+
+	if (!dma_cmd)
+		return 0;
+	if (!((status = inb(bm_base + BM_STATUS)) & BM_STATUS_INTR))
+		return 0;
+
+	cmd = dma_cmd == IDE_CMD_WRITE_DMA ? 0 : BM_CMD_READ;
+	dma_cmd = 0;
+	outb(bm_base + BM_CMD, cmd);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+	// Reading the drive's status also acknowledges its interrupt.
+	if ((inb(0x1F7) & (IDE_DF|IDE_ERR)) || (status & BM_STATUS_ERR))
+		return -1;
+	return 1;
+}
+
+// Start one DMA transfer for the 'nsecs' sectors of the requests in
+// the chain 'dr', which the disk request queue put together.
+static int
+ide_start(struct DiskReq *dr, uint32_t nsecs)
+{
+	struct DiskReq *p;
+	int nprd = 0;
+
+	for (p = dr; p; p = p->dr_next)
+		if ((nprd = ide_prd_add(nprd, p->dr_buf, p->dr_nsecs)) < 0)
+			return nprd;
+	dma_reqs = dr;
+	ide_dma_start(dr->dr_secno, nsecs, dr->dr_write, nprd);
+	return 0;
+}
+
+// Hand back the requests of the transfer ide_start started, if it is
+// done.
+static struct DiskReq *
+ide_done(int *result)
+{
+	struct DiskReq *dr;
+	int r;
+
+	if (!dma_reqs || (r = ide_dma_done()) == 0)
+		return NULL;
+	dr = dma_reqs;
+	dma_reqs = NULL;
+	*result = r < 0 ? r : 0;
+	return dr;
+}
+
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
@@ -0,0 +1,86 @@
+/*
+ * Minimal PCI configuration space access, through configuration
+ * mechanism #1 (ports 0xCF8 and 0xCFC), so the file system server
+ * can find its disk controller.  The server has I/O privileges.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+#define PCI_NBUS	256
+#define PCI_NDEV	32
+#define PCI_NFUNC	8
+
+static uint32_t
+pci_conf_addr(const struct PciFunc *f, uint32_t off)
+{
+	return 0x80000000 | (f->pf_bus << 16) | (f->pf_dev << 11)
+		| (f->pf_func << 8) | (off & 0xFC);
+}
+
+uint32_t
+pci_conf_read(const struct PciFunc *f, uint32_t off)
+{
+	outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(const struct PciFunc *f, uint32_t off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+	outl(PCI_CONF_DATA, v);
+}
+
+// Scan every bus for the first function whose configuration register
+// 'off', masked with 'mask', is 'val', and fill in *f with it.
+// Returns 0 on success, -E_NOT_FOUND if there is none.
+static int
+pci_find(uint32_t off, uint32_t mask, uint32_t val, struct PciFunc *f)
+{
+	uint32_t id, classreg, nfunc;
+
+	for (f->pf_bus = 0; f->pf_bus < PCI_NBUS; f->pf_bus++)
+		for (f->pf_dev = 0; f->pf_dev < PCI_NDEV; f->pf_dev++) {
+			f->pf_func = 0;
+			if (PCI_VENDOR(pci_conf_read(f, PCI_ID)) == 0xFFFF)
+				continue;
+			nfunc = PCI_HDR_MULTIFN(pci_conf_read(f, PCI_BHLC))
+				? PCI_NFUNC : 1;
+
+			for (; f->pf_func < nfunc; f->pf_func++) {
+				id = pci_conf_read(f, PCI_ID);
+				if (PCI_VENDOR(id) == 0xFFFF
+				    || (pci_conf_read(f, off) & mask) != val)
+					continue;
+				classreg = pci_conf_read(f, PCI_CLASSREG);
+				f->pf_vendor = PCI_VENDOR(id);
+				f->pf_device = PCI_DEVICE(id);
+				f->pf_progif = PCI_PROGIF(classreg);
+				return 0;
+			}
+		}
+	return -E_NOT_FOUND;
+}
+
+// Find the first function with PCI class 'class' and subclass
+// 'subclass', and fill in *f with it.
+// Returns 0 on success, -E_NOT_FOUND if there is none.
+int
+pci_find_class(uint8_t class, uint8_t subclass, struct PciFunc *f)
+{
+	return pci_find(PCI_CLASSREG, 0xFFFF0000,
+			((uint32_t) class << 24) | (subclass << 16), f);
+}
+
+// Find the first function with vendor ID 'vendor' and device ID
+// 'device', and fill in *f with it.
+// Returns 0 on success, -E_NOT_FOUND if there is none.
+int
+pci_find_device(uint16_t vendor, uint16_t device, struct PciFunc *f)
+{
+	return pci_find(PCI_ID, 0xFFFFFFFF, ((uint32_t) device << 16) | vendor, f);
+}
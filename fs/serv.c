@@ -11,12 +11,9 @@
 
 #define debug 0
 
-struct OpenFile {
-	uint32_t o_fileid;	// file id
-	struct File *o_file;	// mapped descriptor for open file
-	int o_mode;		// open mode
-	struct Fd *o_fd;	// Fd page
-};
+// Read-ahead window, in blocks (see serve_readahead)
+#define RA_MINBLOCKS	4
+#define RA_MAXBLOCKS	32
 
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
@@ -30,6 +27,20 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 #define REQVA		0x0ffff000
 
+// Map requests whose first block is on its way in from the disk wait
+// here, so the server can take other requests in the meantime
+// (see serve_map and serve_unpark).  When the table is full, a map
+// request waits for the disk instead.
+#define NPARKED		16
+
+struct ParkedMap {
+	envid_t p_envid;		// client, 0 if the entry is free
+	struct Fsreq_map p_req;		// its request
+};
+
+static struct ParkedMap parked[NPARKED];
+static int nparked;
+
 void
 serve_init(void)
 {
@@ -65,6 +76,20 @@ openfile_alloc(struct OpenFile **o)
 	return -E_MAX_OPEN;
 }
 
+// Is file 'f' open for writing?
+static bool
+openfile_writing(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f && pageref(opentab[i].o_fd) > 1
+		    && ((opentab[i].o_mode & O_WRONLY)
+			|| (opentab[i].o_mode & O_RDWR)))
+			return 1;
+	return 0;
+}
+
 // Look up an open file for envid.
 int
 openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
@@ -78,11 +103,13 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
-// Serve requests, sending responses back to envid.
-// To send a result back, ipc_send(envid, r, 0, 0).
-// To include a page, ipc_send(envid, r, srcva, perm).
-void
-serve_open(envid_t envid, struct Fsreq_open *rq)
+// Serve requests from envid.
+// Each serve_* function returns the result to send back to envid;
+// serve() sends it along with the next ipc_reply_waitv.
+// To include a page, store it and its permission in *pg_store and
+// *perm_store (serve_map fills in runs of pages instead).
+int
+serve_open(envid_t envid, struct Fsreq_open *rq, void **pg_store, int *perm_store)
 {
 	char path[MAXPATHLEN];
 	struct File *f;
@@ -121,16 +148,19 @@ serve_open(envid_t envid, struct Fsreq_open *rq)
 	o->o_fd->fd_omode = rq->req_omode;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = rq->req_omode;
+	o->o_ra_next = 0;
+	o->o_ra_window = 0;
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
-	ipc_send(envid, 0, o->o_fd, PTE_P|PTE_U|PTE_W|PTE_SHARE);
-	return;
+	*pg_store = o->o_fd;
+	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
+	return 0;
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
+int
 serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 {
 	struct OpenFile *o;
@@ -170,7 +200,7 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 	// Here's how it goes.
 
 	// First, use openfile_lookup to find the relevant open file.
-	// On failure, return the error code to the client with ipc_send.
+	// On failure, return the error code to the client.
 	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
 		goto out;
 
@@ -186,38 +216,206 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 	// Finally, return to the client!
 	// (We just return r since we know it's 0 at this point.)
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
-serve_map(envid_t envid, struct Fsreq_map *rq)
+// Read ahead for a map request for blocks bno through bno + n - 1.
+// A request that starts where the last one on the same open file
+// ended is sequential: it opens a window of RA_MINBLOCKS blocks past
+// the request, and each sequential request after that doubles the
+// window, up to RA_MAXBLOCKS.  Any other request closes the window.
+// The request and its window come in from disk together, and so does
+// a request for several blocks with no window.
+// serve_map records where the request really ended in o_ra_next.
+static void
+serve_readahead(struct OpenFile *o, uint32_t bno, uint32_t n)
 {
-	int r;
+	if (bno != o->o_ra_next)
+		o->o_ra_window = 0;
+	else if (o->o_ra_window == 0)
+		o->o_ra_window = RA_MINBLOCKS;
+	else
+		o->o_ra_window = MIN(2 * o->o_ra_window, RA_MAXBLOCKS);
+
+	file_readahead(o->o_file, bno, n + o->o_ra_window);
+}
+
+// Put off map request 'rq' from 'envid' until its first block is in.
+// Returns 0 on success, -E_NO_MEM if the table is full.
+static int
+serve_park(envid_t envid, const struct Fsreq_map *rq)
+{
+	struct ParkedMap *p;
+
+	for (p = parked; p < parked + NPARKED; p++)
+		if (!p->p_envid) {
+			p->p_envid = envid;
+			p->p_req = *rq;
+			nparked++;
+			return 0;
+		}
+	return -E_NO_MEM;
+}
+
+// Fill in segs[] with the blocks for map request 'rq' on 'o',
+// starting with its first block, which is read in if need be.
+static int
+serve_map_blocks(struct OpenFile *o, struct Fsreq_map *rq,
+		 struct IpcSeg *segs, int *nsegs_store)
+{
+	int r, nsegs, i, j;
 	char *blk;
-	struct OpenFile *o;
 	int perm;
+	uint32_t bno, nblocks, endbno;
+
+	if ((rq->req_flags & FSMAP_SNAPSHOT) && openfile_writing(o->o_file))
+		return -E_BUSY;
+	bno = rq->req_offset / BLKSIZE;
+	if ((r = file_get_block(o->o_file, bno, &blk)) < 0)
+		return r;
+
+	perm = PTE_P |PTE_U;
+	if (!(rq->req_flags & FSMAP_NOSHARE))
+		perm |= PTE_SHARE;
+	if (((o->o_mode & O_WRONLY) ||
+	     (o->o_mode & O_RDWR)) && !(rq->req_flags & FSMAP_SNAPSHOT))
+		perm |= PTE_W;
+
+	segs[0].seg_va = (uintptr_t) blk;
+	segs[0].seg_npages = 1;
+	segs[0].seg_perm = perm;
+	nsegs = 1;
+
+	// If the client asked for more, send the following blocks too,
+	// up to the end of the file.  Blocks that are next to each other
+	// on disk are also next to each other in DISKMAP, so they go out
+	// as one run.  Stop quietly at the first problem; the client
+	// asks again for whatever it did not get.
+	// Touching each block tells the block cache it is in use, so
+	// making room for the ones after it does not evict it.
+	*(volatile char *) blk;
+	nblocks = MIN((uint32_t) rq->req_npages, MAXFILESIZE / BLKSIZE - bno);
+	endbno = ROUNDUP(o->o_file->f_size, BLKSIZE) / BLKSIZE;
+	// Blocks still on their way in are left for the next request.
+	for (bno++; bno < endbno && nblocks > 1; bno++, nblocks--) {
+		if (file_block_pending(o->o_file, bno)
+		    || file_get_block(o->o_file, bno, &blk) < 0)
+			break;
+		*(volatile char *) blk;
+		if ((uintptr_t) blk == segs[nsegs-1].seg_va
+		    + segs[nsegs-1].seg_npages * BLKSIZE)
+			segs[nsegs-1].seg_npages++;
+		else if (nsegs < IPC_MAXSEGS) {
+			segs[nsegs].seg_va = (uintptr_t) blk;
+			segs[nsegs].seg_npages = 1;
+			segs[nsegs].seg_perm = perm;
+			nsegs++;
+		} else
+			break;
+	}
+
+	// A cache smaller than the run could still have evicted some of
+	// it; send only the part before the first block that is gone.
+	for (i = 0; i < nsegs; i++)
+		for (j = 0; j < segs[i].seg_npages; j++)
+			if (!va_is_mapped((char *) segs[i].seg_va + j * BLKSIZE)) {
+				segs[i].seg_npages = j;
+				nsegs = j ? i + 1 : i;
+				break;
+			}
+	if (nsegs == 0)
+		return -E_NO_MEM;
+
+	// A snapshot's blocks must get pages of their own before they
+	// are written, and a writer must not get a snapshot's page.
+	for (i = 0; i < nsegs; i++)
+		for (j = 0; j < segs[i].seg_npages; j++) {
+			bno = (segs[i].seg_va - DISKMAP) / BLKSIZE + j;
+			if (rq->req_flags & FSMAP_SNAPSHOT)
+				r = block_snapshot(bno);
+			else if (perm & PTE_W)
+				r = block_unshare(bno);
+			else
+				r = 0;
+			if (r < 0)
+				return r;
+		}
+
+	o->o_ra_next = rq->req_offset / BLKSIZE;
+	for (i = 0; i < nsegs; i++)
+		o->o_ra_next += segs[i].seg_npages;
+
+	*nsegs_store = nsegs;
+	return 0;
+}
+
+int
+serve_map(envid_t envid, struct Fsreq_map *rq, struct IpcSeg *segs, int *nsegs_store)
+{
+	struct OpenFile *o;
+	uint32_t bno;
+	int r;
 
 	if (debug)
 		cprintf("serve_map %08x %08x %08x\n", envid, rq->req_fileid, rq->req_offset);
 
 	// Map the requested block in the client's address space
-	// by using ipc_send.
+	// by sending it back with the reply.
 	// Map read-only unless the file's open mode (o->o_mode) allows writes
 	// (see the O_ flags in inc/lib.h).
+	// A snapshot is the block's page, read-only and without PTE_SHARE,
+	// which the client maps copy-on-write.  The block gets a page of
+	// its own before anybody can write to it (see block_unshare), so
+	// there is no snapshot of a file that is open for writing
+	// (see serve_map_blocks).
 	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
-		ipc_send(envid, r, 0, 0);
-	if ((r = file_get_block(o->o_file, rq->req_offset / BLKSIZE, &blk)) < 0)
-		ipc_send(envid, r, 0, 0);
-
-	perm = PTE_P |PTE_U |PTE_SHARE;
-	if ((o->o_mode & O_WRONLY) ||
-	    (o->o_mode & O_RDWR))
-		perm |= PTE_W;
+		return r;
+	bno = rq->req_offset / BLKSIZE;
+	serve_readahead(o, bno, MAX(rq->req_npages, 1));
+
+	// If the read for the first block is under way, answer later
+	// (see serve_unpark) instead of waiting for the disk.
+	if (file_block_pending(o->o_file, bno) && serve_park(envid, rq) == 0)
+		return SERVE_PARKED;
+	return serve_map_blocks(o, rq, segs, nsegs_store);
+}
 
-	ipc_send(envid, 0, blk, perm);
+// Answer the parked map requests whose first block is in by now.
+// A client that has gone away in the meantime gets nothing.  One that
+// cannot take the answer (its pages do not map, say) has its call
+// failed by the kernel with the error (see sys_ipc_try_sendv), so
+// either way the request is done with.
+// Returns the number of requests still parked.
+int
+serve_unpark(void)
+{
+	struct ParkedMap *p;
+	struct OpenFile *o;
+	struct IpcSeg segs[IPC_MAXSEGS];
+	int r, nsegs;
+
+	for (p = parked; nparked > 0 && p < parked + NPARKED; p++) {
+		if (!p->p_envid)
+			continue;
+		nsegs = 0;
+		if ((r = openfile_lookup(p->p_envid, p->p_req.req_fileid, &o)) == 0) {
+			if (file_block_pending(o->o_file,
+					       p->p_req.req_offset / BLKSIZE))
+				continue;
+			r = serve_map_blocks(o, &p->p_req, segs, &nsegs);
+		}
+		if (r < 0)
+			nsegs = 0;
+		if ((r = sys_ipc_try_sendv(p->p_envid, r, segs, nsegs)) < 0)
+			cprintf("fs: answering parked map for %08x: %e\n",
+				p->p_envid, r);
+		p->p_envid = 0;
+		nparked--;
+	}
+	return nparked;
 }
 
-void
+int
 serve_close(envid_t envid, struct Fsreq_close *rq)
 {
 	struct OpenFile *o;
@@ -253,14 +451,14 @@ serve_close(envid_t envid, struct Fsreq_close *rq)
 	file_close(o->o_file);
 
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
+int
 serve_remove(envid_t envid, struct Fsreq_remove *rq)
 {
 	char path[MAXPATHLEN];
-	int r, len;
+	int len;
 
 	if (debug)
 		cprintf("serve_remove %08x %s\n", envid, rq->req_path);
@@ -273,13 +471,10 @@ serve_remove(envid_t envid, struct Fsreq_remove *rq)
 	len = strlen(rq->req_path);
 	memmove(path, rq->req_path, len);
 	path[len] = '\0';
-	if ((r = file_remove(path)) < 0)
-		ipc_send(envid, r, 0, 0);
-
-	ipc_send(envid, 0, 0, 0);
+	return file_remove(path);
 }
 
-void
+int
 serve_dirty(envid_t envid, struct Fsreq_dirty *rq)
 {
 	struct OpenFile *o;
@@ -293,67 +488,139 @@ serve_dirty(envid_t envid, struct Fsreq_dirty *rq)
 	
 	// LAB 5: Your code here.
 	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
-		ipc_send(envid, r, 0, 0);
-	if ((r = file_dirty(o->o_file, rq->req_offset)) < 0)
-		ipc_send(envid, r, 0, 0);
-
-	ipc_send(envid, 0, 0, 0);
+		return r;
+	return file_dirty(o->o_file, rq->req_offset);
 }
 
-void
+int
 serve_sync(envid_t envid)
 {
 	fs_sync();
-	ipc_send(envid, 0, 0, 0);
+	return 0;
 }
 
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm;
-	
+	uint32_t req;
+	envid_t whom;
+	int perm, r, reply_perm, reply_nsegs;
+	void *reply_pg, *rq;
+	struct IpcMsg msg;
+	struct IpcSeg reply_segs[IPC_MAXSEGS];
+
+	// Small requests arrive as IPC messages, laid out in msg_word
+	static_assert(sizeof(struct Fsreq_map) <= sizeof(msg.msg_word));
+	static_assert(sizeof(struct Fsreq_set_size) <= sizeof(msg.msg_word));
+	static_assert(sizeof(struct Fsreq_close) <= sizeof(msg.msg_word));
+	static_assert(sizeof(struct Fsreq_dirty) <= sizeof(msg.msg_word));
+
+	// Each trip around the loop replies to the previous request
+	// and waits for the next one in a single system call.
+	// The next request page replaces the previous one at REQVA.
+	whom = 0;
+	r = reply_nsegs = 0;
 	while (1) {
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, (void *) REQVA, &perm);
+		req = ipc_reply_waitv(whom, r, reply_segs, reply_nsegs,
+				      &whom, (void *) REQVA, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, vpt[VPN(REQVA)], REQVA);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		r = reply_perm = reply_nsegs = 0;
+		reply_pg = 0;
+
+		if (whom == 0) {
+			cprintf("fs: ipc_reply_wait: %e\n", req);
+			continue;
+		}
+
+		// Our own alarm: time for write-back, with nobody to reply to.
+		// The disk's interrupt also comes from us: its command is
+		// done, so the next one can start, and the map requests
+		// that waited for it can be answered.
+		if (whom == env->env_id) {
+			if (req == 0) {
+				fs_writeback();
+				sys_ipc_alarm(WB_INTERVAL);
+			} else if (req == IPC_IRQ(bdev->bd_irq)) {
+				diskq_intr();
+				serve_unpark();
+			}
+			whom = 0;
+			continue;
+		}
+
+		// All requests must contain an argument page or message.
+		// Copy the message out of our Env before the next
+		// request overwrites it.
+		if (env->env_ipc_hasmsg) {
+			msg = env->env_ipc_msg;
+			rq = msg.msg_word;
+		} else if (perm & PTE_P)
+			rq = (void *) REQVA;
+		else {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
 		switch (req) {
 		case FSREQ_OPEN:
-			serve_open(whom, (struct Fsreq_open*)REQVA);
+			// paths only fit in a page
+			if (rq != (void *) REQVA) {
+				r = -E_INVAL;
+				break;
+			}
+			r = serve_open(whom, rq, &reply_pg, &reply_perm);
 			break;
 		case FSREQ_MAP:
-			serve_map(whom, (struct Fsreq_map*)REQVA);
+			r = serve_map(whom, rq, reply_segs, &reply_nsegs);
+			if (r == SERVE_PARKED)
+				whom = r = reply_nsegs = 0;
 			break;
 		case FSREQ_SET_SIZE:
-			serve_set_size(whom, (struct Fsreq_set_size*)REQVA);
+			r = serve_set_size(whom, rq);
 			break;
 		case FSREQ_CLOSE:
-			serve_close(whom, (struct Fsreq_close*)REQVA);
+			r = serve_close(whom, rq);
 			break;
 		case FSREQ_DIRTY:
-			serve_dirty(whom, (struct Fsreq_dirty*)REQVA);
+			r = serve_dirty(whom, rq);
 			break;
 		case FSREQ_REMOVE:
-			serve_remove(whom, (struct Fsreq_remove*)REQVA);
+			if (rq != (void *) REQVA) {
+				r = -E_INVAL;
+				break;
+			}
+			r = serve_remove(whom, rq);
 			break;
 		case FSREQ_SYNC:
-			serve_sync(whom);
+			r = serve_sync(whom);
 			break;
 		default:
 			cprintf("Invalid request code %d from %08x\n", whom, req);
+			r = -E_INVAL;
 			break;
 		}
-		sys_page_unmap(0, (void*) REQVA);
+
+		if (reply_pg) {
+			reply_segs[0].seg_va = (uintptr_t) reply_pg;
+			reply_segs[0].seg_npages = 1;
+			reply_segs[0].seg_perm = reply_perm;
+			reply_nsegs = 1;
+		}
+
+		// While requests keep coming, the alarm may not get a turn.
+		if (fs_writeback_due())
+			fs_writeback();
+
+		// Waiting for the disk on this request may also have
+		// brought in blocks that parked requests wait for.
+		if (nparked > 0)
+			serve_unpark();
 	}
 }
 
@@ -372,6 +639,7 @@ umain(void)
 	fs_init();
 	fs_test();
 
+	sys_ipc_alarm(WB_INTERVAL);
 	serve();
 }
 
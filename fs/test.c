@@ -16,13 +16,154 @@ strecmp(char *a, char *b)
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
-void
-fs_test(void)
+// A disk for checking the order of the disk queue: it only notes each
+// command it is given, and is done with it when diskq_intr asks.
+static struct DiskReq *fake_cmd;
+static uint32_t fake_secno[8], fake_nsecs[8];
+static int fake_ncmds;
+
+static int
+fake_start(struct DiskReq *dr, uint32_t nsecs)
+{
+	fake_secno[fake_ncmds] = dr->dr_secno;
+	fake_nsecs[fake_ncmds++] = nsecs;
+	fake_cmd = dr;
+	return 0;
+}
+
+static struct DiskReq *
+fake_done(int *result)
+{
+	struct DiskReq *dr = fake_cmd;
+
+	fake_cmd = NULL;
+	*result = 0;
+	return dr;
+}
+
+static struct Bdev bdev_fake = {
+	.bd_name =	"fake",
+	.bd_maxcmds =	1,
+	.bd_maxreqs =	8,
+	.bd_start =	fake_start,
+	.bd_done =	fake_done,
+};
+
+// End of our text and data (see user/user.ld)
+extern char end[];
+
+// The client in fs_test_parked: receive the answer to the map request
+// made in its name and pass the value and page on to 'parent'.  It runs
+// with nothing but our text and data, read-only, and a stack, so it
+// makes system calls directly and writes no globals.
+static void
+fs_test_client(envid_t parent)
 {
-	struct File *f;
+	const volatile struct Env *e;
 	int r;
+
+	r = sys_ipc_recv((void *) UTEMP);
+	e = &envs[ENVX(sys_getenvid())];
+	if (r < 0 || !(e->env_ipc_perm & PTE_P))
+		sys_ipc_send(parent, r < 0 ? r : e->env_ipc_value, 0, 0, 0);
+	else
+		sys_ipc_send(parent, e->env_ipc_value, (void *) UTEMP,
+			     PTE_P | PTE_U, 0);
+	sys_env_destroy(0);
+}
+
+// Check that a map request whose first block is still coming in from
+// the disk is parked, and answered once the block is in.  Only a disk
+// that works in the background parks requests.
+static void
+fs_test_parked(void)
+{
+	struct OpenFile *o;
+	struct Fsreq_map rq;
+	struct IpcSeg segs[IPC_MAXSEGS];
+	struct Trapframe tf;
+	envid_t client, from;
+	uintptr_t va;
 	char *blk;
-	uint32_t *bits;
+	int r, fileid, nsegs, perm;
+
+	if (!bdev->bd_maxcmds)
+		return;
+
+	if ((fileid = openfile_alloc(&o)) < 0)
+		panic("openfile_alloc: %e", fileid);
+	if ((r = file_open("/newmotd", &o->o_file)) < 0)
+		panic("file_open /newmotd: %e", r);
+	o->o_mode = O_RDONLY;
+	o->o_ra_next = o->o_ra_window = 0;
+
+	// a client with our text, a stack, and the open file's Fd page
+	if ((client = sys_exofork()) < 0)
+		panic("sys_exofork: %e", client);
+	for (va = UTEXT; va < (uintptr_t) end; va += PGSIZE)
+		if ((vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P)
+		    && (r = sys_page_map(0, (void *) va, client, (void *) va,
+					 PTE_P | PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	((envid_t *) ((char *) UTEMP + PGSIZE))[-1] = env->env_id;
+	if ((r = sys_page_map(0, UTEMP, client, (void *) (USTACKTOP - PGSIZE),
+			      PTE_P | PTE_U | PTE_W)) < 0
+	    || (r = sys_page_map(0, o->o_fd, client, o->o_fd, PTE_P | PTE_U)) < 0)
+		panic("sys_page_map: %e", r);
+	sys_page_unmap(0, UTEMP);
+	tf = envs[ENVX(client)].env_tf;
+	tf.tf_eip = (uintptr_t) fs_test_client;
+	tf.tf_esp = USTACKTOP - 8;
+	if ((r = sys_env_set_trapframe(client, &tf)) < 0
+	    || (r = sys_env_set_status(client, ENV_RUNNABLE)) < 0)
+		panic("starting the client: %e", r);
+
+	// push the file's first block out of the cache
+	if ((r = file_get_block(o->o_file, 0, &blk)) < 0)
+		panic("file_get_block: %e", r);
+	file_flush(o->o_file);
+	if ((r = bc_set_capacity(1)) < 0)
+		panic("bc_set_capacity: %e", r);
+	*(volatile off_t *) &o->o_file->f_size;
+	if ((r = bc_set_capacity(BCACHE_NBLOCKS)) < 0)
+		panic("bc_set_capacity 2: %e", r);
+	assert(!va_is_mapped(blk));
+
+	rq.req_fileid = fileid;
+	rq.req_offset = 0;
+	rq.req_npages = 1;
+	rq.req_flags = FSMAP_NOSHARE;
+	assert(serve_map(client, &rq, segs, &nsegs) == SERVE_PARKED);
+	assert(serve_unpark() == 1);
+
+	while (!envs[ENVX(client)].env_ipc_recving)
+		sys_yield();
+	diskq_drain();
+	assert(serve_unpark() == 0);
+	do {
+		r = ipc_recv(&from, UTEMP, &perm);
+		if (from == env->env_id && r == IPC_IRQ(bdev->bd_irq))
+			diskq_intr();
+	} while (from != client);
+	assert(r == 0 && (perm & PTE_P));
+	assert(PTE_ADDR(vpt[VPN(UTEMP)]) == PTE_ADDR(vpt[VPN(blk)]));
+	sys_page_unmap(0, UTEMP);
+	file_close(o->o_file);
+	cprintf("parked map requests are good\n");
+}
+
+void
+fs_test(void)
+{
+	struct File *f, *files[2];
+	struct Bdev *realbdev;
+	struct DiskReq dreqs[5];
+	static const uint32_t secnos[5] = { 100, 50, 200, 150, 208 };
+	int r, i, j, n;
+	char *blk, *blks[16];
+	uint32_t *bits, hint, bno;
 
 	// back up bitmap
 	if ((r = sys_page_alloc(0, (void*) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
@@ -37,6 +178,21 @@ fs_test(void)
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
 	cprintf("alloc_block is good\n");
+
+	// allocate a run of blocks after it
+	hint = r + 1;
+	if ((n = alloc_block_run(hint, 4, &bno)) < 0)
+		panic("alloc_block_run: %e", n);
+	assert(n >= 1 && n <= 4 && bno >= hint);
+	// every block it skipped is in use
+	for (i = hint; i < bno; i++)
+		assert(!(bits[i/32] & (1 << (i%32))));
+	for (i = bno; i < bno + n; i++) {
+		assert(bits[i/32] & (1 << (i%32)));
+		assert(!(bitmap[i/32] & (1 << (i%32))));
+		bitmap[i/32] |= 1 << (i%32);
+	}
+	cprintf("alloc_block_run is good\n");
 	
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
@@ -60,7 +216,10 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
-	assert(f->f_direct[0] == 0);
+	if (super->s_magic == FS_MAGIC)
+		assert(f->f_nextents == 0 && f->f_extdepth == 0);
+	else
+		assert(f->f_direct[0] == 0);
 	assert(!(vpt[VPN(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
@@ -76,4 +235,112 @@ fs_test(void)
 	file_close(f);
 	assert(!(vpt[VPN(f)] & PTE_D));	
 	cprintf("file rewrite is good\n");
+
+	// a snapshot that someone holds stays behind when the block
+	// gets a page of its own, and the block stays clean
+	bno = ((uintptr_t) blk - DISKMAP) / BLKSIZE;
+	if ((r = block_snapshot(bno)) < 0)
+		panic("block_snapshot: %e", r);
+	if ((r = sys_page_map(0, blk, 0, UTEMP, PTE_P|PTE_U)) < 0)
+		panic("sys_page_map: %e", r);
+	if ((r = block_unshare(bno)) < 0)
+		panic("block_unshare: %e", r);
+	assert(PTE_ADDR(vpt[VPN(UTEMP)]) != PTE_ADDR(vpt[VPN(blk)]));
+	assert(strcmp(UTEMP, msg) == 0 && strcmp(blk, msg) == 0);
+	assert(!(vpt[VPN(blk)] & PTE_D));
+	sys_page_unmap(0, UTEMP);
+	cprintf("block snapshots are good\n");
+
+	// grow two files a block at a time in turn, so neither gets
+	// consecutive blocks and both need an extent block
+	if (super->s_magic == FS_MAGIC) {
+		if ((r = file_create("/exta", &files[0])) < 0
+		    || (r = file_create("/extb", &files[1])) < 0)
+			panic("file_create /ext*: %e", r);
+		for (i = 0; i < 2 * NEXTENT; i++)
+			for (j = 0; j < 2; j++) {
+				if ((r = file_set_size(files[j], (i + 1) * BLKSIZE)) < 0)
+					panic("file_set_size 4: %e", r);
+				if ((r = file_get_block(files[j], i, &blk)) < 0)
+					panic("file_get_block 5: %e", r);
+				*(int *) blk = j * 1000 + i;
+			}
+		for (j = 0; j < 2; j++) {
+			assert(files[j]->f_extdepth == 1);
+			for (i = 0; i < 2 * NEXTENT; i++) {
+				if ((r = file_get_block(files[j], i, &blk)) < 0)
+					panic("file_get_block 6: %e", r);
+				assert(*(int *) blk == j * 1000 + i);
+			}
+		}
+		if ((r = file_set_size(files[0], 2 * BLKSIZE)) < 0)
+			panic("file_set_size 5: %e", r);
+		assert(files[0]->f_extdepth == 0 && files[0]->f_nextents == 2);
+		if ((r = file_remove("/exta")) < 0
+		    || (r = file_remove("/extb")) < 0)
+			panic("file_remove /ext*: %e", r);
+		cprintf("file extents are good\n");
+	}
+
+	// write more blocks than a small cache holds, and read them back
+	if ((r = bc_set_capacity(8)) < 0)
+		panic("bc_set_capacity: %e", r);
+	if ((r = file_create("/bctest", &f)) < 0)
+		panic("file_create /bctest: %e", r);
+	if ((r = file_set_size(f, 16 * BLKSIZE)) < 0)
+		panic("file_set_size 3: %e", r);
+	for (i = 0; i < 16; i++) {
+		if ((r = file_get_block(f, i, &blks[i])) < 0)
+			panic("file_get_block 3: %e", r);
+		*(int *) blks[i] = i;
+	}
+	for (i = n = 0; i < 16; i++)
+		if (va_is_mapped(blks[i]))
+			n++;
+	assert(n <= 8);
+	for (i = 0; i < 16; i++) {
+		if ((r = file_get_block(f, i, &blk)) < 0)
+			panic("file_get_block 4: %e", r);
+		assert(blk == blks[i] && *(int *) blk == i);
+	}
+	// the last blocks read pushed the first ones out; read some ahead
+	file_flush(f);
+	assert(!va_is_mapped(blks[0]));
+	if ((r = file_readahead(f, 0, 4)) < 0)
+		panic("file_readahead: %e", r);
+	diskq_drain();
+	for (i = 0; i < 4; i++)
+		assert(va_is_mapped(blks[i]) && *(int *) blks[i] == i);
+	if ((r = file_remove("/bctest")) < 0)
+		panic("file_remove /bctest: %e", r);
+	if ((r = bc_set_capacity(BCACHE_NBLOCKS)) < 0)
+		panic("bc_set_capacity 2: %e", r);
+	cprintf("block cache is good\n");
+
+	// The first request goes to the disk at once and the rest wait.
+	// They go out in C-LOOK order from there: up to the highest, then
+	// on from the lowest.  208 comes right after 200 on the disk, so
+	// the two go out as one command.
+	diskq_drain();
+	realbdev = bdev;
+	bdev = &bdev_fake;
+	memset(dreqs, 0, sizeof(dreqs));
+	for (i = 0; i < 5; i++) {
+		dreqs[i].dr_secno = secnos[i];
+		dreqs[i].dr_nsecs = 8;
+		diskq_submit(&dreqs[i]);
+	}
+	while (fake_cmd)
+		diskq_intr();
+	bdev = realbdev;
+	assert(fake_ncmds == 4);
+	assert(fake_secno[0] == 100 && fake_nsecs[0] == 8);
+	assert(fake_secno[1] == 150 && fake_nsecs[1] == 8);
+	assert(fake_secno[2] == 200 && fake_nsecs[2] == 16);
+	assert(fake_secno[3] == 50 && fake_nsecs[3] == 8);
+	for (i = 0; i < 5; i++)
+		assert(dreqs[i].dr_done && dreqs[i].dr_result == 0);
+	cprintf("disk queue order is good\n");
+
+	fs_test_parked();
 }
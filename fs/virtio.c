@@ -0,0 +1,346 @@
+/*
+ * Driver for a virtio block device, through the legacy PCI interface
+ * (virtio 0.9.5).  Emulators move data for it much more cheaply than
+ * they emulate IDE.
+ *
+ * Commands go to the device on one virtqueue, in memory we share with
+ * it: a table of descriptors, the available ring where we post the
+ * first descriptor of each command, and the used ring where the device
+ * posts the ones it has finished.  Each command takes a chain of
+ * descriptors from a free list, as many as it needs: the request
+ * header, the pieces of the data, and the status byte the device
+ * writes last.  Its header and status live in a slot of their own.
+ * The device interrupts when it has put commands on the used ring.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define VIRTIO_VENDOR		0x1AF4
+#define VIRTIO_DEVICE_BLK	0x1001	// Legacy (transitional) block device
+
+// Legacy virtio registers, as offsets from the I/O base in BAR 0
+#define VIRTIO_FEATURES		0x00	// Features the device has
+#define VIRTIO_GUEST_FEATURES	0x04	// Features the driver uses
+#define VIRTIO_QUEUE_PFN	0x08	// Page number of the selected queue
+#define VIRTIO_QUEUE_SIZE	0x0C	// Entries in the selected queue
+#define VIRTIO_QUEUE_SEL	0x0E	// Selected queue
+#define VIRTIO_QUEUE_NOTIFY	0x10	// Queue with new commands
+#define VIRTIO_STATUS		0x12	// Device status
+#define VIRTIO_ISR		0x13	// Interrupt status; reading clears it
+
+#define VIRTIO_STATUS_ACK	0x01	// We have seen the device
+#define VIRTIO_STATUS_DRIVER	0x02	// We can drive it
+#define VIRTIO_STATUS_DRIVER_OK	0x04	// We are ready
+#define VIRTIO_STATUS_FAILED	0x80	// We gave up on it
+
+#define VIRTIO_BLK_T_IN		0	// Read
+#define VIRTIO_BLK_T_OUT	1	// Write
+#define VIRTIO_BLK_S_OK		0
+
+struct VringDesc {
+	uint64_t vd_addr;	// Physical address
+	uint32_t vd_len;	// Bytes
+	uint16_t vd_flags;	// VRING_DESC_F_*
+	uint16_t vd_next;	// Next descriptor, with VRING_DESC_F_NEXT
+};
+
+#define VRING_DESC_F_NEXT	1	// The command goes on in vd_next
+#define VRING_DESC_F_WRITE	2	// The device writes the buffer
+
+struct VringAvail {
+	uint16_t va_flags;
+	uint16_t va_idx;	// Where we post the next command
+	uint16_t va_ring[];	// First descriptors of commands
+};
+
+struct VringUsedElem {
+	uint32_t vu_id;		// First descriptor of the command
+	uint32_t vu_len;	// Bytes the device wrote
+};
+
+struct VringUsed {
+	uint16_t vu_flags;
+	uint16_t vu_idx;	// Where the device posts the next command
+	struct VringUsedElem vu_ring[];
+};
+
+// What the device reads first in each command
+struct VirtioBlkHdr {
+	uint32_t vh_type;	// VIRTIO_BLK_T_*
+	uint32_t vh_ioprio;
+	uint64_t vh_sector;
+};
+
+// Requests one command can take (bd_maxreqs), and descriptors for a
+// command, at most and at least: the header, each page or part of one
+// of the data, and the status byte
+#define VQ_MAXREQS	4
+#define VQ_MAXDESC	(2 + 256 * SECTSIZE / PGSIZE + VQ_MAXREQS)
+#define VQ_MINDESC	3
+// Commands going at once, at most
+#define VQ_MAXSLOTS	16
+
+// Header and status of each slot
+struct VirtioSlot {
+	struct VirtioBlkHdr vs_hdr;
+	uint8_t vs_status;
+};
+
+// Free descriptors, linked by vd_next
+#define VQ_NONE		0xFFFF
+
+// The virtqueue, in up to VQ_MAXPAGES physically contiguous pages,
+// and a page for the slots, below the PRD table (see ide.c).
+#define VQVA		(DISKMAP - 12 * PGSIZE)
+#define VQ_MAXPAGES	8
+#define VSLOTVA		((struct VirtioSlot *) (DISKMAP - 3 * PGSIZE))
+
+static uint16_t vio_base;
+static uint16_t vq_size;
+static struct VringDesc *vq_desc;
+static volatile struct VringAvail *vq_avail;
+static volatile struct VringUsed *vq_used;
+// Next entry of the used ring to look at
+static uint16_t vq_used_idx;
+static int vq_nslots;
+// Requests in the command in each slot, NULL if the slot is free,
+// and its first descriptor
+static struct DiskReq *vq_reqs[VQ_MAXSLOTS];
+static uint16_t vq_first[VQ_MAXSLOTS];
+// First free descriptor, VQ_NONE if none, and how many there are
+static uint16_t vq_free;
+static int vq_nfree;
+
+static int virtio_start(struct DiskReq *dr, uint32_t nsecs);
+static struct DiskReq *virtio_done(int *result);
+
+struct Bdev bdev_virtio =
+{
+	.bd_name =	"virtio-blk",
+	.bd_maxreqs =	VQ_MAXREQS,
+	.bd_start =	virtio_start,
+	.bd_done =	virtio_done
+};
+
+// Bytes of a legacy virtqueue with 'qsize' entries
+static uint32_t
+vring_size(uint32_t qsize)
+{
+	return ROUNDUP(sizeof(struct VringDesc) * qsize
+		       + sizeof(uint16_t) * (3 + qsize), PGSIZE)
+		+ ROUNDUP(sizeof(uint16_t) * 3
+			  + sizeof(struct VringUsedElem) * qsize, PGSIZE);
+}
+
+// Look for a virtio block device and, if there is one, set it up with
+// one virtqueue and fill in bdev_virtio for it.
+// Returns 0 on success, < 0 if there is no device we can use.
+int
+virtio_blk_init(void)
+{
+	struct PciFunc f;
+	uint32_t bar, npages, irq;
+	int r, i;
+
+	if ((r = pci_find_device(VIRTIO_VENDOR, VIRTIO_DEVICE_BLK, &f)) < 0)
+		return r;
+	bar = pci_conf_read(&f, PCI_BAR(0));
+	irq = PCI_INTR_LINE(pci_conf_read(&f, PCI_INTR));
+	if (!(bar & 1) || irq == 0 || irq >= 16)
+		return -E_INVAL;
+
+	pci_conf_write(&f, PCI_COMMAND, pci_conf_read(&f, PCI_COMMAND)
+		       | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+	vio_base = bar & 0xFFFC;
+
+	// Reset the device and tell it we know how to drive it.
+	// We use none of its optional features.
+	outb(vio_base + VIRTIO_STATUS, 0);
+	outb(vio_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+	outb(vio_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK|VIRTIO_STATUS_DRIVER);
+	outl(vio_base + VIRTIO_GUEST_FEATURES, 0);
+
+	outw(vio_base + VIRTIO_QUEUE_SEL, 0);
+	vq_size = inw(vio_base + VIRTIO_QUEUE_SIZE);
+	npages = vring_size(vq_size) / PGSIZE;
+	r = -E_INVAL;
+	if (vq_size < VQ_MAXDESC || npages > VQ_MAXPAGES)
+		goto fail;
+
+	if ((r = sys_page_alloc_contig(0, (void *) VQVA, npages,
+				       PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	if ((r = sys_page_alloc(0, VSLOTVA, PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail_vq;
+	if ((r = sys_irq_attach(irq)) < 0)
+		goto fail_slots;
+
+	vq_desc = (struct VringDesc *) VQVA;
+	vq_avail = (struct VringAvail *) (vq_desc + vq_size);
+	vq_used = (struct VringUsed *) (VQVA + ROUNDUP(sizeof(struct VringDesc)
+		* vq_size + sizeof(uint16_t) * (3 + vq_size), PGSIZE));
+	for (i = 0; i < vq_size; i++)
+		vq_desc[i].vd_next = i + 1 < vq_size ? i + 1 : VQ_NONE;
+	vq_free = 0;
+	vq_nfree = vq_size;
+	vq_nslots = MIN(vq_size / VQ_MINDESC, VQ_MAXSLOTS);
+	outl(vio_base + VIRTIO_QUEUE_PFN, PTE_ADDR(vpt[VPN(VQVA)]) >> PGSHIFT);
+	outb(vio_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK|VIRTIO_STATUS_DRIVER
+	     |VIRTIO_STATUS_DRIVER_OK);
+
+	bdev_virtio.bd_irq = irq;
+	bdev_virtio.bd_maxcmds = vq_nslots;
+	cprintf("virtio-blk: %04x:%04x at port 0x%x, irq %d, %d commands at once\n",
+		f.pf_vendor, f.pf_device, vio_base, irq, vq_nslots);
+	return 0;
+
+fail_slots:
+	sys_page_unmap(0, VSLOTVA);
+fail_vq:
+	for (; npages > 0; npages--)
+		sys_page_unmap(0, (void *) (VQVA + (npages - 1) * PGSIZE));
+fail:
+	outb(vio_base + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+	return r;
+}
+
+// Fill in descriptor 'd' for the 'len' bytes at 'va', leading on to
+// the descriptor in its vd_next, which the free list left there.
+// Returns 0 on success, -E_INVAL if va is not mapped.
+static int
+vq_desc_set(int d, const void *va, uint32_t len, uint16_t flags)
+{
+	uintptr_t a = (uintptr_t) va;
+
+	if (!(vpd[PDX(a)] & PTE_P) || !(vpt[VPN(a)] & PTE_P))
+		return -E_INVAL;
+	vq_desc[d].vd_addr = PTE_ADDR(vpt[VPN(a)]) + PGOFF(a);
+	vq_desc[d].vd_len = len;
+	vq_desc[d].vd_flags = flags | VRING_DESC_F_NEXT;
+	return 0;
+}
+
+// Descriptors a command for the requests in the chain 'dr' takes.
+static int
+vq_ndesc(struct DiskReq *dr)
+{
+	uintptr_t va;
+	int n = 2;
+
+	for (; dr; dr = dr->dr_next) {
+		va = (uintptr_t) dr->dr_buf;
+		n += (ROUNDUP(va + dr->dr_nsecs * SECTSIZE, PGSIZE)
+		      - ROUNDDOWN(va, PGSIZE)) / PGSIZE;
+	}
+	return n;
+}
+
+// Put the chain of descriptors from 'd' back on the free list.
+static void
+vq_desc_free(uint16_t d)
+{
+	uint16_t next;
+
+	for (;;) {
+		next = vq_desc[d].vd_next;
+		vq_desc[d].vd_next = vq_free;
+		vq_free = d;
+		vq_nfree++;
+		if (!(vq_desc[d].vd_flags & VRING_DESC_F_NEXT))
+			return;
+		d = next;
+	}
+}
+
+// Start a command for the 'nsecs' sectors of the requests in the chain
+// 'dr', in a free slot with descriptors off the free list, and tell
+// the device about it.
+// Returns -E_NO_MEM if there is no free slot or too few descriptors.
+static int
+virtio_start(struct DiskReq *dr, uint32_t nsecs)
+{
+	struct VirtioSlot *vs;
+	struct DiskReq *p;
+	uintptr_t va, end;
+	uint32_t n;
+	int slot, first, d, r;
+
+	if (vq_ndesc(dr) > VQ_MAXDESC)
+		return -E_INVAL;
+	for (slot = 0; slot < vq_nslots && vq_reqs[slot]; slot++)
+		/* find a free one */;
+	if (slot == vq_nslots || vq_ndesc(dr) > vq_nfree)
+		return -E_NO_MEM;
+
+	vs = &VSLOTVA[slot];
+	vs->vs_hdr.vh_type = dr->dr_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	vs->vs_hdr.vh_ioprio = 0;
+	vs->vs_hdr.vh_sector = dr->dr_secno;
+	vs->vs_status = 0xFF;
+
+	// Fill in the descriptors at the front of the free list, and
+	// take them off it once they all are.
+	d = first = vq_free;
+	if ((r = vq_desc_set(d, &vs->vs_hdr, sizeof(vs->vs_hdr), 0)) < 0)
+		return r;
+	d = vq_desc[d].vd_next;
+	for (p = dr; p; p = p->dr_next) {
+		va = (uintptr_t) p->dr_buf;
+		end = va + p->dr_nsecs * SECTSIZE;
+		for (; va < end; va += n, d = vq_desc[d].vd_next) {
+			n = MIN(end - va, PGSIZE - PGOFF(va));
+			if ((r = vq_desc_set(d, (void *) va, n, dr->dr_write
+					     ? 0 : VRING_DESC_F_WRITE)) < 0)
+				return r;
+		}
+	}
+	if ((r = vq_desc_set(d, &vs->vs_status, 1, VRING_DESC_F_WRITE)) < 0)
+		return r;
+	vq_desc[d].vd_flags &= ~VRING_DESC_F_NEXT;
+	vq_free = vq_desc[d].vd_next;
+	vq_nfree -= vq_ndesc(dr);
+
+	vq_reqs[slot] = dr;
+	vq_first[slot] = first;
+	vq_avail->va_ring[vq_avail->va_idx % vq_size] = first;
+	// The command must be complete before the device can see it.
+	__asm __volatile("" : : : "memory");
+	vq_avail->va_idx++;
+	__asm __volatile("" : : : "memory");
+	outw(vio_base + VIRTIO_QUEUE_NOTIFY, 0);
+	return 0;
+}
+
+// Hand back the requests of the next command the device has finished.
+static struct DiskReq *
+virtio_done(int *result)
+{
+	volatile struct VringUsedElem *ue;
+	struct DiskReq *dr;
+	int slot;
+
+	if (vq_used_idx == vq_used->vu_idx) {
+		// Nothing more: acknowledge the interrupt, so the device
+		// raises it again for the next command, and look once
+		// more for one that finished before that.
+		inb(vio_base + VIRTIO_ISR);
+		if (vq_used_idx == vq_used->vu_idx)
+			return NULL;
+	}
+
+	ue = &vq_used->vu_ring[vq_used_idx % vq_size];
+	vq_used_idx++;
+	for (slot = 0; slot < vq_nslots; slot++)
+		if (vq_reqs[slot] && vq_first[slot] == ue->vu_id)
+			break;
+	if (slot == vq_nslots)
+		panic("virtio-blk: bad used descriptor %d", ue->vu_id);
+
+	dr = vq_reqs[slot];
+	vq_reqs[slot] = NULL;
+	vq_desc_free(vq_first[slot]);
+	*result = *(volatile uint8_t *) &VSLOTVA[slot].vs_status
+		== VIRTIO_BLK_S_OK ? 0 : -E_UNSPECIFIED;
+	return dr;
+}
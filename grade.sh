@@ -175,6 +175,46 @@ runtest1 -tag 'PTE_SHARE [testpteshare]' testpteshare \
 	'fork handles PTE_SHARE right' \
 	'spawn handles PTE_SHARE right' \
 
+pts=0
+runtest1 -tag 'clock page [testtime]' testtime \
+	'monotonic clock is monotonic' \
+	'realtime clock is set' \
+	'clock_gettime rejects bad clock ids' \
+
+pts=0
+runtest1 -tag 'system call ring [testring]' testring \
+	'ring allocated 100 pages' \
+	'ring unmapped 100 pages' \
+	'ring reports errors' \
+
+pts=0
+runtest1 -tag 'blocking send [testipcsend]' testipcsend \
+	'blocked senders are served in order' \
+	'ipc_send_timeout times out' \
+	'undeliverable replies fail the call' \
+
+pts=0
+runtest1 -tag 'ipc mailbox [testmbox]' testmbox \
+	'full mailbox refuses posts' \
+	'posted messages arrive in order' \
+	'drained mailbox is empty' \
+	'ipc_recv drains the mailbox' \
+
+pts=0
+runtest1 -tag 'threads [testthread]' testthread \
+	'threads share memory and the mutex works' \
+	'condition variables work' \
+	'threads share memory from malloc' \
+
+pts=0
+runtest1 -tag 'demand loading [testpager]' testpager \
+	'read-only pages are loaded on demand' \
+
+pts=0
+runtest1 -tag 'exec [testexec]' testexec \
+	'exec keeps the envid' \
+	'exec of a missing program fails' \
+
 # 10 points - run-testfdsharing
 pts=10
 runtest1 -tag 'fd sharing [testfdsharing]' testfdsharing \
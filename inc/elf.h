@@ -47,11 +47,18 @@ struct Secthdr {
 
 // Values for Proghdr::p_type
 #define ELF_PROG_LOAD		1
+#define ELF_PROG_INTERP		3
 
 // Flag bits for Proghdr::p_flags
 #define ELF_PROG_FLAG_EXEC	1
 #define ELF_PROG_FLAG_WRITE	2
 #define ELF_PROG_FLAG_READ	4
+// OS-specific: load this segment at startup even when the rest of
+// the program is demand-loaded (see inc/pager.h)
+#define ELF_PROG_FLAG_EAGER	0x00100000
+// OS-specific: the thread-local data of a program that uses the shared
+// library (see user/dyn.ld)
+#define ELF_PROG_FLAG_TLS	0x00200000
 
 // Values for Secthdr::sh_type
 #define ELF_SHT_NULL		0
@@ -35,12 +35,44 @@ typedef int32_t envid_t;
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
 
+// Special environment types, so that others can find them
+// (see ipc_find_env)
+enum EnvType {
+	ENV_TYPE_USER = 0,
+	ENV_TYPE_FS,			// File system server
+};
+
+// A small IPC message: a few words and a short buffer that the kernel
+// copies from sender to receiver (see sys_ipc_call_msg).
+#define IPC_NWORDS		4
+#define IPC_MSGBUF		64
+
+struct IpcMsg {
+	uint32_t msg_word[IPC_NWORDS];	// Message words
+	uint32_t msg_len;		// Bytes used in msg_buf
+	uint8_t msg_buf[IPC_MSGBUF];	// Message buffer
+};
+
+// A run of pages for a multi-page IPC transfer
+// (see sys_ipc_reply_waitv).
+#define IPC_MAXSEGS		16
+
+struct IpcSeg {
+	uintptr_t seg_va;		// First page of the run
+	uint32_t seg_npages;		// Number of pages
+	uint32_t seg_perm;		// Permissions to map them with
+};
+
+// Most messages an IPC mailbox can hold (see sys_ipc_mbox_setup).
+#define IPC_MBOXMAX		32
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	LIST_ENTRY(Env) env_link;	// Free list link pointers
 	envid_t env_id;			// Unique environment identifier
 	envid_t env_parent_id;		// env_id of this env's parent
 	unsigned env_status;		// Status of the environment
+	enum EnvType env_type;		// Special environment, if any
 	uint32_t env_runs;		// Number of times environment has run
 
 	// Address space
@@ -53,9 +85,40 @@ struct Env {
 	// Lab 4 IPC
 	bool env_ipc_recving;		// env is blocked receiving
 	void *env_ipc_dstva;		// va at which to map received page
+	uint32_t env_ipc_dstnpages;	// pages that fit at env_ipc_dstva
+	uint32_t env_ipc_npages;	// pages received with the last message
 	uint32_t env_ipc_value;		// data value sent to us 
 	envid_t env_ipc_from;		// envid of the sender	
 	int env_ipc_perm;		// perm of page mapping received
+	envid_t env_ipc_expect;		// only receive from this env, 0 for any
+	bool env_ipc_hasmsg;		// a message came with the value
+	struct IpcMsg env_ipc_msg;	// message received, if env_ipc_hasmsg
+
+	// Blocking IPC send (see sys_ipc_send)
+	struct Env *env_ipc_sendq;	// first env blocked sending to us
+	struct Env *env_ipc_sendq_tail;	// last env blocked sending to us
+	struct Env *env_ipc_sendq_next;	// next env in the queue we wait in
+	struct Env *env_ipc_send_to;	// env we're blocked sending to, or NULL
+	uint32_t env_ipc_send_value;	// value we're sending
+	void *env_ipc_send_srcva;	// page we're sending, 0 for none
+	int env_ipc_send_perm;		// perm of page we're sending
+	bool env_ipc_send_hasmsg;	// we're sending a message too
+	struct IpcMsg env_ipc_send_msg;	// message we're sending
+	bool env_ipc_send_call;		// wait for a reply once sent
+	uint64_t env_ipc_send_deadline;	// give up at this tick, 0 for never
+
+	// IPC mailbox (see sys_ipc_post)
+	struct Page *env_ipc_mbox;	// mailbox page, or NULL if none
+
+	// IPC alarm (see sys_ipc_alarm)
+	uint64_t env_ipc_alarm;		// goes off at this tick, 0 for none
+	struct Env *env_ipc_alarm_next;	// next in the list of alarms set
+
+	// Hardware interrupts (see sys_irq_attach)
+	uint16_t env_irq_pending;	// IRQs that came in, not yet received
+
+	// System call ring (see inc/ring.h)
+	struct Page *env_ring;		// ring page, or NULL if none registered
 };
 
 #endif // !JOS_INC_ENV_H
@@ -23,7 +23,8 @@
 #define E_BAD_PATH	12	// Bad path
 #define E_FILE_EXISTS	13	// File already exists
 #define E_NOT_EXEC	14	// File not a valid executable
+#define E_BUSY		15	// File is open for writing
 
-#define MAXERROR	14
+#define MAXERROR	15
 
 #endif	// !JOS_INC_ERROR_H */
@@ -23,17 +23,47 @@
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	(NINDIRECT * BLKSIZE)
+// An extent: a run of blocks of a file that are consecutive on disk
+struct Extent {
+	uint32_t e_fileblk;		// First block of the run in the file
+	uint32_t e_diskblk;		// First block of the run on disk
+	uint32_t e_nblocks;		// Blocks in the run
+};
+
+// Number of extents in a File descriptor
+#define NEXTENT		7
+// Number of extents in an extent block
+#define NBLKEXTENT	(BLKSIZE / sizeof(struct Extent))
+
+// Largest file with extents, and with block pointers
+#define MAXFILESIZE	0x40000000
+#define MAXBLKPTRSIZE	(NINDIRECT * BLKSIZE)
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		// Block pointers, on FS_MAGIC_BLKPTR file systems.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+
+		// Extents, on FS_MAGIC file systems, in order of
+		// e_fileblk.  A block is allocated iff an extent holds it.
+		// With f_extdepth 0, f_extents are the file's extents.
+		// With f_extdepth 1, each of f_extents is an extent block:
+		// e_diskblk holds e_nblocks extents, the first of which
+		// starts at e_fileblk.
+		struct {
+			uint32_t f_nextents;		// f_extents in use
+			uint32_t f_extdepth;		// 0 or 1
+			struct Extent f_extents[NEXTENT];
+		};
+	};
 
 	// Points to the directory in which this file lives.
 	// Meaningful only in memory; the value on disk can be garbage.
@@ -42,7 +72,8 @@ struct File {
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - sizeof(struct File*)];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 8 - sizeof(struct Extent)*NEXTENT
+		      - sizeof(struct File*)];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -55,10 +86,11 @@ struct File {
 
 // File system super-block (both in-memory and on-disk)
 
-#define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+#define FS_MAGIC	0x4A0530AF	// related vaguely to 'J\0S!'; extents
+#define FS_MAGIC_BLKPTR	0x4A0530AE	// older layout with block pointers
 
 struct Super {
-	uint32_t s_magic;		// Magic number: FS_MAGIC
+	uint32_t s_magic;		// FS_MAGIC or FS_MAGIC_BLKPTR
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
 };
@@ -81,8 +113,14 @@ struct Fsreq_open {
 struct Fsreq_map {
 	int req_fileid;
 	off_t req_offset;
+	int req_npages;		// map up to this many blocks, if > 1
+	int req_flags;		// FSMAP_ flags
 };
 
+// Fsreq_map flags
+#define FSMAP_NOSHARE	0x1	// map without PTE_SHARE
+#define FSMAP_SNAPSHOT	0x2	// map a copy-on-write snapshot (see serve_map)
+
 struct Fsreq_set_size {
 	int req_fileid;
 	off_t req_size;
@@ -21,14 +21,21 @@
 #include <inc/fd.h>
 #include <inc/args.h>
 #include <inc/malloc.h>
+#include <inc/time.h>
+#include <inc/thread.h>
 
 #define USED(x)		(void)(x)
 
+// Thread-local variables: every environment made by sfork() gets its
+// own copy of them, while the rest of memory is shared (see user/user.ld).
+#define __threadlocal	__attribute__((__section__(".tlsdata")))
+
 // libos.c or entry.S
 extern char *binaryname;
 extern volatile struct Env *env;
 extern volatile struct Env envs[NENV];
 extern volatile struct Page pages[];
+extern volatile struct Timepage timepage;
 void	exit(void);
 
 // pgfault.c
@@ -47,13 +54,39 @@ static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_exec(envid_t env);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_contig(envid_t env, void *pg, unsigned npages,
+			      int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_table_share(envid_t env, void *va, size_t len);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm,
+		     unsigned timeout);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_call_msg(envid_t to_env, uint32_t value,
+			 const struct IpcMsg *msg, void *rcv_pg,
+			 unsigned rcv_npages);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_reply_waitv(envid_t to_env, uint32_t value,
+			    const struct IpcSeg *segs, int nsegs, void *rcv_pg);
+int	sys_ipc_try_sendv(envid_t to_env, uint32_t value,
+			  const struct IpcSeg *segs, int nsegs);
+int	sys_ipc_mbox_setup(unsigned n);
+int	sys_ipc_post(envid_t to_env, uint32_t value, void *pg, int perm,
+		     const struct IpcMsg *msg);
+int	sys_ipc_poll(void *rcv_pg);
+int	sys_ipc_alarm(unsigned ms);
+int	sys_irq_attach(int irq);
+int	sys_irq_wait(void);
 int sys_phy_page(envid_t envid, void *va);
+int	sys_ring_setup(void *va);
+int	sys_ring_enter(void);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t sys_exofork(void) __attribute__((always_inline));
@@ -71,12 +104,31 @@ sys_exofork(void)
 
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	ipc_send_timeout(envid_t to_env, uint32_t value, void *pg, int perm,
+			 unsigned timeout);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t	ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t	ipc_call_msg(envid_t to_env, uint32_t value, const struct IpcMsg *msg,
+		     void *rcv_pg, unsigned rcv_npages, int *perm_store);
+int32_t	ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t	ipc_reply_waitv(envid_t to_env, uint32_t value,
+			const struct IpcSeg *segs, int nsegs,
+			envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int	ipc_post(envid_t to_env, uint32_t value, void *pg, int perm);
+int	ipc_poll(envid_t *from_env_store, uint32_t *value_store, void *pg,
+		 int *perm_store);
+envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+#define	PTE_COW		0x800
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void);
+void	cow_init(void);
 
 // fd.c
 int	close(int fd);
@@ -92,6 +144,7 @@ int	stat(const char *path, struct Stat *statbuf);
 // file.c
 int	open(const char *path, int mode);
 int	read_map(int fd, off_t offset, void **blk);
+int	read_snapshot(int fd, off_t offset, void *dst_va);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
@@ -99,6 +152,8 @@ int	sync(void);
 // fsipc.c
 int	fsipc_open(const char *path, int omode, struct Fd *fd);
 int	fsipc_map(int fileid, off_t offset, void *dst_va);
+int	fsipc_map_run(int fileid, off_t offset, void *dst_va, int npages);
+int	fsipc_map_snapshot(int fileid, off_t offset, void *dst_va);
 int	fsipc_set_size(int fileid, off_t size);
 int	fsipc_close(int fileid);
 int	fsipc_dirty(int fileid, off_t offset);
@@ -111,6 +166,8 @@ int	pageref(void *addr);
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
+int	exec(const char *program, const char **argv);
+int	execl(const char *program, const char *arg0, ...);
 
 // console.c
 void	cputchar(int c);
@@ -125,6 +182,30 @@ int	pipeisclosed(int pipefd);
 // wait.c
 void	wait(envid_t env);
 
+// ring.c
+int	ring_page_alloc(envid_t env, void *pg, int perm);
+int	ring_page_map(envid_t src_env, void *src_pg,
+		      envid_t dst_env, void *dst_pg, int perm);
+int	ring_page_unmap(envid_t env, void *pg);
+int	ring_env_set_status(envid_t env, int status);
+int	ring_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	ring_ipc_post(envid_t to_env, uint32_t value, void *pg, int perm,
+		      const struct IpcMsg *msg);
+int	ring_flush(void);
+
+// time.c
+int	clock_gettime(int clockid, struct timespec *ts);
+
+// thread.c
+int	thread_create(thread_t *tid, void *(*func)(void *), void *arg);
+int	thread_join(thread_t tid, void **result_store);
+void	thread_exit(void *result) __attribute__((noreturn));
+void	mutex_lock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
+void	cond_wait(struct cond *c, struct mutex *m);
+void	cond_signal(struct cond *c);
+void	cond_broadcast(struct cond *c);
+
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
 #define	O_WRONLY	0x0001		/* open for writing only */
@@ -1,6 +1,12 @@
 #ifndef JOS_INC_MALLOC_H
 #define JOS_INC_MALLOC_H 1
 
+// The address space malloc() hands out.  Threads made with sfork()
+// share its page tables, so they see the memory malloc() maps later
+// (see lib/malloc.c).
+#define MALLOCBASE	0x08000000
+#define MALLOCTOP	0x10000000
+
 void *malloc(size_t size);
 void free(void *addr);
 
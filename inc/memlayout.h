@@ -45,13 +45,15 @@
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *    UENVS     ---->  +------------------------------+ 0xeec00000
+ *                     |           RO CLOCK           | R-/R-  PTSIZE
+ * UTOP,UTIME ------>  +------------------------------+ 0xee800000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee7ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee7fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee7fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -107,13 +109,15 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only clock page (struct Timepage, see inc/time.h)
+#define UTIME		(UENVS - PTSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
  */
 
 // Top of user-accessible VM
-#define UTOP		UENVS
+#define UTOP		UTIME
 // Top of one-page user exception stack
 #define UXSTACKTOP	UTOP
 // Next page left invalid to guard against exception stack overflow; then:
@@ -130,6 +134,14 @@
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)	
+// Bottom of the file data area; the file descriptor table takes the
+// PTSIZE below it (see lib/fd.c)
+#define FILEBASE	0xD0000000
+// The system call ring page, just below the file descriptor table
+#define RINGVA		(FILEBASE - PTSIZE - PGSIZE)
+
+// Most pages sys_page_alloc_contig allocates in one piece
+#define PAGE_CONTIG_MAX	16
 
 
 #ifndef __ASSEMBLER__
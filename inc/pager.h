@@ -0,0 +1,46 @@
+#ifndef JOS_INC_PAGER_H
+#define JOS_INC_PAGER_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+// Demand loading.
+// spawn() leaves the text segments of a program unmapped and describes
+// them in a pager table instead.  The first touch of one of their pages
+// faults, and the page fault upcall asks the file server for the page
+// (see lib/pager.c).  The kernel does not fault pages in for system
+// calls, so the other read-only segments, which hold data programs
+// hand to system calls and the stabs the kernel reads, are loaded up
+// front.  So is the page where a text segment's file part ends, if
+// the segment goes on past it, since the rest of that page must be
+// zero.
+//
+// The pager table lives at PAGERVA, below the system call ring page,
+// and the struct Fd of each file it pages from at
+// PAGERFD(i): file 0 is the program, file 1 the shared library, if
+// the program uses it.  The Fd pages keep the files open for as long
+// as the program runs.  All are mapped read-only and without
+// PTE_SHARE, so fork() children share them but spawn() does not pass
+// them on.
+#define PAGER_NFILES	2	// Files a pager table can page from
+#define PAGERVA		(RINGVA - (PAGER_NFILES + 1) * PGSIZE)
+#define PAGERFD(i)	(PAGERVA + ((i) + 1) * PGSIZE)
+
+#define PAGER_MAXSEGS	8	// Segments a pager table can describe
+#define PAGER_CLUSTER	4	// Pages to fetch per fault, at most
+
+struct PagerSeg {
+	int ps_file;			// Which file: PAGERFD(ps_file)
+	uintptr_t ps_va;		// First address of the segment
+	uint32_t ps_memsz;		// Size in memory
+	uint32_t ps_filesz;		// Size in the file; the rest is zero
+	uint32_t ps_offset;		// Offset in the file
+};
+
+struct Pager {
+	int pg_nsegs;
+	struct PagerSeg pg_segs[PAGER_MAXSEGS];
+};
+
+#endif /* !JOS_INC_PAGER_H */
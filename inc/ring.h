@@ -0,0 +1,45 @@
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+
+// System call rings.
+// An environment can register one page holding a submission queue
+// and a completion queue with sys_ring_setup().  It queues system
+// calls by filling in submission entries and advancing sq_tail;
+// the kernel runs them in order only when the environment calls
+// sys_ring_enter(), and posts one completion entry per call.
+// That way a batch of N page-mapping calls costs one trap, not N.
+//
+// The indexes are free-running; entry i lives in slot i % RING_NENTRIES.
+// The environment only writes sq_tail and cq_head, the kernel only
+// writes sq_head and cq_tail.  The kernel stops consuming submissions
+// while the completion queue is full.
+//
+// Only calls that cannot block are allowed in a ring: SYS_page_alloc,
+// SYS_page_map, SYS_page_unmap, SYS_env_set_status,
+// SYS_ipc_try_send and SYS_ipc_post.  Anything else completes with -E_INVAL.
+
+#define RING_NENTRIES	64		// Must be a power of 2
+
+struct RingSqe {
+	uint32_t sqe_op;		// System call number
+	uint32_t sqe_tag;		// Copied into the completion entry
+	uint32_t sqe_args[5];		// System call arguments a1..a5
+};
+
+struct RingCqe {
+	uint32_t cqe_tag;		// sqe_tag of the finished call
+	int32_t cqe_result;		// Its return value
+};
+
+struct Ring {
+	volatile uint32_t sq_head;	// Next submission the kernel runs
+	volatile uint32_t sq_tail;	// Next free submission slot
+	volatile uint32_t cq_head;	// Next completion to reap
+	volatile uint32_t cq_tail;	// Next free completion slot
+	struct RingSqe sq[RING_NENTRIES];
+	struct RingCqe cq[RING_NENTRIES];
+};
+
+#endif /* !JOS_INC_RING_H */
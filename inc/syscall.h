@@ -19,6 +19,23 @@ enum
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_call_msg,
+	SYS_ipc_reply_wait,
+	SYS_ipc_reply_waitv,
+	SYS_ipc_try_sendv,
+	SYS_ipc_mbox_setup,
+	SYS_ipc_post,
+	SYS_ipc_poll,
+	SYS_ipc_alarm,
+	SYS_irq_attach,
+	SYS_irq_wait,
+	SYS_ring_setup,
+	SYS_ring_enter,
+	SYS_env_exec,
+	SYS_page_alloc_contig,
+	SYS_page_table_share,
 	NSYSCALLS
 };
 
@@ -0,0 +1,33 @@
+#ifndef JOS_INC_THREAD_H
+#define JOS_INC_THREAD_H
+
+#include <inc/types.h>
+
+// User-level threads (see lib/thread.c).
+
+// Most threads a program can have at once, the main thread included
+#define NTHREAD		32
+
+typedef int thread_t;
+
+struct uthread;
+
+// A mutex.  All zeros is an unlocked mutex.
+// Mutexes and condition variables must live in memory that all the
+// threads share, such as global variables, not on a thread's stack.
+struct mutex {
+	volatile uint32_t m_guard;	// Protects the other fields
+	bool m_locked;			// Somebody holds the mutex
+	struct uthread *m_waiters;	// Threads waiting for it, in order
+	struct uthread *m_waiters_tail;
+};
+
+// A condition variable.  All zeros is a condition variable
+// that nobody is waiting on.
+struct cond {
+	volatile uint32_t c_guard;	// Protects the other fields
+	struct uthread *c_waiters;	// Threads waiting on it, in order
+	struct uthread *c_waiters_tail;
+};
+
+#endif /* !JOS_INC_THREAD_H */
@@ -0,0 +1,36 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// The clock page.
+// The kernel keeps one of these up to date on every timer interrupt
+// and maps it read-only at UTIME in every environment, so user code
+// can read the time without a system call (see lib/time.c).
+//
+// Readers must follow the sequence lock: retry if tp_seq is odd
+// (an update is in progress) or changes while the other fields are
+// being read.
+struct Timepage {
+	volatile uint32_t tp_seq;	// Sequence count, odd while updating
+	uint32_t tp_hz;			// Timer interrupts per second
+	uint64_t tp_ticks;		// Timer interrupts since boot
+	uint64_t tp_tsc;		// Time stamp counter at the last tick
+	uint32_t tp_tsc_per_tick;	// TSC cycles per timer tick, 0 if no TSC
+	uint32_t tp_tsc_mult;		// ns = (cycles * tp_tsc_mult)
+	uint32_t tp_tsc_shift;		//      >> tp_tsc_shift
+	uint32_t tp_boot_sec;		// RTC wall time at boot, seconds since 1970
+};
+
+// Clock IDs for clock_gettime()
+#define CLOCK_REALTIME	0	// Wall-clock time
+#define CLOCK_MONOTONIC	1	// Time since boot
+
+#define NSEC_PER_SEC	1000000000
+
+struct timespec {
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+};
+
+#endif /* !JOS_INC_TIME_H */
@@ -32,10 +32,15 @@
 // Hardware IRQ numbers. We receive these as (IRQ_OFFSET+IRQ_WHATEVER)
 #define IRQ_TIMER        0
 #define IRQ_KBD          1
+#define IRQ_SERIAL       4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 #define IRQ_SPURIOUS    31
 
+// The IPC value that delivers IRQ 'irq' to the environment attached
+// to it (see sys_irq_attach).  It comes from the environment itself.
+#define IPC_IRQ(irq)	(0x80000000 | (irq))
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
@@ -34,6 +34,21 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline bool cpu_has_sysenter(void);
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
+static __inline int bsf(uint32_t x) __attribute__((always_inline));
+
+// Model-specific registers used to configure sysenter/sysexit.
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+// CPUID leaf 1 %edx feature bits
+#define CPUID_FEAT_TSC		0x00000010	// Time stamp counter
+#define CPUID_FEAT_MSR		0x00000020	// rdmsr/wrmsr
+#define CPUID_FEAT_SEP		0x00000800	// sysenter/sysexit
 
 static __inline void
 breakpoint(void)
@@ -274,4 +289,58 @@ read_tsc(void)
         return tsc;
 }
 
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+// Does this processor really implement sysenter/sysexit?
+// The original Pentium Pro (family 6, model < 3, stepping < 3)
+// sets the SEP bit even though it does not.
+static __inline bool
+cpu_has_sysenter(void)
+{
+	uint32_t eax, edx;
+
+	cpuid(1, &eax, 0, 0, &edx);
+	if (!(edx & CPUID_FEAT_SEP))
+		return 0;
+	if (((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3 && (eax & 0xF) < 3)
+		return 0;
+	return 1;
+}
+
+// Atomically store 'newval' in *addr and return the old value.
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	__asm __volatile("lock; xchgl %0, %1" :
+			 "+m" (*addr), "=a" (result) :
+			 "1" (newval) :
+			 "cc", "memory");
+	return result;
+}
+
+// Return the index of the lowest set bit in x, which must not be 0.
+static __inline int
+bsf(uint32_t x)
+{
+	int index;
+
+	__asm __volatile("bsfl %1, %0" : "=r" (index) : "rm" (x) : "cc");
+	return index;
+}
+
 #endif /* !JOS_INC_X86_H */
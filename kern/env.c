@@ -11,10 +11,12 @@
 #include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/monitor.h>
+#include <kern/syscall.h>
 #include <kern/sched.h>
 
 struct Env *envs = NULL;		// All environments
 struct Env *curenv = NULL;	        // The current env
+struct Trapframe *curtf = NULL;		// See env_trapframe()
 static struct Env_list env_free_list;	// Free list
 
 #define ENVGENSHIFT	12		// >= LOGNENV
@@ -63,6 +65,36 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// While the kernel handles a trap from user mode, curenv's trap-time
+// registers stay in the Trapframe that the trap entry code pushed on
+// the kernel stack, and 'curtf' points at it.  curenv->env_tf is stale
+// until env_save_tf() copies them out, which happens only when we
+// switch to another environment.  If curenv keeps running, the trap
+// returns with iret straight from the kernel stack and nothing is
+// copied at all.
+//
+// Returns the up-to-date register state of environment 'e'.
+//
+struct Trapframe *
+env_trapframe(struct Env *e)
+{
+	if (e == curenv && curtf)
+		return curtf;
+	return &e->env_tf;
+}
+
+//
+// Save curenv's live trap-time registers into curenv->env_tf.
+//
+void
+env_save_tf(void)
+{
+	if (curenv && curtf)
+		curenv->env_tf = *curtf;
+	curtf = NULL;
+}
+
 //
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
@@ -163,6 +195,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_status = ENV_RUNNABLE;
+	e->env_type = ENV_TYPE_USER;
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -192,6 +225,17 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_expect = 0;
+	e->env_ipc_sendq = e->env_ipc_sendq_tail = NULL;
+	e->env_ipc_sendq_next = e->env_ipc_send_to = NULL;
+	e->env_ipc_send_deadline = 0;
+	e->env_ipc_mbox = NULL;
+	e->env_ipc_alarm = 0;
+	e->env_ipc_alarm_next = NULL;
+	e->env_irq_pending = 0;
+
+	// No system call ring until the environment registers one.
+	e->env_ring = NULL;
 
 	// If this is the file server (e == &envs[1]) give it I/O privileges.
 	// LAB 5: Your code here.
@@ -239,6 +283,49 @@ segment_alloc(struct Env *e, void *va, size_t len)
 	}
 }
 
+//
+// Map the pages of read-only segment 'ph' of the program image
+// 'binary' straight from the kernel's copy of the image, without
+// copying them, as far as that can be done: the image must start on a
+// page boundary (see kernel.ld), and each page must hold only file
+// contents, none of the segment's zero-filled tail, and must not run
+// past the image's last page.
+// Returns the address up to which the segment is mapped;
+// the caller loads the rest.
+//
+static uintptr_t
+segment_map_image(struct Env *e, uint8_t *binary, size_t size,
+		  struct Proghdr *ph)
+{
+	struct Page *pp;
+	uintptr_t va, end;
+	uint8_t *src;
+	int r;
+
+	va = ROUNDDOWN(ph->p_va, PGSIZE);
+	src = binary + ROUNDDOWN(ph->p_offset, PGSIZE);
+	if ((ph->p_flags & ELF_PROG_FLAG_WRITE) || PGOFF(binary) != 0
+	    || PGOFF(ph->p_offset) != PGOFF(ph->p_va))
+		return va;
+
+	end = ph->p_va + ph->p_filesz;
+	if (ph->p_memsz == ph->p_filesz)
+		end = ROUNDUP(end, PGSIZE);
+	end = MIN(end, va + (ROUNDUP(binary + size, PGSIZE) - src));
+
+	for (; va + PGSIZE <= end; va += PGSIZE, src += PGSIZE) {
+		// Pages of the kernel image are not counted as allocated,
+		// so give the kernel's copy a reference of its own that is
+		// never dropped: unmapping must not free the page.
+		pp = pa2page(PADDR(src));
+		if (pp->pp_ref == 0)
+			pp->pp_ref = 1;
+		if ((r = page_insert(e->env_pgdir, pp, (void *) va, PTE_U)) < 0)
+			panic("segment_map_image: %e", r);
+	}
+	return va;
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -295,6 +382,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	// LAB 3: Your code here.
 	struct Page *p;
 	struct Proghdr *ph;
+	uintptr_t va, fileend, memend;
 	int r, ph_num;
 
 	// basic sanity check for elf image
@@ -307,10 +395,20 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	lcr3(e->env_cr3);
 	while (--ph_num >= 0) {
 		if (ph->p_type == ELF_PROG_LOAD) {
-			segment_alloc(e, (void *)ph->p_va, ph->p_memsz);
-
-			memmove((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-			memset((void *)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
+			// Text is mapped in place where it can be; the rest
+			// of the segment gets fresh pages and a copy.
+			va = segment_map_image(e, binary, size, ph);
+			va = MAX(va, ph->p_va);
+			fileend = ph->p_va + ph->p_filesz;
+			memend = ph->p_va + ph->p_memsz;
+			if (va < memend)
+				segment_alloc(e, (void *)va, memend - va);
+			if (va < fileend)
+				memmove((void *)va, binary + ph->p_offset + (va - ph->p_va),
+					fileend - va);
+			va = MAX(va, fileend);
+			if (va < memend)
+				memset((void *)va, 0, memend - va);
 		}
 		ph++;
 	}
@@ -334,14 +432,14 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 // Allocates a new env and loads the named elf binary into it.
 // This function is ONLY called during kernel initialization,
 // before running the first user-mode environment.
-// The new env's parent ID is set to 0.
+// The new env's parent ID is set to 0, and its type to 'type'.
 //
 // Where does the result go? 
 // By convention, envs[0] is the first environment allocated, so
 // whoever calls env_create simply looks for the newly created
 // environment there. 
 void
-env_create(uint8_t *binary, size_t size)
+env_create(uint8_t *binary, size_t size, enum EnvType type)
 {
 	// LAB 3: Your code here.
 	struct Env *e;
@@ -349,6 +447,7 @@ env_create(uint8_t *binary, size_t size)
 
 	if ((r = env_alloc(&e, 0)) < 0)
 		panic("env_create: %e", r);
+	e->env_type = type;
 
 	load_icode(e, binary, size);
 }
@@ -366,12 +465,23 @@ env_free(struct Env *e)
 	// If freeing the current environment, switch to boot_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
 		lcr3(boot_cr3);
+		curtf = NULL;
+	}
+
+	// Wake up anybody blocked sending to or calling e
+	ipc_env_free(e);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Drop the kernel's reference to the system call ring
+	if (e->env_ring) {
+		page_decref(e->env_ring);
+		e->env_ring = NULL;
+	}
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -384,8 +494,11 @@ env_free(struct Env *e)
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
+		// unmap all PTEs in this page table, unless other
+		// environments still use it (see sys_page_table_share)
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+			if (pa2page(pa)->pp_ref > 1)
+				break;
 			if (pt[pteno] & PTE_P)
 				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
 		}
@@ -463,6 +576,18 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
+	struct Trapframe *tf;
+
+	// Resuming the environment that just trapped:
+	// return straight from its registers on the kernel stack.
+	if (e == curenv && curtf) {
+		tf = curtf;
+		curtf = NULL;
+		e->env_runs++;
+		env_pop_tf(tf);
+	}
+
+	env_save_tf();
 	curenv = e;
 	e->env_runs++;
 	lcr3(e->env_cr3);
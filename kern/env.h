@@ -13,16 +13,19 @@
 
 extern struct Env *envs;		// All environments
 extern struct Env *curenv;	        // Current environment
+extern struct Trapframe *curtf;		// curenv's live trap-time registers
 
 LIST_HEAD(Env_list, Env);		// Declares 'struct Env_list'
 
 void	env_init(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
-void	env_create(uint8_t *binary, size_t size);
+void	env_create(uint8_t *binary, size_t size, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+struct Trapframe *env_trapframe(struct Env *e);
+void	env_save_tf(void);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -30,14 +33,14 @@ void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 // For the grading script
 #define ENV_CREATE2(start, size)	{		\
 	extern uint8_t start[], size[];			\
-	env_create(start, (int)size);			\
+	env_create(start, (int)size, ENV_TYPE_USER);	\
 }
 
-#define ENV_CREATE(x)			{		\
+#define ENV_CREATE(x, type)		{		\
 	extern uint8_t _binary_obj_##x##_start[],	\
 		_binary_obj_##x##_size[];		\
 	env_create(_binary_obj_##x##_start,		\
-		(int)_binary_obj_##x##_size);		\
+		(int)_binary_obj_##x##_size, type);	\
 }
 
 #endif // !JOS_KERN_ENV_H
@@ -42,10 +42,10 @@ i386_init(void)
 	kclock_init();
 
 	// Should always have an idle process as first one.
-	ENV_CREATE(user_idle);
+	ENV_CREATE(user_idle, ENV_TYPE_USER);
 
 	// Start fs.
-	ENV_CREATE(fs_fs);
+	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
 	// Start init
 #if defined(TEST)
@@ -53,9 +53,9 @@ i386_init(void)
 	ENV_CREATE2(TEST, TESTSIZE);
 #else
 	// Touch all you want.
-	ENV_CREATE(user_icode);
-	// ENV_CREATE(user_pipereadeof);
-	// ENV_CREATE(user_pipewriteeof);
+	ENV_CREATE(user_icode, ENV_TYPE_USER);
+	// ENV_CREATE(user_pipereadeof, ENV_TYPE_USER);
+	// ENV_CREATE(user_pipewriteeof, ENV_TYPE_USER);
 #endif
 
 	// Should not be necessary - drain keyboard because interrupt has given up.
@@ -3,6 +3,9 @@
 /* Support for two time-related hardware gadgets: 1) the run time
  * clock with its NVRAM access functions; 2) the 8253 timer, which
  * generates interrupts on IRQ 0.
+ *
+ * Both feed the clock page (struct Timepage) that every environment
+ * sees read-only at UTIME.
  */
 
 #include <inc/x86.h>
@@ -13,6 +16,9 @@
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 
+// The clock page, allocated and mapped at UTIME by i386_vm_init().
+struct Timepage *timepage;
+
 unsigned
 mc146818_read(unsigned reg)
 {
@@ -27,15 +33,130 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC+1, datum);
 }
 
+// RTC registers hold BCD unless MC_REGB_BINARY is set.
+static unsigned
+rtc_decode(unsigned v, bool binary)
+{
+	if (binary)
+		return v;
+	return (v & 0x0F) + (v >> 4) * 10;
+}
+
+// Read the wall-clock time from the RTC in seconds since 1970-01-01,
+// assuming the RTC keeps UTC.
+static uint32_t
+rtc_read_time(void)
+{
+	unsigned sec, min, hour, day, mon, year, b, pm;
+	unsigned era, yoe, doy, doe;
+	bool binary;
+
+	// Don't read the registers in the middle of an update.
+	while (mc146818_read(MC_REGA) & MC_REGA_UIP)
+		/* do nothing */;
+
+	b = mc146818_read(MC_REGB);
+	binary = (b & MC_REGB_BINARY) != 0;
+	sec = rtc_decode(mc146818_read(MC_SEC), binary);
+	min = rtc_decode(mc146818_read(MC_MIN), binary);
+	hour = mc146818_read(MC_HOUR);
+	pm = hour & 0x80;
+	hour = rtc_decode(hour & 0x7F, binary);
+	if (!(b & MC_REGB_24HR))
+		hour = (hour % 12) + (pm ? 12 : 0);
+	day = rtc_decode(mc146818_read(MC_DAY), binary);
+	mon = rtc_decode(mc146818_read(MC_MONTH), binary);
+	year = rtc_decode(mc146818_read(MC_YEAR), binary);
+	if (rtc_decode(mc146818_read(NVRAM_CENTURY), binary) == 19)
+		year += 1900;
+	else
+		year += 2000;
+
+	// Days since the epoch, counting years from March so that
+	// the leap day is the last day of the year.
+	if (mon <= 2)
+		year--;
+	era = year / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return ((era * 146097 + doe - 719468) * 24 + hour) * 3600
+		+ min * 60 + sec;
+}
+
+// Count TSC cycles across one timer period, using PIT channel 2
+// (the speaker timer) gated on but with the speaker turned off.
+// Returns 0 if the processor has no TSC.
+static uint32_t
+tsc_calibrate(void)
+{
+	uint32_t edx;
+	uint64_t t0, t1;
+	uint8_t port;
+
+	cpuid(1, 0, 0, 0, &edx);
+	if (!(edx & CPUID_FEAT_TSC))
+		return 0;
+
+	port = inb(0x61);
+	outb(0x61, (port & ~0x02) | 0x01);
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(TIMER_CNTR2, TIMER_DIV(KCLOCK_HZ) % 256);
+	outb(TIMER_CNTR2, TIMER_DIV(KCLOCK_HZ) / 256);
+	t0 = read_tsc();
+	while (!(inb(0x61) & 0x20))
+		/* do nothing */;
+	t1 = read_tsc();
+	outb(0x61, port);
+
+	return (uint32_t) (t1 - t0);
+}
+
 void
 kclock_init(void)
 {
-	/* initialize 8253 clock to interrupt 100 times/sec */
+	uint32_t cycles, shift;
+	uint64_t mult;
+
+	// Fill in the clock page before user environments can see it.
+	cycles = tsc_calibrate();
+	timepage->tp_hz = KCLOCK_HZ;
+	timepage->tp_tsc_per_tick = cycles;
+	if (cycles) {
+		// The most precise multiplier that fits in 32 bits: a TSC
+		// slower than 1 GHz has fewer cycles per tick than
+		// nanoseconds, and needs a smaller shift.
+		for (shift = 32; shift > 0; shift--) {
+			mult = ((uint64_t) (NSEC_PER_SEC / KCLOCK_HZ) << shift)
+				/ cycles;
+			if (mult <= 0xFFFFFFFF)
+				break;
+		}
+		timepage->tp_tsc_mult = mult;
+		timepage->tp_tsc_shift = shift;
+	}
+	timepage->tp_tsc = read_tsc();
+	timepage->tp_boot_sec = rtc_read_time();
+	cprintf("	TSC: %u cycles per tick, boot time %u\n",
+		cycles, timepage->tp_boot_sec);
+
+	/* initialize 8253 clock to interrupt KCLOCK_HZ times/sec */
 	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
-	outb(IO_TIMER1, TIMER_DIV(100) % 256);
-	outb(IO_TIMER1, TIMER_DIV(100) / 256);
+	outb(IO_TIMER1, TIMER_DIV(KCLOCK_HZ) % 256);
+	outb(IO_TIMER1, TIMER_DIV(KCLOCK_HZ) / 256);
 	cprintf("	Setup timer interrupts via 8259A\n");
 	irq_setmask_8259A(irq_mask_8259A & ~(1<<0));
 	cprintf("	unmasked timer interrupt\n");
 }
 
+// Called on every timer interrupt: advance the clock page.
+void
+kclock_tick(void)
+{
+	timepage->tp_seq++;
+	asm volatile("" : : : "memory");
+	timepage->tp_ticks++;
+	timepage->tp_tsc = read_tsc();
+	asm volatile("" : : : "memory");
+	timepage->tp_seq++;
+}
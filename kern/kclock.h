@@ -6,8 +6,25 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/time.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
+/* RTC time-of-day registers */
+#define MC_SEC		0x00	/* seconds */
+#define MC_MIN		0x02	/* minutes */
+#define MC_HOUR		0x04	/* hours; bit 7 is PM in 12-hour mode */
+#define MC_DAY		0x07	/* day of month */
+#define MC_MONTH	0x08	/* month */
+#define MC_YEAR		0x09	/* year within century */
+#define MC_REGA		0x0a	/* status register A */
+#define  MC_REGA_UIP	0x80	/*   update in progress */
+#define MC_REGB		0x0b	/* status register B */
+#define  MC_REGB_24HR	0x02	/*   24-hour mode */
+#define  MC_REGB_BINARY	0x04	/*   binary (not BCD) values */
+
+#define KCLOCK_HZ	100	/* timer interrupts per second */
+
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
 #define	MC_NVRAM_SIZE	50	/* 50 bytes of NVRAM */
 
@@ -29,5 +46,8 @@
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 void kclock_init(void);
+void kclock_tick(void);
+
+extern struct Timepage *timepage;
 
 #endif	// !JOS_KERN_KCLOCK_H
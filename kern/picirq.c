@@ -83,3 +83,12 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+// Acknowledge IRQ 'irq'.  The master is in automatic EOI mode, but the
+// slave is not, so an IRQ that comes through the slave must be
+// acknowledged there before it can come in again.
+void
+irq_eoi(int irq)
+{
+	if (irq >= 8)
+		outb(IO_PIC2, 0x20);
+}
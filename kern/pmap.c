@@ -195,6 +195,11 @@ i386_vm_init(void)
 	env_size = ROUNDUP((sizeof(struct Env) * NENV), PGSIZE);
 	envs = boot_alloc(env_size, PGSIZE);
 
+	//////////////////////////////////////////////////////////////////////
+	// Make 'timepage' point to the page the clock is published in.
+	timepage = boot_alloc(PGSIZE, PGSIZE);
+	memset(timepage, 0, PGSIZE);
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -226,6 +231,13 @@ i386_vm_init(void)
 	//    - the image of envs mapped at UENVS  -- kernel R, user R
 	boot_map_segment(pgdir, UENVS, env_size, PADDR(envs), PTE_U);
 
+	//////////////////////////////////////////////////////////////////////
+	// Map the clock page read-only by the user at linear address UTIME.
+	// Permissions:
+	//    - timepage itself -- kernel RW, user NONE
+	//    - the image mapped at UTIME -- kernel R, user R
+	boot_map_segment(pgdir, UTIME, PGSIZE, PADDR(timepage), PTE_U);
+
 	//////////////////////////////////////////////////////////////////////
 	// Map the kernel stack (symbol name "bootstack").  The complete VA
 	// range of the stack, [KSTACKTOP-PTSIZE, KSTACKTOP), breaks into two
@@ -388,6 +400,9 @@ check_boot_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check clock page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timepage));
+
 	// check phys mem
 	for (i = 0; i < npage; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -404,6 +419,7 @@ check_boot_pgdir(void)
 		case PDX(KSTACKTOP-1):
 		case PDX(UPAGES):
 		case PDX(UENVS):
+		case PDX(UTIME):
 			assert(pgdir[i]);
 			break;
 		default:
@@ -532,6 +548,45 @@ page_alloc(struct Page **pp_store)
 	return -E_NO_MEM;
 }
 
+// Is 'pp' on the free list?  A page that was taken off the list may
+// still point back into it, but that slot no longer points to the page.
+static bool
+page_is_free(struct Page *pp)
+{
+	return pp->pp_link.le_prev && *pp->pp_link.le_prev == pp;
+}
+
+//
+// Allocates 'n' physical pages that are next to each other, for
+// devices that need a DMA buffer larger than a page in one piece.
+// *pp_store is set to the first; the others follow it in pages[].
+// Each is like a page from page_alloc.  This looks at every page,
+// so keep it out of anything that runs often.
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- if there is no such run of free pages
+//
+int
+page_alloc_contig(size_t n, struct Page **pp_store)
+{
+	size_t i, run;
+
+	if (n == 0)
+		return -E_NO_MEM;
+	for (i = 0, run = 0; i < npage && run < n; i++)
+		run = page_is_free(&pages[i]) ? run + 1 : 0;
+	if (run < n)
+		return -E_NO_MEM;
+
+	for (i -= n; run > 0; run--, i++) {
+		LIST_REMOVE(&pages[i], pp_link);
+		page_initpp(&pages[i]);
+	}
+	*pp_store = &pages[i - n];
+	return 0;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/ring.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -11,6 +12,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -91,7 +94,7 @@ sys_exofork(void)
 		return -E_NO_FREE_ENV;
 
 	child->env_status = ENV_NOT_RUNNABLE;
-	child->env_tf = curenv->env_tf;
+	child->env_tf = *env_trapframe(curenv);
 	// install the pgfault upcall to the child
 	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
 	// tweak the register eax of the child,
@@ -154,7 +157,7 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	if ((r = envid2env(envid, &task, 1)) < 0)
 		return -E_BAD_ENV;
 
-	task->env_tf = *tf;
+	*env_trapframe(task) = *tf;
 
 	return 0;
 }
@@ -214,9 +217,6 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (envid2env(envid, &task, 1) < 0)
 		return -E_BAD_ENV;
 
-	if (page_alloc(&page) < 0)
-		return -E_NO_MEM;
-
 	if ((unsigned int)va >= UTOP || va != ROUNDDOWN(va, PGSIZE))
 		return -E_INVAL;
 
@@ -227,6 +227,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (perm & ((~(PTE_U | PTE_P | PTE_W | PTE_AVAIL)) & 0xfff))
 		return -E_INVAL;
 
+	if (page_alloc(&page) < 0)
+		return -E_NO_MEM;
+
 	memset(page2kva(page), 0, PGSIZE);
 	if (page_insert(task->env_pgdir, page, va, perm) < 0) {
 		page_free(page);
@@ -237,6 +240,53 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return 0;
 }
 
+// Allocate 'npages' pages of memory that are next to each other in
+// physical memory, and map them in order from 'va' in envid's
+// address space with permission 'perm', as sys_page_alloc does one.
+// For drivers whose devices need a DMA buffer in one piece.
+//
+// Return 0 on success, < 0 on error.  Errors are those of
+// sys_page_alloc, plus:
+//	-E_INVAL if npages is 0 or more than PAGE_CONTIG_MAX,
+//		or the pages would reach UTOP.
+//	-E_NO_MEM if there is no run of npages free pages.
+static int
+sys_page_alloc_contig(envid_t envid, void *va, uint32_t npages, int perm)
+{
+	struct Env *task;
+	struct Page *page;
+	uint32_t i, j;
+
+	if (envid2env(envid, &task, 1) < 0)
+		return -E_BAD_ENV;
+
+	if ((uintptr_t) va >= UTOP || va != ROUNDDOWN(va, PGSIZE)
+	    || npages == 0 || npages > PAGE_CONTIG_MAX
+	    || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	if (!(perm & PTE_U) || !(perm & PTE_P)
+	    || (perm & ((~(PTE_U | PTE_P | PTE_W | PTE_AVAIL)) & 0xfff)))
+		return -E_INVAL;
+
+	if (page_alloc_contig(npages, &page) < 0)
+		return -E_NO_MEM;
+
+	for (i = 0; i < npages; i++) {
+		memset(page2kva(&page[i]), 0, PGSIZE);
+		if (page_insert(task->env_pgdir, &page[i],
+				(char *) va + i * PGSIZE, perm) < 0) {
+			// the pages mapped so far go back when unmapped
+			for (j = i; j < npages; j++)
+				page_free(&page[j]);
+			while (i-- > 0)
+				page_remove(task->env_pgdir,
+					    (char *) va + i * PGSIZE);
+			return -E_NO_MEM;
+		}
+	}
+	return 0;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -324,6 +374,608 @@ sys_page_unmap(envid_t envid, void *va)
 	return 0;
 }
 
+// Make environment 'envid' use the caller's page tables for the 'len'
+// bytes of address space from 'va', allocating any the caller does not
+// have yet, so that pages either of them maps or unmaps there later
+// show up in both (see sfork() in lib/fork.c).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or is not a child of the caller.
+//	-E_INVAL if envid is the caller, va or len is not a multiple of
+//		PTSIZE, the range goes past UTOP, or envid already has
+//		a page table in it.
+//	-E_NO_MEM if there is no memory for a page table.
+static int
+sys_page_table_share(envid_t envid, void *va, size_t len)
+{
+	struct Env *e;
+	struct Page *pt;
+	uintptr_t start = (uintptr_t) va, a;
+
+	if (envid2env(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	if (e == curenv || start % PTSIZE != 0 || len % PTSIZE != 0
+	    || start > UTOP || len > UTOP - start)
+		return -E_INVAL;
+	for (a = start; a < start + len; a += PTSIZE)
+		if (e->env_pgdir[PDX(a)] & PTE_P)
+			return -E_INVAL;
+
+	for (a = start; a < start + len; a += PTSIZE)
+		if (!pgdir_walk(curenv->env_pgdir, (void *) a, 1))
+			return -E_NO_MEM;
+	for (a = start; a < start + len; a += PTSIZE) {
+		pt = pa2page(PTE_ADDR(curenv->env_pgdir[PDX(a)]));
+		pt->pp_ref++;
+		e->env_pgdir[PDX(a)] = curenv->env_pgdir[PDX(a)];
+	}
+	return 0;
+}
+
+// Number of environments blocked in sys_ipc_send with a timeout,
+// so that ipc_tick() can skip its scan when there are none.
+static int ipc_ntimed;
+// Environments with an alarm set, soonest first (see sys_ipc_alarm)
+static struct Env *ipc_alarms;
+
+// An IPC mailbox: a ring of messages posted to an environment that
+// was not receiving at the time (see sys_ipc_post).  It lives in a
+// kernel page that is never mapped in user space.  Each queued page
+// holds a reference of its own until the message is received.
+struct IpcMboxEnt {
+	envid_t me_from;		// Sender
+	uint32_t me_value;		// Value sent
+	struct Page *me_page;		// Page sent, or NULL
+	int me_perm;			// Permissions for me_page
+	bool me_hasmsg;			// me_msg is valid
+	struct IpcMsg me_msg;		// Message sent
+};
+
+struct IpcMbox {
+	uint32_t mb_head;		// Next message to receive
+	uint32_t mb_tail;		// Where the next post goes
+	uint32_t mb_size;		// Most messages that may be queued
+	struct IpcMboxEnt mb_ent[IPC_MBOXMAX];
+};
+
+#define MBOX(e)	((struct IpcMbox *) page2kva((e)->env_ipc_mbox))
+
+// Check that 'src' may send the page at 'srcva' with 'perm'.
+// Returns 0 if so and stores the page in *page_store and its PTE in
+// *pte_store, if they're nonnull.  Otherwise returns -E_INVAL.
+static int
+ipc_page_check(struct Env *src, void *srcva, unsigned perm,
+	       struct Page **page_store, pte_t **pte_store)
+{
+	struct Page *page;
+	pte_t *pte;
+
+	if ((unsigned int)srcva >= UTOP)
+		return -E_INVAL;
+
+	if (srcva != ROUNDDOWN(srcva, PGSIZE))
+		return -E_INVAL;
+
+	if ((page = page_lookup(src->env_pgdir, srcva, &pte)) == NULL)
+		return -E_INVAL;
+
+	// PTE_U and PTE_P must be set
+	if (!(perm & PTE_U) || !(perm & PTE_P))
+		return -E_INVAL;
+	// other bits than PTE_{U,P,W,AVAIL} are set
+	if (perm & ((~(PTE_U | PTE_P | PTE_W | PTE_AVAIL)) & 0xfff))
+		return -E_INVAL;
+	// perm has PTE_W, but scrpte is read-only.
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+
+	if (page_store)
+		*page_store = page;
+	if (pte_store)
+		*pte_store = pte;
+	return 0;
+}
+
+// Copy the message 'src' to 'dst'.  Only the used part of the
+// buffer is copied.
+static void
+ipc_msg_copy(struct IpcMsg *dst, const struct IpcMsg *src)
+{
+	memmove(dst->msg_word, src->msg_word, sizeof(dst->msg_word));
+	dst->msg_len = src->msg_len;
+	memmove(dst->msg_buf, src->msg_buf, src->msg_len);
+}
+
+// Deliver 'value' and the pages described by segs[0..nsegs-1]
+// from 'src' to 'target', which must be blocked receiving, and mark
+// it runnable.  See sys_ipc_try_send for the rules.
+// If 'msg' is nonnull, it is a checked kernel copy of a message to
+// deliver along with the value (see sys_ipc_call_msg).
+//
+// The pages are mapped one after another into the window of
+// env_ipc_dstnpages pages that the target set up at env_ipc_dstva;
+// pages that do not fit are left out.  Only the pages that get mapped
+// (or the first one, if none fit) are checked.  Nothing is mapped
+// unless all of them can be.
+//
+// Returns 0 on success where no page mapping occurs,
+// 1 on success where a page mapping occurs, and < 0 on error.
+static int
+ipc_deliver_segs(struct Env *src, struct Env *target, uint32_t value,
+		 const struct IpcMsg *msg, const struct IpcSeg *segs, int nsegs)
+{
+	struct Page *page;
+	uintptr_t dstva;
+	uint32_t i, n, window, limit;
+	unsigned perm = 0;
+	int s, r;
+
+	if (!target->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+
+	// the target is waiting for a reply from somebody else
+	if (target->env_ipc_expect && target->env_ipc_expect != src->env_id)
+		return -E_IPC_NOT_RECV;
+
+	// the receiver may not be asking for a page
+	dstva = (uintptr_t) target->env_ipc_dstva;
+	window = dstva < UTOP ? target->env_ipc_dstnpages : 0;
+
+	// check first...
+	limit = MAX(window, 1);
+	for (s = 0, n = 0; s < nsegs && n < limit; s++) {
+		if (segs[s].seg_va >= UTOP
+		    || segs[s].seg_npages > (UTOP - segs[s].seg_va) / PGSIZE)
+			return -E_INVAL;
+		for (i = 0; i < segs[s].seg_npages && n < limit; i++, n++)
+			if ((r = ipc_page_check(src, (void *) (segs[s].seg_va + i*PGSIZE),
+						segs[s].seg_perm, NULL, NULL)) < 0)
+				return r;
+	}
+
+	// ...then map
+	for (s = 0, n = 0; s < nsegs && n < window; s++)
+		for (i = 0; i < segs[s].seg_npages && n < window; i++, n++) {
+			page = page_lookup(src->env_pgdir,
+					   (void *) (segs[s].seg_va + i*PGSIZE), NULL);
+			if (page_insert(target->env_pgdir, page,
+					(void *) (dstva + n*PGSIZE),
+					segs[s].seg_perm) < 0) {
+				while (n-- > 0)
+					page_remove(target->env_pgdir,
+						    (void *) (dstva + n*PGSIZE));
+				return -E_NO_MEM;
+			}
+			if (n == 0)
+				perm = segs[s].seg_perm;
+		}
+
+	if (msg)
+		ipc_msg_copy(&target->env_ipc_msg, msg);
+	target->env_ipc_hasmsg = (msg != NULL);
+	target->env_ipc_recving = 0;
+	target->env_ipc_expect = 0;
+	target->env_ipc_value = value;
+	target->env_ipc_from = src->env_id;
+	target->env_ipc_perm = perm;
+	target->env_ipc_npages = n;
+	target->env_status = ENV_RUNNABLE;
+
+	return n > 0;
+}
+
+// Deliver 'value' (and the page at 'srcva' with 'perm', if srcva != 0)
+// from 'src' to 'target', as ipc_deliver_segs does.
+static int
+ipc_deliver(struct Env *src, struct Env *target, uint32_t value,
+	    const struct IpcMsg *msg, void *srcva, unsigned perm)
+{
+	struct IpcSeg seg;
+
+	seg.seg_va = (uintptr_t) srcva;
+	seg.seg_npages = 1;
+	seg.seg_perm = perm;
+	return ipc_deliver_segs(src, target, value, msg, &seg, srcva ? 1 : 0);
+}
+
+// Block the current environment in target's queue of senders.
+// The message waits there until target receives it (see ipc_wait);
+// 'msg', if nonnull, is copied into the sender's Env until then.
+// If 'call' is set, the environment then waits for target's reply,
+// as sys_ipc_call does; otherwise the send returns 0 or 1, as
+// sys_ipc_try_send would have.
+// If 'timeout' is nonzero, the send gives up with -E_IPC_NOT_RECV
+// after about 'timeout' milliseconds.
+// The caller must check the arguments and then give up the CPU.
+static void
+ipc_send_block(struct Env *target, uint32_t value, const struct IpcMsg *msg,
+	       void *srcva, unsigned perm, bool call, uint32_t timeout)
+{
+	uint64_t ticks;
+
+	curenv->env_ipc_send_to = target;
+	curenv->env_ipc_send_value = value;
+	if (msg)
+		ipc_msg_copy(&curenv->env_ipc_send_msg, msg);
+	curenv->env_ipc_send_hasmsg = (msg != NULL);
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_call = call;
+	curenv->env_ipc_send_deadline = 0;
+	if (timeout) {
+		ticks = ((uint64_t) timeout * timepage->tp_hz + 999) / 1000;
+		curenv->env_ipc_send_deadline = timepage->tp_ticks + ticks;
+		ipc_ntimed++;
+	}
+
+	// append to the tail, so senders are served first come first served
+	curenv->env_ipc_sendq_next = NULL;
+	if (target->env_ipc_sendq)
+		target->env_ipc_sendq_tail->env_ipc_sendq_next = curenv;
+	else
+		target->env_ipc_sendq = curenv;
+	target->env_ipc_sendq_tail = curenv;
+
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	env_trapframe(curenv)->tf_regs.reg_eax = 0;
+}
+
+// Take blocked sender 's' out of the queue it is waiting in.
+static void
+ipc_sendq_remove(struct Env *s)
+{
+	struct Env *target = s->env_ipc_send_to;
+	struct Env **pp, *prev = NULL;
+
+	for (pp = &target->env_ipc_sendq; *pp != s; pp = &(*pp)->env_ipc_sendq_next)
+		prev = *pp;
+	*pp = s->env_ipc_sendq_next;
+	if (target->env_ipc_sendq_tail == s)
+		target->env_ipc_sendq_tail = prev;
+
+	s->env_ipc_sendq_next = NULL;
+	s->env_ipc_send_to = NULL;
+	if (s->env_ipc_send_deadline) {
+		s->env_ipc_send_deadline = 0;
+		ipc_ntimed--;
+	}
+}
+
+// Finish blocked sender 's', whose send had result 'r'.
+// A successful sys_ipc_call goes on to wait for the reply;
+// everything else returns 'r' to the sender.
+static void
+ipc_send_done(struct Env *s, int r)
+{
+	struct Env *target = s->env_ipc_send_to;
+
+	ipc_sendq_remove(s);
+	if (r >= 0 && s->env_ipc_send_call) {
+		// env_ipc_dstva was set by sys_ipc_call
+		s->env_ipc_expect = target->env_id;
+		s->env_ipc_recving = 1;
+		return;
+	}
+	env_trapframe(s)->tf_regs.reg_eax = r;
+	s->env_status = ENV_RUNNABLE;
+}
+
+// If 'e' is waiting for a reply from 'from' (see sys_ipc_call), give up
+// on it: its call returns 'r', with no pages, as a send that fails in
+// ipc_send_done does.
+// Returns 1 if it was waiting, 0 if not.
+static int
+ipc_call_fail(struct Env *e, envid_t from, int r)
+{
+	if (!e->env_ipc_recving || e->env_ipc_expect != from)
+		return 0;
+	e->env_ipc_recving = 0;
+	e->env_ipc_expect = 0;
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	env_trapframe(e)->tf_regs.reg_eax = r;
+	e->env_status = ENV_RUNNABLE;
+	return 1;
+}
+
+// Hand the oldest message in e's mailbox to e, which must be
+// receiving, as ipc_deliver_segs would have when it was posted.
+// Returns 1 if a message was delivered, 0 if there was none,
+// < 0 if its page could not be mapped (the message stays queued).
+static int
+ipc_mbox_take(struct Env *e)
+{
+	struct IpcMbox *mb;
+	struct IpcMboxEnt *me;
+	int r, perm = 0;
+
+	if (!e->env_ipc_mbox)
+		return 0;
+	mb = MBOX(e);
+	if (mb->mb_head == mb->mb_tail)
+		return 0;
+	me = &mb->mb_ent[mb->mb_head % IPC_MBOXMAX];
+
+	if (me->me_page && (uintptr_t) e->env_ipc_dstva < UTOP) {
+		if ((r = page_insert(e->env_pgdir, me->me_page,
+				     e->env_ipc_dstva, me->me_perm)) < 0)
+			return r;
+		perm = me->me_perm;
+	}
+	if (me->me_page)
+		page_decref(me->me_page);
+
+	if (me->me_hasmsg)
+		ipc_msg_copy(&e->env_ipc_msg, &me->me_msg);
+	e->env_ipc_hasmsg = me->me_hasmsg;
+	e->env_ipc_recving = 0;
+	e->env_ipc_expect = 0;
+	e->env_ipc_value = me->me_value;
+	e->env_ipc_from = me->me_from;
+	e->env_ipc_perm = perm;
+	e->env_ipc_npages = (perm != 0);
+	e->env_status = ENV_RUNNABLE;
+	mb->mb_head++;
+	return 1;
+}
+
+// Set e's alarm to go off at tick 'when', keeping ipc_alarms sorted.
+static void
+ipc_alarm_set(struct Env *e, uint64_t when)
+{
+	struct Env **pp;
+
+	for (pp = &ipc_alarms; *pp && (*pp)->env_ipc_alarm <= when;
+	     pp = &(*pp)->env_ipc_alarm_next)
+		/* do nothing */;
+	e->env_ipc_alarm = when;
+	e->env_ipc_alarm_next = *pp;
+	*pp = e;
+}
+
+// Cancel e's alarm, if it has one.
+static void
+ipc_alarm_cancel(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_ipc_alarm)
+		return;
+	for (pp = &ipc_alarms; *pp != e; pp = &(*pp)->env_ipc_alarm_next)
+		/* do nothing */;
+	*pp = e->env_ipc_alarm_next;
+	e->env_ipc_alarm_next = NULL;
+	e->env_ipc_alarm = 0;
+}
+
+// If e's alarm has gone off and e is receiving from anybody, hand it
+// the alarm message: a value of 0 from e itself, with no page.
+// Returns 1 if it was delivered, 0 if not.
+static int
+ipc_alarm_take(struct Env *e)
+{
+	if (!e->env_ipc_alarm || e->env_ipc_alarm > timepage->tp_ticks
+	    || !e->env_ipc_recving || e->env_ipc_expect)
+		return 0;
+
+	ipc_alarm_cancel(e);
+
+	e->env_ipc_hasmsg = 0;
+	e->env_ipc_recving = 0;
+	e->env_ipc_value = 0;
+	e->env_ipc_from = e->env_id;
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	e->env_status = ENV_RUNNABLE;
+	return 1;
+}
+
+// Environment each IRQ is attached to, NULL for none
+static struct Env *irq_envs[MAX_IRQS];
+// IRQs masked at the interrupt controller since they came in, until
+// their environment is done with them (see irq_release)
+static uint16_t irq_held;
+
+// If an IRQ attached to e has come in and e is receiving from anybody
+// or from itself, hand it the lowest-numbered one: a value of
+// IPC_IRQ(irq) from e itself, with no page.
+// Returns 1 if it was delivered, 0 if not.
+static int
+ipc_irq_take(struct Env *e)
+{
+	int irq;
+
+	if (!e->env_irq_pending || !e->env_ipc_recving
+	    || (e->env_ipc_expect && e->env_ipc_expect != e->env_id))
+		return 0;
+
+	for (irq = 0; !(e->env_irq_pending & (1 << irq)); irq++)
+		/* find it */;
+	e->env_irq_pending &= ~(1 << irq);
+
+	e->env_ipc_hasmsg = 0;
+	e->env_ipc_recving = 0;
+	e->env_ipc_expect = 0;
+	e->env_ipc_value = IPC_IRQ(irq);
+	e->env_ipc_from = e->env_id;
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	e->env_status = ENV_RUNNABLE;
+	return 1;
+}
+
+// Called when IRQ 'irq' comes in.  If an environment is attached to
+// it, note the IRQ and deliver it if the environment is waiting, and
+// acknowledge it at the interrupt controller.
+// The IRQ stays masked until the environment waits again with it
+// received: a level-triggered PCI device keeps its line up until the
+// driver has dealt with it, and would otherwise interrupt forever.
+// Returns 1 if an environment took it, 0 if not.
+int
+irq_deliver(int irq)
+{
+	struct Env *e = irq_envs[irq];
+
+	if (!e)
+		return 0;
+	e->env_irq_pending |= 1 << irq;
+	irq_held |= 1 << irq;
+	irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+	ipc_irq_take(e);
+	irq_eoi(irq);
+	return 1;
+}
+
+// Unmask the held IRQs attached to e that e has received, now that it
+// is waiting again and so must be done with them.
+static void
+irq_release(struct Env *e)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		if ((irq_held & (1 << irq)) && irq_envs[irq] == e
+		    && !(e->env_irq_pending & (1 << irq))) {
+			irq_held &= ~(1 << irq);
+			irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+		}
+}
+
+// Detach every IRQ attached to e, leaving it masked, and drop the
+// ones that came in for e but were not received.
+static void
+irq_detach(struct Env *e)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		if (irq_envs[irq] == e) {
+			irq_envs[irq] = NULL;
+			irq_held &= ~(1 << irq);
+			irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+		}
+	e->env_irq_pending = 0;
+}
+
+// Drop every message queued in e's mailbox.
+static void
+ipc_mbox_flush(struct Env *e)
+{
+	struct IpcMbox *mb = MBOX(e);
+	struct IpcMboxEnt *me;
+
+	for (; mb->mb_head != mb->mb_tail; mb->mb_head++) {
+		me = &mb->mb_ent[mb->mb_head % IPC_MBOXMAX];
+		if (me->me_page)
+			page_decref(me->me_page);
+	}
+}
+
+// Mark the current environment as blocked receiving a message
+// from 'from' (or from anybody, if 'from' is 0), with a window of
+// 'npages' pages at 'dstva' for any pages that come with it.
+// The receiving system call returns 0 once a message arrives.
+//
+// If a message is waiting in our mailbox (when from is 0), or a
+// suitable sender is already blocked in our queue, the message is
+// delivered right away, and the current environment stays runnable.
+// So is an alarm that went off while we were not receiving, if
+// nothing else is there.  Otherwise the caller must give up the CPU.
+static void
+ipc_wait(void *dstva, uint32_t npages, envid_t from)
+{
+	struct Env *s, *next;
+
+	if (irq_held)
+		irq_release(curenv);
+
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstnpages = npages;
+	curenv->env_ipc_expect = from;
+	curenv->env_ipc_recving = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	// set the return value to be zero,
+	// it is necessary, because the 'return' statement
+	// after 'sched_yield' will never be executed,
+	// actually it is skipped.
+	env_trapframe(curenv)->tf_regs.reg_eax = 0;
+
+	if (!from && ipc_mbox_take(curenv) > 0)
+		return;
+
+	for (s = curenv->env_ipc_sendq; s && curenv->env_ipc_recving; s = next) {
+		next = s->env_ipc_sendq_next;
+		if (from && s->env_id != from)
+			continue;
+		// The sender's page may have gone away while it waited;
+		// then it gets the error and we try the next one.
+		ipc_send_done(s, ipc_deliver(s, curenv, s->env_ipc_send_value,
+					     s->env_ipc_send_hasmsg
+					     ? &s->env_ipc_send_msg : NULL,
+					     s->env_ipc_send_srcva,
+					     s->env_ipc_send_perm));
+	}
+
+	ipc_irq_take(curenv);
+	ipc_alarm_take(curenv);
+}
+
+// Give up on sends whose timeout has expired,
+// and wake up receivers whose alarm has gone off.
+// Called on every clock interrupt.
+void
+ipc_tick(void)
+{
+	struct Env *e, *next;
+	int i;
+
+	// Alarms that went off while their environment was not
+	// receiving stay at the front of the list until it is.
+	for (e = ipc_alarms; e && e->env_ipc_alarm <= timepage->tp_ticks;
+	     e = next) {
+		next = e->env_ipc_alarm_next;
+		ipc_alarm_take(e);
+	}
+
+	if (ipc_ntimed == 0)
+		return;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_ipc_send_to
+		    && envs[i].env_ipc_send_deadline
+		    && envs[i].env_ipc_send_deadline <= timepage->tp_ticks)
+			ipc_send_done(&envs[i], -E_IPC_NOT_RECV);
+}
+
+// Environment 'e' is going away: take it out of any send queue,
+// drop its mailbox, and fail the sends blocked on it and the calls
+// waiting for its reply with -E_BAD_ENV.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *s;
+	int i;
+
+	if (e->env_ipc_send_to)
+		ipc_sendq_remove(e);
+
+	ipc_alarm_cancel(e);
+	irq_detach(e);
+
+	if (e->env_ipc_mbox) {
+		ipc_mbox_flush(e);
+		page_decref(e->env_ipc_mbox);
+		e->env_ipc_mbox = NULL;
+	}
+
+	while ((s = e->env_ipc_sendq) != NULL)
+		ipc_send_done(s, -E_BAD_ENV);
+
+	for (i = 0; i < NENV; i++)
+		ipc_call_fail(&envs[i], e->env_id, -E_BAD_ENV);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If va != 0, then also send page currently mapped at 'va',
 // so that receiver gets a duplicate mapping of the same page.
@@ -350,7 +1002,9 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//		or another environment managed to send first,
+//		or envid is waiting for a reply from another environment
+//		(see sys_ipc_call).
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -363,59 +1017,50 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	struct Env *target;
-	struct Page *page;
-	pte_t *pte;
-	int r, ret = 0;
 
-	if ((r = envid2env(envid, &target, 0)) < 0)
+	if (envid2env(envid, &target, 0) < 0)
 		return -E_BAD_ENV;
 
-	if (!target->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
-
-	// srcva is not null, then
-	// we need to map it, thus sharing the map
-	if (srcva) {
-		if ((unsigned int)srcva >= UTOP)
-			return -E_INVAL;
-
-		if (srcva != ROUNDDOWN(srcva, PGSIZE))
-			return -E_INVAL;
-
-		if ((page = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL)
-			return -E_INVAL;
+	return ipc_deliver(curenv, target, value, NULL, srcva, perm);
+}
 
-		// PTE_U and PTE_P must be set
-		if (!(perm & PTE_U) || !(perm & PTE_P))
-			return -E_INVAL;
-		// other bits than PTE_{U,P,W,AVAIL} are set
-		if (perm & ((~(PTE_U | PTE_P | PTE_W | PTE_AVAIL)) & 0xfff))
-			return -E_INVAL;
-		// perm has PTE_W, but scrpte is read-only.
-		if ((perm & PTE_W) && !(*pte & PTE_W))
-			return -E_INVAL;
+// Send 'value' (and the page at 'srcva', if srcva != 0) to 'envid',
+// blocking until it is received.  Like sys_ipc_try_send, except that
+// if 'envid' is not receiving, the caller waits in a first-come
+// first-served queue of senders that sys_ipc_recv takes messages from.
+// The page is looked up again when the message is finally delivered.
+//
+// If 'timeout' is nonzero, gives up after about 'timeout' milliseconds.
+//
+// Returns 0 or 1 as sys_ipc_try_send does, or < 0 on error.
+// Errors are those of sys_ipc_try_send, except that
+//	-E_IPC_NOT_RECV means the timeout expired, and
+//	-E_BAD_ENV also means envid was destroyed while we waited.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     uint32_t timeout)
+{
+	struct Env *target;
+	int r;
 
-		if (page_insert(target->env_pgdir, page, target->env_ipc_dstva, perm) < 0)
-			return -E_NO_MEM;
+	if (envid2env(envid, &target, 0) < 0)
+		return -E_BAD_ENV;
 
-		ret = 1;
-	}
+	if (srcva && (r = ipc_page_check(curenv, srcva, perm, NULL, NULL)) < 0)
+		return r;
 
-	target->env_ipc_recving = 0;
-	target->env_ipc_value = value;
-	target->env_ipc_from = curenv->env_id;
-	if (ret)
-		target->env_ipc_perm = perm;
-	else
-		target->env_ipc_perm = 0;
-	target->env_status = ENV_RUNNABLE;
+	if ((r = ipc_deliver(curenv, target, value, NULL, srcva, perm)) != -E_IPC_NOT_RECV)
+		return r;
 
-	return ret;
+	ipc_send_block(target, value, NULL, srcva, perm, 0, timeout);
+	sched_yield();
 }
 
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
+// If a sender is already waiting in sys_ipc_send or sys_ipc_call,
+// take the first one's message instead.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
@@ -428,20 +1073,475 @@ static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
-	if ((unsigned int)dstva >= UTOP || dstva != ROUNDDOWN(dstva, PGSIZE))
+	if ((unsigned int)dstva < UTOP && dstva != ROUNDDOWN(dstva, PGSIZE))
+		return -E_INVAL;
+
+	ipc_wait(dstva, 1, 0);
+	if (curenv->env_status == ENV_RUNNABLE)
+		return 0;
+	// give up the CPU
+	sched_yield();
+}
+
+// Common code for sys_ipc_call and sys_ipc_call_msg.
+static int
+ipc_call(envid_t envid, uint32_t value, const struct IpcMsg *msg,
+	 void *srcva, unsigned perm, void *dstva, uint32_t dstnpages)
+{
+	struct Env *target;
+	int r;
+
+	if ((unsigned int)dstva < UTOP
+	    && (dstva != ROUNDDOWN(dstva, PGSIZE)
+		|| dstnpages == 0
+		|| dstnpages > (UTOP - (uintptr_t) dstva) / PGSIZE))
+		return -E_INVAL;
+
+	if (envid2env(envid, &target, 0) < 0)
+		return -E_BAD_ENV;
+
+	if (srcva && (r = ipc_page_check(curenv, srcva, perm, NULL, NULL)) < 0)
+		return r;
+
+	r = ipc_deliver(curenv, target, value, msg, srcva, perm);
+	if (r == -E_IPC_NOT_RECV) {
+		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_dstnpages = dstnpages;
+		ipc_send_block(target, value, msg, srcva, perm, 1, 0);
+		sched_yield();
+	} else if (r < 0)
+		return r;
+
+	ipc_wait(dstva, dstnpages, target->env_id);
+	env_run(target);
+}
+
+// Send a request to 'envid' as sys_ipc_send does, then block
+// until 'envid' sends back a reply, as sys_ipc_recv(dstva) does.
+// Only 'envid' can send the reply.  If 'envid' was receiving,
+// the CPU goes straight to it instead of through the scheduler.
+//
+// This function only returns on error, but the system call will
+// eventually return 0 when the reply arrives.  The request is not
+// sent unless no errors occur.
+// Errors are those of sys_ipc_send and sys_ipc_recv; -E_BAD_ENV
+// also means envid was destroyed before it replied, and -E_INVAL or
+// -E_NO_MEM that its reply could not be delivered.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	return ipc_call(envid, value, NULL, srcva, perm, dstva, 1);
+}
+
+// Like sys_ipc_call, but instead of a page, send the small message
+// '*msg' along with the value: IPC_NWORDS words plus msg_len bytes
+// of buffer.  The kernel copies it into the receiver's Env, where the
+// receiver finds it in env_ipc_msg with env_ipc_hasmsg set.
+// No page tables change on either side, so this is the cheap way to
+// make requests that fit in a few words.
+//
+// The reply may carry up to 'dstnpages' pages, which are mapped one
+// after another starting at 'dstva' (see sys_ipc_reply_waitv).
+// env_ipc_npages says how many arrived.
+//
+// Errors are those of sys_ipc_call, plus:
+//	-E_FAULT if msg is not readable by the caller.
+//	-E_INVAL if msg->msg_len > IPC_MSGBUF.
+//	-E_INVAL if dstva < UTOP and the window is empty or
+//		reaches past UTOP.
+static int
+sys_ipc_call_msg(envid_t envid, uint32_t value, const struct IpcMsg *msg,
+		 void *dstva, uint32_t dstnpages)
+{
+	struct IpcMsg kmsg;
+
+	if (user_mem_check(curenv, msg, sizeof(*msg), PTE_U) < 0)
+		return -E_FAULT;
+	// copy it once, so the caller cannot change it under us
+	memmove(&kmsg, msg, sizeof(kmsg));
+	if (kmsg.msg_len > IPC_MSGBUF)
+		return -E_INVAL;
+
+	return ipc_call(envid, value, &kmsg, 0, 0, dstva, dstnpages);
+}
+
+// Common code for sys_ipc_reply_wait and sys_ipc_reply_waitv.
+static int
+ipc_reply_wait(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+	       int nsegs, void *dstva)
+{
+	struct Env *target = NULL;
+	int r;
+
+	if ((unsigned int)dstva < UTOP && dstva != ROUNDDOWN(dstva, PGSIZE))
+		return -E_INVAL;
+
+	if (envid && envid2env(envid, &target, 0) == 0) {
+		r = ipc_deliver_segs(curenv, target, value, NULL, segs, nsegs);
+		if (r == -E_IPC_NOT_RECV)
+			target = NULL;
+		else if (r < 0) {
+			// a client stuck waiting for this reply gets the error
+			if (!ipc_call_fail(target, curenv->env_id, r))
+				return r;
+			target = NULL;
+		}
+	}
+
+	ipc_wait(dstva, 1, 0);
+	// Keep serving while requests are queued up.
+	if (curenv->env_status == ENV_RUNNABLE)
+		return 0;
+	if (target)
+		env_run(target);
+	sched_yield();
+}
+
+// The server half of sys_ipc_call.  Send the reply 'value' (and the
+// page at 'srcva', if srcva != 0) to 'envid', then block until the next
+// request arrives, as sys_ipc_recv(dstva) does.  If 'envid' is 0,
+// there is nothing to reply to and this is just sys_ipc_recv.
+// If the reply went out and no other request is queued, the CPU goes
+// straight to 'envid'.
+//
+// A client that has gone away or stopped waiting does not stop the
+// server from waiting for the next request.  Nor does a reply that
+// cannot be sent to a client waiting in sys_ipc_call: the client's
+// call fails with the error instead.
+//
+// This function only returns on error, but the system call will
+// eventually return 0 when the next request arrives.
+// Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL or -E_NO_MEM if the reply could not be sent to an
+//		environment that was not waiting in sys_ipc_call
+//		(see sys_ipc_try_send).
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva)
+{
+	struct IpcSeg seg;
+
+	seg.seg_va = (uintptr_t) srcva;
+	seg.seg_npages = 1;
+	seg.seg_perm = perm;
+	return ipc_reply_wait(envid, value, &seg, srcva ? 1 : 0, dstva);
+}
+
+// Like sys_ipc_reply_wait, but the reply carries the pages described by
+// the 'nsegs' entries of 'segs', each a run of seg_npages pages starting
+// at seg_va, mapped with seg_perm.  They land one after another in the
+// window the client asked for with sys_ipc_call_msg; whatever does not
+// fit is left out.  Nothing is mapped unless all of it can be.
+//
+// Errors are those of sys_ipc_reply_wait, plus:
+//	-E_FAULT if segs is not readable by the caller.
+//	-E_INVAL if nsegs < 0 or nsegs > IPC_MAXSEGS.
+static int
+sys_ipc_reply_waitv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+		    int nsegs, void *dstva)
+{
+	struct IpcSeg ksegs[IPC_MAXSEGS];
+
+	if (nsegs < 0 || nsegs > IPC_MAXSEGS)
+		return -E_INVAL;
+	if (user_mem_check(curenv, segs, nsegs * sizeof(segs[0]), PTE_U) < 0)
+		return -E_FAULT;
+	memmove(ksegs, segs, nsegs * sizeof(segs[0]));
+
+	return ipc_reply_wait(envid, value, ksegs, nsegs, dstva);
+}
+
+// Like sys_ipc_try_send, but sends the pages described by the 'nsegs'
+// entries of 'segs', as sys_ipc_reply_waitv does, and does not wait.
+// A server uses it to answer a request it put off, while it goes on
+// serving others.  If the answer cannot be delivered to a client
+// waiting for a reply from us (see sys_ipc_call), the client's call
+// fails with the error, as in sys_ipc_reply_wait, so it does not wait
+// forever; the error also comes back here.
+//
+// Errors are those of sys_ipc_try_send, plus:
+//	-E_FAULT if segs is not readable by the caller.
+//	-E_INVAL if nsegs < 0 or nsegs > IPC_MAXSEGS.
+static int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+		  int nsegs)
+{
+	struct IpcSeg ksegs[IPC_MAXSEGS];
+	struct Env *target;
+	int r;
+
+	if (nsegs < 0 || nsegs > IPC_MAXSEGS)
+		return -E_INVAL;
+	if (user_mem_check(curenv, segs, nsegs * sizeof(segs[0]), PTE_U) < 0)
+		return -E_FAULT;
+	memmove(ksegs, segs, nsegs * sizeof(segs[0]));
+
+	if (envid2env(envid, &target, 0) < 0)
+		return -E_BAD_ENV;
+	r = ipc_deliver_segs(curenv, target, value, NULL, ksegs, nsegs);
+	if (r < 0 && r != -E_IPC_NOT_RECV)
+		ipc_call_fail(target, curenv->env_id, r);
+	return r;
+}
+
+// Give the current environment a mailbox that holds up to 'n' messages
+// posted with sys_ipc_post while it is not receiving, or change the
+// size of the one it has.  With 'n' == 0, the mailbox and any messages
+// still in it are thrown away.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if n > IPC_MBOXMAX, or if more than n messages are queued
+//		and n != 0.
+//	-E_NO_MEM if there's no memory for the mailbox.
+static int
+sys_ipc_mbox_setup(uint32_t n)
+{
+	struct Page *page;
+	struct IpcMbox *mb;
+
+	static_assert(sizeof(struct IpcMbox) <= PGSIZE);
+
+	if (n > IPC_MBOXMAX)
+		return -E_INVAL;
+
+	if (n == 0) {
+		if (curenv->env_ipc_mbox) {
+			ipc_mbox_flush(curenv);
+			page_decref(curenv->env_ipc_mbox);
+			curenv->env_ipc_mbox = NULL;
+		}
+		return 0;
+	}
+
+	if (!curenv->env_ipc_mbox) {
+		if (page_alloc(&page) < 0)
+			return -E_NO_MEM;
+		page->pp_ref++;
+		curenv->env_ipc_mbox = page;
+		memset(MBOX(curenv), 0, sizeof(struct IpcMbox));
+	}
+
+	mb = MBOX(curenv);
+	if (mb->mb_tail - mb->mb_head > n)
+		return -E_INVAL;
+	mb->mb_size = n;
+	return 0;
+}
+
+// Send 'value' to 'envid' without waiting, along with the page at
+// 'srcva' (if srcva != 0) and the small message '*msg' (if msg != 0).
+// If 'envid' is receiving, the message is delivered right away as
+// sys_ipc_try_send would; otherwise it goes in envid's mailbox (see
+// sys_ipc_mbox_setup), which keeps the page alive until 'envid'
+// receives the message with sys_ipc_recv or sys_ipc_poll.
+// Messages come out of a mailbox in the order they were posted.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_IPC_NOT_RECV if envid is not receiving and has no room
+//		in its mailbox.
+//	-E_INVAL or -E_FAULT if the page or the message is bad
+//		(see sys_ipc_try_send and sys_ipc_call_msg).
+//	-E_NO_MEM if the page could not be mapped.
+static int
+sys_ipc_post(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     const struct IpcMsg *msg)
+{
+	struct Env *target;
+	struct Page *page = NULL;
+	struct IpcMbox *mb;
+	struct IpcMboxEnt *me;
+	struct IpcMsg kmsg;
+	int r;
+
+	if (envid2env(envid, &target, 0) < 0)
+		return -E_BAD_ENV;
+
+	if (srcva && (r = ipc_page_check(curenv, srcva, perm, &page, NULL)) < 0)
+		return r;
+
+	if (msg) {
+		if (user_mem_check(curenv, msg, sizeof(*msg), PTE_U) < 0)
+			return -E_FAULT;
+		memmove(&kmsg, msg, sizeof(kmsg));
+		if (kmsg.msg_len > IPC_MSGBUF)
+			return -E_INVAL;
+	}
+
+	r = ipc_deliver(curenv, target, value, msg ? &kmsg : NULL, srcva, perm);
+	if (r != -E_IPC_NOT_RECV)
+		return MIN(r, 0);
+
+	if (!target->env_ipc_mbox)
+		return -E_IPC_NOT_RECV;
+	mb = MBOX(target);
+	if (mb->mb_tail - mb->mb_head >= mb->mb_size)
+		return -E_IPC_NOT_RECV;
+
+	me = &mb->mb_ent[mb->mb_tail % IPC_MBOXMAX];
+	me->me_from = curenv->env_id;
+	me->me_value = value;
+	me->me_page = page;
+	me->me_perm = page ? perm : 0;
+	if (page)
+		page->pp_ref++;
+	me->me_hasmsg = (msg != NULL);
+	if (msg)
+		ipc_msg_copy(&me->me_msg, &kmsg);
+	mb->mb_tail++;
+	return 0;
+}
+
+// Receive the oldest message in the current environment's mailbox,
+// if there is one, without blocking.  It arrives as it would for
+// sys_ipc_recv(dstva): in env_ipc_value, env_ipc_from, env_ipc_perm
+// and, if one came along, env_ipc_msg.
+//
+// Returns 1 if a message was received, 0 if the mailbox is empty
+// (or there is none), < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_NO_MEM if the message's page could not be mapped;
+//		the message stays in the mailbox.
+static int
+sys_ipc_poll(void *dstva)
+{
+	int r;
+
+	if ((unsigned int)dstva < UTOP && dstva != ROUNDDOWN(dstva, PGSIZE))
 		return -E_INVAL;
 
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstnpages = 1;
+	curenv->env_ipc_expect = 0;
 	curenv->env_ipc_recving = 1;
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	// set the return value to be zero,
-	// it is necessary, because the 'return' statement
-	// after 'sched_yield' will never be executed,
-	// actually it is skipped.
-	curenv->env_tf.tf_regs.reg_eax = 0;
+	r = ipc_mbox_take(curenv);
+	curenv->env_ipc_recving = 0;
+	return r;
+}
+
+// Set the calling environment's alarm to go off in about 'ms'
+// milliseconds, replacing any alarm already set.  0 cancels it.
+// When it goes off, the environment receives a value of 0 from itself
+// the next time it waits for a message from anybody, unless another
+// message is there first.  An alarm goes off once.
+// Returns 0.
+static int
+sys_ipc_alarm(uint32_t ms)
+{
+	uint64_t ticks;
+
+	ipc_alarm_cancel(curenv);
+	if (ms) {
+		ticks = ((uint64_t) ms * timepage->tp_hz + 999) / 1000;
+		ipc_alarm_set(curenv, timepage->tp_ticks + MAX(ticks, 1));
+	}
+	return 0;
+}
+
+// Attach hardware interrupt 'irq' to the calling environment, which
+// must have I/O privileges, and enable it.  From then on the IRQ comes
+// in as a message of value IPC_IRQ(irq) from the environment itself,
+// received the next time it waits for a message from anybody (or in
+// sys_irq_wait).  An IRQ that comes in again before it is received
+// is delivered once.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq is not a valid IRQ, is one the kernel handles,
+//		or is attached to another environment.
+//	-E_INVAL if the environment does not have I/O privileges.
+static int
+sys_irq_attach(int irq)
+{
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_TIMER || irq == IRQ_KBD
+	    || irq == IRQ_SERIAL || irq == IRQ_SLAVE)
+		return -E_INVAL;
+	if ((env_trapframe(curenv)->tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_INVAL;
+	if (irq_envs[irq] && irq_envs[irq] != curenv)
+		return -E_INVAL;
+
+	irq_envs[irq] = curenv;
+	curenv->env_irq_pending &= ~(1 << irq);
+	irq_held &= ~(1 << irq);
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Wait for an IRQ attached to the calling environment, receiving it
+// as sys_irq_attach describes.  Messages from other environments wait
+// until the next time we receive from anybody.
+// Returns 0 once an IRQ is received, with the IRQ's value in
+// env_ipc_value.
+static int
+sys_irq_wait(void)
+{
+	ipc_wait((void *) UTOP, 0, curenv->env_id);
+	if (curenv->env_status == ENV_RUNNABLE)
+		return 0;
 	// give up the CPU
 	sched_yield();
-	return 0;
+}
+
+// Replace the current environment's program with the one that has been
+// built in 'envid', a child made with sys_exofork that has never run:
+// the current environment takes over envid's address space, registers
+// and page fault upcall, and envid is destroyed along with the current
+// environment's old address space.  The current environment keeps its
+// envid, so whoever is waiting for it to exit keeps waiting for the new
+// program.  Its system call ring and mailbox belonged to the old program
+// and go away too, as do its IRQ attachments, and the sends blocked on
+// it and the calls waiting for its reply fail with -E_BAD_ENV, as they
+// would had it exited.
+//
+// Pages the new program should keep, such as PTE_SHARE file descriptor
+// pages, must already be mapped in envid (see exec() in lib/spawn.c).
+//
+// Does not return on success.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or is not a child of the caller.
+//	-E_INVAL if envid is the caller or has been made runnable.
+static int
+sys_env_exec(envid_t envid)
+{
+	struct Env *e, *s;
+	pde_t *pgdir;
+	physaddr_t cr3;
+	int i;
+
+	if (envid2env(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	if (e == curenv || e->env_status != ENV_NOT_RUNNABLE || e->env_runs)
+		return -E_INVAL;
+
+	pgdir = curenv->env_pgdir;
+	cr3 = curenv->env_cr3;
+	curenv->env_pgdir = e->env_pgdir;
+	curenv->env_cr3 = e->env_cr3;
+	e->env_pgdir = pgdir;
+	e->env_cr3 = cr3;
+	// stop using the old page directory before freeing it
+	lcr3(curenv->env_cr3);
+
+	curenv->env_tf = e->env_tf;
+	curtf = NULL;
+	curenv->env_pgfault_upcall = e->env_pgfault_upcall;
+
+	if (curenv->env_ring) {
+		page_decref(curenv->env_ring);
+		curenv->env_ring = NULL;
+	}
+	sys_ipc_mbox_setup(0);
+	sys_ipc_alarm(0);
+	irq_detach(curenv);
+
+	while ((s = curenv->env_ipc_sendq) != NULL)
+		ipc_send_done(s, -E_BAD_ENV);
+	for (i = 0; i < NENV; i++)
+		ipc_call_fail(&envs[i], curenv->env_id, -E_BAD_ENV);
+
+	env_destroy(e);
+	env_run(curenv);
 }
 
 static int
@@ -461,6 +1561,118 @@ sys_phy_page(envid_t envid, void *va)
 	return *pte;
 }
 
+// Register the page mapped at 'va' in the current environment as its
+// system call ring (see inc/ring.h), replacing any earlier ring.
+// The kernel keeps its own reference to the page, so unmapping it
+// afterwards does not pull it out from under the kernel.
+// The page is cleared.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is not mapped writable in the caller's address space.
+static int
+sys_ring_setup(void *va)
+{
+	struct Page *page;
+	pte_t *pte;
+
+	if ((unsigned int)va >= UTOP || va != ROUNDDOWN(va, PGSIZE))
+		return -E_INVAL;
+
+	if ((page = page_lookup(curenv->env_pgdir, va, &pte)) == NULL)
+		return -E_INVAL;
+	if ((*pte & (PTE_U | PTE_W)) != (PTE_U | PTE_W))
+		return -E_INVAL;
+
+	page->pp_ref++;
+	if (curenv->env_ring)
+		page_decref(curenv->env_ring);
+	curenv->env_ring = page;
+	memset(page2kva(page), 0, PGSIZE);
+	return 0;
+}
+
+// Run one queued system call on behalf of the current environment.
+// Only calls that cannot block or switch environments are allowed.
+static int32_t
+ring_dispatch(const struct RingSqe *sqe)
+{
+	const uint32_t *a = sqe->sqe_args;
+
+	switch (sqe->sqe_op) {
+	case SYS_page_alloc:
+		return sys_page_alloc((envid_t)a[0], (void *)a[1], (int)a[2]);
+	case SYS_page_map:
+		return sys_page_map((envid_t)a[0], (void *)a[1],
+				    (envid_t)a[2], (void *)a[3], (int)a[4]);
+	case SYS_page_unmap:
+		return sys_page_unmap((envid_t)a[0], (void *)a[1]);
+	case SYS_env_set_status:
+		return sys_env_set_status((envid_t)a[0], (int)a[1]);
+	case SYS_ipc_try_send:
+		return sys_ipc_try_send((envid_t)a[0], a[1],
+					(void *)a[2], (int)a[3]);
+	case SYS_ipc_post:
+		return sys_ipc_post((envid_t)a[0], a[1], (void *)a[2],
+				    (unsigned)a[3], (const struct IpcMsg *)a[4]);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Run the system calls queued in e's ring, in order, and post their
+// results.  Stops early if the completion queue fills up or if e
+// stops being runnable (say, a queued sys_env_set_status on itself).
+// e must be curenv, since the calls act on behalf of curenv.
+//
+// The ring is shared with user space, which may scribble on it at
+// any time; a ring whose indexes make no sense is left alone.
+//
+// Returns the number of calls run.
+static int
+ring_drain(struct Env *e)
+{
+	struct Ring *ring;
+	struct RingSqe sqe;
+	struct RingCqe *cqe;
+	int n = 0;
+
+	assert(e == curenv && e->env_ring);
+	ring = page2kva(e->env_ring);
+
+	while (ring->sq_head != ring->sq_tail
+	       && e->env_status == ENV_RUNNABLE) {
+		if (ring->sq_tail - ring->sq_head > RING_NENTRIES
+		    || ring->cq_tail - ring->cq_head > RING_NENTRIES)
+			break;
+		if (ring->cq_tail - ring->cq_head == RING_NENTRIES)
+			break;
+
+		// Copy the entry out first: user space may change it.
+		sqe = ring->sq[ring->sq_head % RING_NENTRIES];
+		ring->sq_head++;
+
+		cqe = &ring->cq[ring->cq_tail % RING_NENTRIES];
+		cqe->cqe_tag = sqe.sqe_tag;
+		cqe->cqe_result = ring_dispatch(&sqe);
+		ring->cq_tail++;
+		n++;
+	}
+	return n;
+}
+
+// Run the calls queued in the current environment's ring.
+//
+// Returns the number of calls run, or < 0 on error.  Errors are:
+//	-E_INVAL if the environment has no ring.
+static int
+sys_ring_enter(void)
+{
+	if (!curenv->env_ring)
+		return -E_INVAL;
+	return ring_drain(curenv);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -486,6 +1698,12 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_page_alloc:
 		ret = sys_page_alloc((envid_t)a1, (void *)a2, (int)a3);
 		break;
+	case SYS_page_alloc_contig:
+		ret = sys_page_alloc_contig((envid_t)a1, (void *)a2, a3, (int)a4);
+		break;
+	case SYS_page_table_share:
+		ret = sys_page_table_share((envid_t)a1, (void *)a2, (size_t)a3);
+		break;
 	case SYS_page_map:
 		ret = sys_page_map((envid_t)a1, (void *)a2,
 						   (envid_t)a3, (void *)a4, (int)a5);
@@ -505,6 +1723,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_env_set_pgfault_upcall:
 		ret = sys_env_set_pgfault_upcall((envid_t)a1, (void *)a2);
 		break;
+	case SYS_env_exec:
+		ret = sys_env_exec((envid_t)a1);
+		break;
 	case SYS_yield:
 		sys_yield();
 		break;
@@ -518,6 +1739,56 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_ipc_recv:
 		ret = sys_ipc_recv((void *)a1);
 		break;
+	case SYS_ipc_send:
+		ret = sys_ipc_send((envid_t)a1, (uint32_t)a2,
+				   (void *)a3, (unsigned)a4, a5);
+		break;
+	case SYS_ipc_call:
+		ret = sys_ipc_call((envid_t)a1, (uint32_t)a2,
+				   (void *)a3, (unsigned)a4, (void *)a5);
+		break;
+	case SYS_ipc_call_msg:
+		ret = sys_ipc_call_msg((envid_t)a1, (uint32_t)a2,
+				       (const struct IpcMsg *)a3, (void *)a4, a5);
+		break;
+	case SYS_ipc_reply_wait:
+		ret = sys_ipc_reply_wait((envid_t)a1, (uint32_t)a2,
+					 (void *)a3, (unsigned)a4, (void *)a5);
+		break;
+	case SYS_ipc_reply_waitv:
+		ret = sys_ipc_reply_waitv((envid_t)a1, (uint32_t)a2,
+					  (const struct IpcSeg *)a3, (int)a4,
+					  (void *)a5);
+		break;
+	case SYS_ipc_try_sendv:
+		ret = sys_ipc_try_sendv((envid_t)a1, (uint32_t)a2,
+					(const struct IpcSeg *)a3, (int)a4);
+		break;
+	case SYS_ipc_mbox_setup:
+		ret = sys_ipc_mbox_setup((uint32_t)a1);
+		break;
+	case SYS_ipc_post:
+		ret = sys_ipc_post((envid_t)a1, (uint32_t)a2, (void *)a3,
+				   (unsigned)a4, (const struct IpcMsg *)a5);
+		break;
+	case SYS_ipc_poll:
+		ret = sys_ipc_poll((void *)a1);
+		break;
+	case SYS_ipc_alarm:
+		ret = sys_ipc_alarm((uint32_t)a1);
+		break;
+	case SYS_irq_attach:
+		ret = sys_irq_attach((int)a1);
+		break;
+	case SYS_irq_wait:
+		ret = sys_irq_wait();
+		break;
+	case SYS_ring_setup:
+		ret = sys_ring_setup((void *)a1);
+		break;
+	case SYS_ring_enter:
+		ret = sys_ring_enter();
+		break;
 	default:
 		// NSYSCALLS
 		ret = -E_INVAL;
@@ -5,7 +5,11 @@
 #endif
 
 #include <inc/syscall.h>
+#include <inc/env.h>
 
+void ipc_tick(void);
+void ipc_env_free(struct Env *e);
+int irq_deliver(int irq);
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -23,6 +23,8 @@ struct Pseudodesc idt_pd = {
 };
 
 
+static void sysenter_init(void);
+
 static const char *trapname(int trapno)
 {
 	static const char * const excnames[] = {
@@ -154,6 +156,28 @@ idt_init(void)
 
 	// Load the IDT
 	asm volatile("lidt idt_pd");
+
+	sysenter_init();
+}
+
+// Point the SYSENTER MSRs at sysenter_handler, if the processor
+// supports sysenter/sysexit.  User environments make the same
+// cpu_has_sysenter() check before choosing the fast system call stub.
+static void
+sysenter_init(void)
+{
+	extern void sysenter_handler();
+
+	if (!cpu_has_sysenter())
+		return;
+
+	// sysenter loads %cs from SYSENTER_CS and %ss from SYSENTER_CS+8;
+	// sysexit loads SYSENTER_CS+16 and +24 with RPL 3.
+	// That is exactly GD_KT, GD_KD, GD_UT and GD_UD.
+	wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+	wrmsr(MSR_IA32_SYSENTER_ESP, KSTACKTOP);
+	wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	cprintf("sysenter/sysexit enabled\n");
 }
 
 void
@@ -214,6 +238,8 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	case IRQ_OFFSET:
 		// clock interrupt
+		kclock_tick();
+		ipc_tick();
 		sched_yield();
 		break;
 	case IRQ_OFFSET + IRQ_KBD:
@@ -221,6 +247,11 @@ trap_dispatch(struct Trapframe *tf)
 		kbd_intr();
 		return;
 	default:
+		// an interrupt some environment attached to
+		if (tf->tf_trapno >= IRQ_OFFSET
+		    && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+		    && irq_deliver(tf->tf_trapno - IRQ_OFFSET))
+			return;
 		break;
 	}
 
@@ -239,13 +270,11 @@ trap(struct Trapframe *tf)
 {
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
+		// Leave the trap frame on the kernel stack; env_run()
+		// copies it into 'curenv->env_tf' only if we switch
+		// to another environment (see env_trapframe()).
 		assert(curenv);
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		curtf = tf;
 	}
 
 	// Dispatch based on what type of trap occurred
@@ -253,13 +282,42 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNABLE)
+	// if doing so makes sense.  If it still owns the frame on the
+	// kernel stack, return to _alltraps, which irets from it.
+	if (curenv && curenv->env_status == ENV_RUNNABLE) {
+		if (curtf == tf) {
+			curtf = NULL;
+			return;
+		}
 		env_run(curenv);
-	else
+	} else
 		sched_yield();
 }
 
+// Called from sysenter_handler with the Trapframe it built on the
+// kernel stack.  The fifth system call argument register (%esi) holds
+// the return address, so sysenter calls take at most four arguments.
+//
+// Returns the Trapframe to resume with sysexit if the caller is still
+// runnable; otherwise runs another environment and does not return.
+struct Trapframe *
+sysenter_trap(struct Trapframe *tf)
+{
+	assert(curenv);
+	curtf = tf;
+
+	tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+				      tf->tf_regs.reg_edx,
+				      tf->tf_regs.reg_ecx,
+				      tf->tf_regs.reg_ebx,
+				      tf->tf_regs.reg_edi,
+				      0);
+
+	if (curenv->env_status != ENV_RUNNABLE)
+		sched_yield();
+	curtf = NULL;
+	return tf;
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
@@ -305,8 +363,8 @@ page_fault_handler(struct Trapframe *tf)
 	//
 	// Hints:
 	//   user_mem_assert() and env_run() are useful here.
-	//   To change what the user environment runs, modify 'curenv->env_tf'
-	//   (the 'tf' variable points at 'curenv->env_tf').
+	//   To change what the user environment runs, modify 'tf'
+	//   (it is curenv's live trap frame; see env_trapframe()).
 	// LAB 4: Your code here.
 	unsigned int orig_esp;
 	struct UTrapframe utf;
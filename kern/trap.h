@@ -16,6 +16,7 @@ void idt_init(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
+struct Trapframe *sysenter_trap(struct Trapframe *tf);
 void backtrace(struct Trapframe *);
 
 #endif /* JOS_KERN_TRAP_H */
@@ -4,6 +4,11 @@
 
 #define debug 0
 
+// An open file is mapped into its fd's data region (see fd2data),
+// so no file bigger than that can be used through here, although the
+// file system allows files up to MAXFILESIZE.
+#define FD_MAXFILESIZE	PTSIZE
+
 static int file_close(struct Fd *fd);
 static ssize_t file_read(struct Fd *fd, void *buf, size_t n, off_t offset);
 static ssize_t file_write(struct Fd *fd, const void *buf, size_t n, off_t offset);
@@ -48,6 +53,10 @@ open(const char *path, int mode)
 		fd_close(fd, 0);
 		return r;
 	}
+	if (fd->fd_file.file.f_size > FD_MAXFILESIZE) {
+		fd_close(fd, 0);
+		return -E_NO_MEM;
+	}
 	if ((r = fmap(fd, 0, fd->fd_file.file.f_size)) < 0) {
 		fd_close(fd, 0);
 		return r;
@@ -110,7 +119,7 @@ read_map(int fdnum, off_t offset, void **blk)
 	if (fd->fd_dev_id != devfile.dev_id)
 		return -E_INVAL;
 	va = fd2data(fd) + offset;
-	if (offset >= MAXFILESIZE)
+	if (offset >= FD_MAXFILESIZE)
 		return -E_NO_DISK;
 	if (!(vpd[PDX(va)] & PTE_P) || !(vpt[VPN(va)] & PTE_P))
 		return -E_NO_DISK;
@@ -118,6 +127,21 @@ read_map(int fdnum, off_t offset, void **blk)
 	return 0;
 }
 
+// Map a snapshot of the file block starting at 'offset' at 'dstva'
+// (see fsipc_map_snapshot).
+int
+read_snapshot(int fdnum, off_t offset, void *dstva)
+{
+	int r;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	return fsipc_map_snapshot(fd->fd_file.id, offset, dstva);
+}
+
 // Write 'n' bytes from 'buf' to 'fd' at the current seek position.
 static ssize_t
 file_write(struct Fd *fd, const void *buf, size_t n, off_t offset)
@@ -127,7 +151,7 @@ file_write(struct Fd *fd, const void *buf, size_t n, off_t offset)
 
 	// don't write past the maximum file size
 	tot = offset + n;
-	if (tot > MAXFILESIZE)
+	if (tot > FD_MAXFILESIZE)
 		return -E_NO_DISK;
 
 	// increase the file's size if necessary
@@ -158,7 +182,7 @@ file_trunc(struct Fd *fd, off_t newsize)
 	off_t oldsize;
 	uint32_t fileid;
 
-	if (newsize > MAXFILESIZE)
+	if (newsize > FD_MAXFILESIZE)
 		return -E_NO_DISK;
 
 	fileid = fd->fd_file.id;
@@ -187,8 +211,12 @@ fmap(struct Fd* fd, off_t oldsize, off_t newsize)
 	int r;
 
 	va = fd2data(fd);
-	for (i = ROUNDUP(oldsize, PGSIZE); i < newsize; i += PGSIZE) {
-		if ((r = fsipc_map(fd->fd_file.id, i, va + i)) < 0) {
+	for (i = ROUNDUP(oldsize, PGSIZE); i < newsize; i += r * PGSIZE) {
+		// ask for all the remaining pages at once;
+		// the server sends back as long a run as it can
+		r = fsipc_map_run(fd->fd_file.id, i, va + i,
+				  ROUNDUP(newsize - i, PGSIZE) / PGSIZE);
+		if (r < 0) {
 			// unmap anything we may have mapped so far
 			funmap(fd, i, oldsize, 0);
 			return r;
@@ -214,14 +242,18 @@ funmap(struct Fd* fd, off_t oldsize, off_t newsize, bool dirty)
 		return 0;
 
 	ret = 0;
+	// nothing past the fd's data region, even for a file too big for it
+	oldsize = MIN(oldsize, FD_MAXFILESIZE);
 	for (i = ROUNDUP(newsize, PGSIZE); i < oldsize; i += PGSIZE)
 		if (vpt[VPN(va + i)] & PTE_P) {
 			if (dirty
 			    && (vpt[VPN(va + i)] & PTE_D)
 			    && (r = fsipc_dirty(fd->fd_file.id, i)) < 0)
 				ret = r;
-			sys_page_unmap(0, va + i);
+			ring_page_unmap(0, va + i);
 		}
+	if ((r = ring_flush()) < 0 && ret == 0)
+		ret = r;
 	return ret;
 }
 
@@ -1,12 +1,9 @@
 // implement fork from user space
 
 #include <inc/string.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -54,6 +51,12 @@ pgfault(struct UTrapframe *utf)
 // marked copy-on-write as well.  (Exercise: Why mark ours copy-on-write again
 // if it was already copy-on-write?)
 //
+// The mappings are queued in the system call ring (see ring.c);
+// fork() flushes them all at once.  Until then our own mapping stays
+// writable, and any write would show through in the child, so the
+// pages we keep writing meanwhile, those of the stack we are running
+// on, are mapped right away instead.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 // 
@@ -63,28 +66,27 @@ duppage(envid_t envid, unsigned pn)
 	int r;
 	void *addr;
 	pte_t pte;
+	int (*map)(envid_t, void *, envid_t, void *, int);
 	// LAB 4: Your code here.
 
+	addr = (void *)(pn*PGSIZE);
+	map = PDX(addr) == PDX(read_esp()) ? sys_page_map : ring_page_map;
 	pte = vpt[pn];
 	if (!(pte & PTE_SHARE) &&
 	    ((pte & PTE_W) || (pte & PTE_COW))) {
-		if ((r = sys_page_map(0, (void *)(pn*PGSIZE),
-				      envid, (void *)(pn*PGSIZE),
-				      PTE_U | PTE_P | PTE_COW)) < 0)
-			panic("sys_page_map error: %e", r);
-
-		if ((r = sys_page_map(envid, (void *)(pn*PGSIZE),
-				      0, (void *)(pn*PGSIZE),
-				      PTE_U | PTE_P | PTE_COW)) < 0)
-			panic("sys_page_map error: %e", r);
+		if ((r = map(0, addr, envid, addr,
+			     PTE_U | PTE_P | PTE_COW)) < 0)
+			panic("duppage: %e", r);
+
+		if ((r = map(envid, addr, 0, addr,
+			     PTE_U | PTE_P | PTE_COW)) < 0)
+			panic("duppage: %e", r);
 	} else {
 		// read-only page or share page
 		// if pte has bit PTE_SHARE set, the PTE should
 		// be copied directly from parent to child
-		if ((r = sys_page_map(0, (void *)(pn*PGSIZE),
-				      envid, (void *)(pn*PGSIZE),
-				      pte & PTE_USER)) < 0)
-			panic("sys_page_map error: %e", r);
+		if ((r = map(0, addr, envid, addr, pte & PTE_USER)) < 0)
+			panic("duppage: %e", r);
 	}
 
 	return 0;
@@ -136,22 +138,150 @@ fork(void)
 			duppage(envid, pn);
 
 	// allocate a new page for child - user exception stack
-	if ((r = sys_page_alloc(envid,
-				(void *)(UXSTACKTOP-PGSIZE),
-				PTE_W |PTE_U |PTE_P)) < 0)
-		panic("sys_page_alloc error: %e", r);
+	if ((r = ring_page_alloc(envid,
+				 (void *)(UXSTACKTOP-PGSIZE),
+				 PTE_W |PTE_U |PTE_P)) < 0)
+		panic("ring_page_alloc error: %e", r);
 
 	// fire the engine
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
+	if ((r = ring_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("ring_env_set_status: %e", r);
+
+	// all of the above happens here, in one trap per ring-full
+	if ((r = ring_flush()) < 0)
+		panic("fork: %e", r);
 
 	return envid;
 }
 
-// Challenge!
-int
+// Bounds of the thread-local pages, which start the data segment,
+// and the end of the initialized data (see user/user.ld), and of the
+// program's own thread-local pages when this is the shared library
+// (see libmain.c)
+extern uint8_t tlsdata[], etlsdata[], edata[];
+extern uintptr_t dyntlsdata, dynetlsdata;
+// Set if this program uses the shared library (see libmain.c)
+extern void (*dynumain)(int argc, char **argv);
+
+//
+// spawn() maps whole pages of a program's initialized data from a
+// snapshot of the file, copy-on-write (see load_elf_to_child).  If this
+// program has any, install the copy-on-write fault handler before
+// anything writes to them.  libmain calls this first thing.
+// A program that uses the shared library can have such pages in a
+// data segment of its own, which the library cannot see, so it always
+// gets the handler.
+//
+void
+cow_init(void)
+{
+	uintptr_t va;
+
+	if (dynumain) {
+		set_pgfault_handler(pgfault);
+		return;
+	}
+	for (va = ROUNDDOWN((uintptr_t) tlsdata, PGSIZE);
+	     va < (uintptr_t) edata; va += PGSIZE)
+		if ((vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_COW)) {
+			set_pgfault_handler(pgfault);
+			return;
+		}
+}
+
+//
+// Map our virtual page pn into the target envid at the same virtual
+// address, so that both environments see the same memory.
+// A copy-on-write page is first replaced by a private writable copy,
+// as a write fault would, since writes must reach both environments.
+//
+// The mappings are queued in the system call ring, as in duppage.
+//
+static int
+sharepage(envid_t envid, unsigned pn)
+{
+	void *addr = (void *) (pn*PGSIZE);
+	pte_t pte;
+	int r;
+
+	pte = vpt[pn];
+	if (!(pte & PTE_SHARE) && (pte & PTE_COW)) {
+		if ((r = sys_page_alloc(0, (void *)PFTEMP, PTE_U | PTE_W | PTE_P)) < 0)
+			return r;
+		memmove((void *)PFTEMP, addr, PGSIZE);
+		if ((r = sys_page_map(0, (void *)PFTEMP, 0, addr,
+				      PTE_U | PTE_W | PTE_P)) < 0)
+			return r;
+		if ((r = sys_page_unmap(0, (void *)PFTEMP)) < 0)
+			return r;
+		pte = vpt[pn];
+	}
+
+	return ring_page_map(0, addr, envid, addr, pte & PTE_USER);
+}
+
+//
+// Like fork, except that parent and child share all their memory
+// except the user stack region and the thread-local pages, which are
+// copied on write as fork would, and the user exception stack, which
+// each gets a page of its own.  They also share the page tables of
+// the address space malloc() uses, so memory malloc() maps later is
+// shared too.  Other pages mapped after sfork returns are private to
+// whichever environment mapped them.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t envid;
+	uintptr_t va;
+	int r;
+	int pn;
+
+	set_pgfault_handler(pgfault);
+
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+
+	if (envid == 0) {
+		// we are the child; env is thread-local
+		env = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	// we are the parent
+	if ((r = sys_page_table_share(envid, (void *) MALLOCBASE,
+				      MALLOCTOP - MALLOCBASE)) < 0)
+		panic("sfork: %e", r);
+	pn = UTOP / PGSIZE - 1;
+	while (--pn >= 0) {
+		va = pn * PGSIZE;
+		if (!(vpd[pn >> 10] & PTE_P)
+		    || (va >= MALLOCBASE && va < MALLOCTOP)) {
+			pn = (pn >> 10) << 10;
+			continue;
+		}
+		if (!(vpt[pn] & PTE_P))
+			continue;
+		if ((va >= USTACKTOP - PTSIZE && va < USTACKTOP)
+		    || (va >= (uintptr_t) tlsdata && va < (uintptr_t) etlsdata)
+		    || (va >= dyntlsdata && va < dynetlsdata))
+			duppage(envid, pn);
+		else if ((r = sharepage(envid, pn)) < 0)
+			panic("sfork: %e", r);
+	}
+
+	if ((r = ring_page_alloc(envid,
+				 (void *)(UXSTACKTOP-PGSIZE),
+				 PTE_W |PTE_U |PTE_P)) < 0)
+		panic("ring_page_alloc error: %e", r);
+
+	if ((r = ring_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("ring_env_set_status: %e", r);
+
+	if ((r = ring_flush()) < 0)
+		panic("sfork: %e", r);
+
+	return envid;
 }
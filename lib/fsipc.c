@@ -5,6 +5,17 @@
 
 extern uint8_t fsipcbuf[PGSIZE];	// page-aligned, declared in entry.S
 
+// The file server, once we have looked it up
+static envid_t fsenv;
+
+static envid_t
+fsipc_env(void)
+{
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	return fsenv;
+}
+
 // Send an IP request to the file server, and wait for a reply.
 // type: request code, passed as the simple integer IPC value.
 // fsreq: page to send containing additional request data, usually fsipcbuf.
@@ -15,13 +26,25 @@ extern uint8_t fsipcbuf[PGSIZE];	// page-aligned, declared in entry.S
 static int
 fsipc(unsigned type, void *fsreq, void *dstva, int *perm)
 {
-	envid_t whom;
-
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", env->env_id, type, fsipcbuf);
 
-	ipc_send(envs[1].env_id, type, fsreq, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(&whom, dstva, perm);
+	return ipc_call(fsipc_env(), type, fsreq, PTE_P | PTE_W | PTE_U,
+			dstva, perm);
+}
+
+// Like fsipc, but for requests small enough to travel as an IPC message
+// instead of a page: the request structure goes in msg->msg_word.
+// Saves mapping and unmapping fsipcbuf in the server.
+// The reply may map up to 'npages' pages starting at 'dstva'.
+static int
+fsipc_msg(unsigned type, struct IpcMsg *msg, void *dstva, int npages, int *perm)
+{
+	if (debug)
+		cprintf("[%08x] fsipc_msg %d %08x\n", env->env_id, type, msg->msg_word[0]);
+
+	msg->msg_len = 0;
+	return ipc_call_msg(fsipc_env(), type, msg, dstva, npages, perm);
 }
 
 // Send file-open request to the file server.
@@ -50,17 +73,58 @@ fsipc_open(const char *path, int omode, struct Fd *fd)
 // Returns 0 on success, < 0 on failure.
 int
 fsipc_map(int fileid, off_t offset, void *dstva)
+{
+	int r;
+
+	if ((r = fsipc_map_run(fileid, offset, dstva, 1)) < 0)
+		return r;
+	return 0;
+}
+
+// Like fsipc_map, but asks for up to 'npages' consecutive blocks
+// starting at 'offset', mapped one after another from 'dstva'.
+// The server may send fewer, for instance at the end of the file.
+// Returns the number of pages mapped (at least 1), or < 0 on failure.
+int
+fsipc_map_run(int fileid, off_t offset, void *dstva, int npages)
 {
 	int r, perm;
+	struct IpcMsg msg;
 	struct Fsreq_map *req;
 
-	req = (struct Fsreq_map*) fsipcbuf;
+	req = (struct Fsreq_map*) msg.msg_word;
 	req->req_fileid = fileid;
 	req->req_offset = offset;
-	if ((r = fsipc(FSREQ_MAP, req, dstva, &perm)) < 0)
+	req->req_npages = npages;
+	req->req_flags = 0;
+	if ((r = fsipc_msg(FSREQ_MAP, &msg, dstva, npages, &perm)) < 0)
 		return r;
 	if ((perm & ~(PTE_W | PTE_SHARE)) != (PTE_U | PTE_P))
 		panic("fsipc_map: unexpected permissions %08x for dstva %08x", perm, dstva);
+	return env->env_ipc_npages;
+}
+
+// Map, read-only at 'dstva', a snapshot of the block at 'offset':
+// a page that keeps the block's current contents even if the file
+// is written later.  Map it copy-on-write to write to it.
+// Returns 0 on success, < 0 on failure; -E_BUSY if the file is open
+// for writing, so that there is no snapshot to take.
+int
+fsipc_map_snapshot(int fileid, off_t offset, void *dstva)
+{
+	int r, perm;
+	struct IpcMsg msg;
+	struct Fsreq_map *req;
+
+	req = (struct Fsreq_map*) msg.msg_word;
+	req->req_fileid = fileid;
+	req->req_offset = offset;
+	req->req_npages = 1;
+	req->req_flags = FSMAP_NOSHARE | FSMAP_SNAPSHOT;
+	if ((r = fsipc_msg(FSREQ_MAP, &msg, dstva, 1, &perm)) < 0)
+		return r;
+	if (perm != (PTE_U | PTE_P))
+		panic("fsipc_map_snapshot: unexpected permissions %08x for dstva %08x", perm, dstva);
 	return 0;
 }
 
@@ -68,12 +132,13 @@ fsipc_map(int fileid, off_t offset, void *dstva)
 int
 fsipc_set_size(int fileid, off_t size)
 {
+	struct IpcMsg msg;
 	struct Fsreq_set_size *req;
 
-	req = (struct Fsreq_set_size*) fsipcbuf;
+	req = (struct Fsreq_set_size*) msg.msg_word;
 	req->req_fileid = fileid;
 	req->req_size = size;
-	return fsipc(FSREQ_SET_SIZE, req, 0, 0);
+	return fsipc_msg(FSREQ_SET_SIZE, &msg, 0, 0, 0);
 }
 
 // Make a file-close request to the file server.
@@ -81,23 +146,25 @@ fsipc_set_size(int fileid, off_t size)
 int
 fsipc_close(int fileid)
 {
+	struct IpcMsg msg;
 	struct Fsreq_close *req;
 
-	req = (struct Fsreq_close*) fsipcbuf;
+	req = (struct Fsreq_close*) msg.msg_word;
 	req->req_fileid = fileid;
-	return fsipc(FSREQ_CLOSE, req, 0, 0);
+	return fsipc_msg(FSREQ_CLOSE, &msg, 0, 0, 0);
 }
 
 // Ask the file server to mark a particular file block dirty.
 int
 fsipc_dirty(int fileid, off_t offset)
 {
+	struct IpcMsg msg;
 	struct Fsreq_dirty *req;
 
-	req = (struct Fsreq_dirty*) fsipcbuf;
+	req = (struct Fsreq_dirty*) msg.msg_word;
 	req->req_fileid = fileid;
 	req->req_offset = offset;
-	return fsipc(FSREQ_DIRTY, req, 0, 0);
+	return fsipc_msg(FSREQ_DIRTY, &msg, 0, 0, 0);
 }
 
 // Ask the file server to delete a file, given its pathname.
@@ -118,6 +185,8 @@ fsipc_remove(const char *path)
 int
 fsipc_sync(void)
 {
-	return fsipc(FSREQ_SYNC, fsipcbuf, 0, 0);
+	struct IpcMsg msg;
+
+	return fsipc_msg(FSREQ_SYNC, &msg, 0, 0, 0);
 }
 
@@ -21,7 +21,7 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	int r;
 
 	if (!pg)
-		pg = (void *)USTACKTOP;
+		pg = (void *)UTOP;
 
 	if ((r = sys_ipc_recv(pg)) < 0) {
 		if (from_env_store)
@@ -39,27 +39,193 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', assuming 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
-//
-// Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_recv a value that it will understand
-//   as meaning "no page".  (Zero is not the right value.)
+// This function blocks in the kernel until 'toenv' receives the message.
+// It panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
 	int r;
 
-	while (1) {
-		r = sys_ipc_try_send(to_env, val, pg, perm);
-		if (r >= 0)
-			return;
-		if (r != -E_IPC_NOT_RECV)
-			panic("sys_ipc_try_send error: %e", r);
+	if ((r = sys_ipc_send(to_env, val, pg, perm, 0)) < 0)
+		panic("sys_ipc_send error: %e", r);
+}
+
+// Like ipc_send, but gives up after about 'timeout' milliseconds
+// (never, if 'timeout' is 0) and returns the error instead of panicking.
+// Returns 0 on success, -E_IPC_NOT_RECV if the timeout expired,
+// or another error from sys_ipc_send.
+int
+ipc_send_timeout(envid_t to_env, uint32_t val, void *pg, int perm,
+		 unsigned timeout)
+{
+	int r;
+
+	if ((r = sys_ipc_send(to_env, val, pg, perm, timeout)) < 0)
+		return r;
+	return 0;
+}
 
-		sys_yield();
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// and wait for its reply, in one system call.
+// Like ipc_send, waits in the kernel until 'to_env' is receiving.
+// The reply can only come from 'to_env'.  Any page it sends is mapped
+// at 'rcv_pg', if nonnull; its permission goes in *perm_store, if nonnull.
+// Returns the reply value, or < 0 if the call failed: 'to_env' went
+// away, say, or its reply could not be delivered.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!rcv_pg)
+		rcv_pg = (void *)UTOP;
+
+	if ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (perm_store)
+			*perm_store = 0;
+		return r;
 	}
+
+	if (perm_store)
+		*perm_store = env->env_ipc_perm;
+	return env->env_ipc_value;
 }
 
+// Like ipc_call, but sends the small message '*msg' instead of a page.
+// The receiver finds it in env->env_ipc_msg, with env->env_ipc_hasmsg set.
+// The reply may carry up to 'rcv_npages' pages, mapped one after another
+// from 'rcv_pg'; env->env_ipc_npages says how many arrived.
+int32_t
+ipc_call_msg(envid_t to_env, uint32_t val, const struct IpcMsg *msg,
+	     void *rcv_pg, unsigned rcv_npages, int *perm_store)
+{
+	int r;
+
+	if (!rcv_pg)
+		rcv_pg = (void *)UTOP;
+
+	if ((r = sys_ipc_call_msg(to_env, val, msg, rcv_pg, rcv_npages)) < 0) {
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+
+	if (perm_store)
+		*perm_store = env->env_ipc_perm;
+	return env->env_ipc_value;
+}
+
+// Server side of ipc_call: reply 'val' (and 'pg' with 'perm', if 'pg'
+// is nonnull) to 'to_env', then receive the next request as ipc_recv
+// does.  Pass 0 for 'to_env' to just receive.
+// If the reply or the receive fails, stores 0 in *from_env_store and
+// *perm_store (if they're nonnull) and returns the error.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!rcv_pg)
+		rcv_pg = (void *)UTOP;
+
+	if ((r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = env->env_ipc_from;
+	if (perm_store)
+		*perm_store = env->env_ipc_perm;
+	return env->env_ipc_value;
+}
+
+// Like ipc_reply_wait, but replies with the runs of pages in
+// segs[0..nsegs-1] instead of a single page.
+int32_t
+ipc_reply_waitv(envid_t to_env, uint32_t val, const struct IpcSeg *segs,
+		int nsegs, envid_t *from_env_store, void *rcv_pg,
+		int *perm_store)
+{
+	int r;
+
+	if (!rcv_pg)
+		rcv_pg = (void *)UTOP;
+
+	if ((r = sys_ipc_reply_waitv(to_env, val, segs, nsegs, rcv_pg)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = env->env_ipc_from;
+	if (perm_store)
+		*perm_store = env->env_ipc_perm;
+	return env->env_ipc_value;
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// without waiting.  If 'to_env' is not receiving, the message waits in
+// its mailbox (see sys_ipc_mbox_setup).
+// Returns 0 on success, -E_IPC_NOT_RECV if 'to_env' is not receiving
+// and its mailbox is full or missing, or another error.
+int
+ipc_post(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	return sys_ipc_post(to_env, val, pg, perm, 0);
+}
+
+// Take the oldest message out of our mailbox without blocking.
+// Stores its value in *value_store, and the sender and page permission
+// in *from_env_store and *perm_store (if they're nonnull), as ipc_recv
+// does.  Any page is mapped at 'pg', if nonnull.
+// Returns 1 if a message was received, 0 if the mailbox is empty,
+// or < 0 on error.
+int
+ipc_poll(envid_t *from_env_store, uint32_t *value_store, void *pg,
+	 int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void *)UTOP;
+
+	if ((r = sys_ipc_poll(pg)) <= 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = env->env_ipc_from;
+	if (value_store)
+		*value_store = env->env_ipc_value;
+	if (perm_store)
+		*perm_store = env->env_ipc_perm;
+	return 1;
+}
+
+// Find the first environment of the given type, such as the file
+// server.  Returns its id, or 0 if there is none.
+envid_t
+ipc_find_env(enum EnvType type)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == type && envs[i].env_status != ENV_FREE)
+			return envs[i].env_id;
+	return 0;
+}
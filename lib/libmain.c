@@ -3,9 +3,15 @@
 
 #include <inc/lib.h>
 
-extern void umain(int argc, char **argv);
-
-volatile struct Env *env;
+// A program linked with the static library defines umain.
+// The shared library is linked without one, so it finds the
+// program's in dynumain instead, and the program's thread-local
+// pages between dyntlsdata and dynetlsdata (see _dynstart in entry.S).
+extern void umain(int argc, char **argv) __attribute__((weak));
+void (*dynumain)(int argc, char **argv);
+uintptr_t dyntlsdata, dynetlsdata;
+
+volatile struct Env *env __threadlocal;
 char *binaryname = "(PROGRAM NAME UNKNOWN)";
 
 void
@@ -15,6 +21,9 @@ libmain(int argc, char **argv)
 	// LAB 3: Your code here.
 	envid_t envid;
 
+	// nothing may write to initialized data before this
+	cow_init();
+
 	envid = sys_getenvid();
 	env = &envs[ENVX(envid)];
 
@@ -23,7 +32,10 @@ libmain(int argc, char **argv)
 		binaryname = argv[0];
 
 	// call user main routine
-	umain(argc, argv);
+	if (dynumain)
+		dynumain(argc, argv);
+	else
+		umain(argc, argv);
 
 	// exit gracefully
 	exit();
@@ -1,5 +1,6 @@
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 /*
  * Simple malloc/free.
@@ -14,6 +15,11 @@
  * If we need to allocate a large amount (more than a page)
  * we can't put a ref count at the end of each page,
  * so we mark the pte entry with the bit PTE_CONTINUED.
+ *
+ * Threads made with sfork() share the page tables of the whole
+ * address space malloc uses, and so the pages it maps, the ref counts
+ * in them, and mptr.  malloc_lock keeps them from using those at the
+ * same time.
  */
 enum
 {
@@ -22,9 +28,25 @@ enum
 
 #define PTE_CONTINUED 0x400
 
-static uint8_t *mbegin = (uint8_t*) 0x08000000;
-static uint8_t *mend   = (uint8_t*) 0x10000000;
+static uint8_t *mbegin = (uint8_t*) MALLOCBASE;
+static uint8_t *mend   = (uint8_t*) MALLOCTOP;
 static uint8_t *mptr;
+static volatile uint32_t mlock;
+
+// Nobody holds mlock across a blocking call, so yielding until it is
+// free does not take long.
+static void
+malloc_lock(void)
+{
+	while (xchg(&mlock, 1) != 0)
+		sys_yield();
+}
+
+static void
+malloc_unlock(void)
+{
+	xchg(&mlock, 0);
+}
 
 static int
 isfree(void *v, size_t n)
@@ -38,8 +60,10 @@ isfree(void *v, size_t n)
 	return 1;
 }
 
-void*
-malloc(size_t n)
+static void free_locked(void *v);
+
+static void*
+malloc_locked(size_t n)
 {
 	int i, cont;
 	int nwrap;
@@ -70,7 +94,7 @@ malloc(size_t n)
 		/*
 		 * stop working on this page and move on.
 		 */
-		free(mptr);	/* drop reference to this page */
+		free_locked(mptr);	/* drop reference to this page */
 		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
 	}
 
@@ -97,11 +121,13 @@ malloc(size_t n)
 	 */
 	for (i = 0; i < n + 4; i += PGSIZE){
 		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+		ring_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont);
+	}
+	if (ring_flush() < 0){
+		for (i -= PGSIZE; i >= 0; i -= PGSIZE)
+			ring_page_unmap(0, mptr + i);
+		ring_flush();
+		return 0;	/* out of physical memory */
 	}
 
 	ref = (uint32_t*) (mptr + i - 4);
@@ -111,8 +137,8 @@ malloc(size_t n)
 	return v;
 }
 
-void
-free(void *v)
+static void
+free_locked(void *v)
 {
 	uint8_t *c;
 	uint32_t *ref;
@@ -124,7 +150,7 @@ free(void *v)
 	c = ROUNDDOWN(v, PGSIZE);
 
 	while (vpt[VPN(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
+		ring_page_unmap(0, c);
 		c += PGSIZE;
 		assert(mbegin <= c && c < mend);
 	}
@@ -135,6 +161,25 @@ free(void *v)
 	 */
 	ref = (uint32_t*) (c + PGSIZE - 4);
 	if (--(*ref) == 0)
-		sys_page_unmap(0, c);	
+		ring_page_unmap(0, c);
+	ring_flush();
 }
 
+void*
+malloc(size_t n)
+{
+	void *v;
+
+	malloc_lock();
+	v = malloc_locked(n);
+	malloc_unlock();
+	return v;
+}
+
+void
+free(void *v)
+{
+	malloc_lock();
+	free_locked(v);
+	malloc_unlock();
+}
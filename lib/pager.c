@@ -0,0 +1,137 @@
+// Demand loading of program segments (see inc/pager.h).
+//
+// pager_fault() runs first thing in the page fault upcall, before any
+// page of the program's text is guaranteed to be present.  So it and
+// everything it calls live in the .pager.text section, which user.ld
+// (and lib.ld) put in a segment of its own that spawn() always loads, and they use
+// nothing from the rest of the library: system calls are made inline,
+// and strings or other read-only data are off limits.
+
+#include <inc/lib.h>
+#include <inc/pager.h>
+
+#define PAGERTEXT	__attribute__((__section__(".pager.text")))
+
+// See pgfault.c
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+static int32_t pager_syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3,
+			     uint32_t a4, uint32_t a5) __attribute__((always_inline));
+
+static __inline int32_t
+pager_syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
+	      uint32_t a5)
+{
+	int32_t ret;
+
+	asm volatile("int %1\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (num),
+		  "d" (a1),
+		  "c" (a2),
+		  "b" (a3),
+		  "D" (a4),
+		  "S" (a5)
+		: "cc", "memory");
+	return ret;
+}
+
+static __inline bool
+pager_mapped(uintptr_t va) __attribute__((always_inline));
+
+static __inline bool
+pager_mapped(uintptr_t va)
+{
+	return (vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+// Ask the file server to map up to 'npages' blocks of pager file
+// 'file', starting at 'offset', one after another from 'va'.
+// Returns the number of pages mapped, or < 0 on error.
+static int PAGERTEXT
+pager_fetch(int file, off_t offset, uintptr_t va, int npages)
+{
+	const struct Fd *fd = (const struct Fd *) PAGERFD(file);
+	volatile struct Env *e;
+	struct IpcMsg msg;
+	struct Fsreq_map *req;
+	int i, r;
+
+	// ipc_find_env, which we cannot call
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS
+		    && envs[i].env_status != ENV_FREE)
+			break;
+	if (i == NENV)
+		return -E_BAD_ENV;
+
+	req = (struct Fsreq_map *) msg.msg_word;
+	req->req_fileid = fd->fd_file.id;
+	req->req_offset = offset;
+	req->req_npages = npages;
+	req->req_flags = FSMAP_NOSHARE;
+	msg.msg_len = 0;
+	if ((r = pager_syscall(SYS_ipc_call_msg, envs[i].env_id, FSREQ_MAP,
+			       (uint32_t) &msg, va, npages)) < 0)
+		return r;
+
+	e = &envs[ENVX(pager_syscall(SYS_getenvid, 0, 0, 0, 0, 0))];
+	if ((int32_t) e->env_ipc_value < 0)
+		return e->env_ipc_value;
+	return e->env_ipc_npages;
+}
+
+// Handle a fault on a page of a demand-loaded segment by mapping it,
+// along with up to PAGER_CLUSTER - 1 of the pages after it that are
+// not mapped yet.  Pages that are all file contents come straight from
+// the file server; a page past the end of the file part is zero.
+// Returns 1 if the fault was handled, 0 if it is somebody else's.
+int PAGERTEXT
+pager_fault(struct UTrapframe *utf)
+{
+	const struct Pager *pager = (const struct Pager *) PAGERVA;
+	const struct PagerSeg *ps;
+	uintptr_t va, base, fileend, end;
+	int i, n;
+
+	va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	if (!pager_mapped(PAGERVA) || pager_mapped(va))
+		goto other;
+
+	for (i = 0; i < pager->pg_nsegs; i++) {
+		ps = &pager->pg_segs[i];
+		base = ROUNDDOWN(ps->ps_va, PGSIZE);
+		if (va < base || va >= ROUNDUP(ps->ps_va + ps->ps_memsz, PGSIZE))
+			continue;
+
+		fileend = ROUNDUP(ps->ps_va + ps->ps_filesz, PGSIZE);
+		if (va >= fileend) {
+			if (pager_syscall(SYS_page_alloc, 0, va,
+					  PTE_P|PTE_U, 0, 0) < 0)
+				goto fail;
+			return 1;
+		}
+
+		// fault around, stopping at the first page already there
+		end = MIN(fileend, va + PAGER_CLUSTER * PGSIZE);
+		for (n = 1; va + n * PGSIZE < end; n++)
+			if (pager_mapped(va + n * PGSIZE))
+				break;
+		if (pager_fetch(ps->ps_file,
+				ROUNDDOWN(ps->ps_offset, PGSIZE) + (va - base),
+				va, n) <= 0)
+			goto fail;
+		return 1;
+	}
+
+other:
+	// With no handler installed, let the kernel deal with the fault.
+	if (_pgfault_handler)
+		return 0;
+fail:
+	// Without an upcall, the fault happens again on return and the
+	// kernel reports it and destroys us.
+	pager_syscall(SYS_env_set_pgfault_upcall, 0, 0, 0, 0, 0);
+	return 1;
+}
@@ -0,0 +1,190 @@
+// Batching system calls through the kernel's system call ring.
+//
+// ring_page_alloc() and friends queue a call instead of making it.
+// The kernel runs queued calls in order only when ring_flush() (or a
+// full queue) enters it, so a loop of N page mapping calls followed by
+// one ring_flush() costs one trap.
+// Errors only show up in ring_flush(), which reports the first one.
+
+#include <inc/lib.h>
+#include <inc/ring.h>
+
+// Environment the ring was set up for.  A child made by fork() inherits
+// our variables and a shared mapping of our ring page, but the kernel
+// does not know about it, so it must set up a ring of its own.
+static envid_t ring_owner __threadlocal;
+// First error reported by a completion since the last ring_flush()
+static int ring_error __threadlocal;
+
+static void ring_reap(void);
+
+// Set up the ring for this environment if it does not have one yet.
+static int
+ring_init(void)
+{
+	int r;
+
+	if (ring_owner == env->env_id)
+		return 0;
+
+	// Replace the inherited page, if any, with a fresh one.
+	// PTE_SHARE keeps fork() from making the page copy-on-write,
+	// which would leave the kernel holding our old copy.
+	if ((r = sys_page_alloc(0, (void *) RINGVA, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	if ((r = sys_ring_setup((void *) RINGVA)) < 0) {
+		sys_page_unmap(0, (void *) RINGVA);
+		return r;
+	}
+	ring_owner = env->env_id;
+	return 0;
+}
+
+// Make system call 'op' with arguments a1..a5 right away.
+// Used when the ring cannot be set up.
+static int
+ring_direct(uint32_t op, uint32_t a1, uint32_t a2, uint32_t a3,
+	    uint32_t a4, uint32_t a5)
+{
+	switch (op) {
+	case SYS_page_alloc:
+		return sys_page_alloc(a1, (void *) a2, a3);
+	case SYS_page_map:
+		return sys_page_map(a1, (void *) a2, a3, (void *) a4, a5);
+	case SYS_page_unmap:
+		return sys_page_unmap(a1, (void *) a2);
+	case SYS_env_set_status:
+		return sys_env_set_status(a1, a2);
+	case SYS_ipc_try_send:
+		return sys_ipc_try_send(a1, a2, (void *) a3, a4);
+	case SYS_ipc_post:
+		return sys_ipc_post(a1, a2, (void *) a3, a4,
+				    (const struct IpcMsg *) a5);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Queue system call 'op' with arguments a1..a5.
+// If the submission queue is full, flushes it first.
+// If the ring cannot be set up, makes the call directly instead;
+// either way an error shows up in the next ring_flush().
+// Returns 0.
+static int
+ring_submit(uint32_t op, uint32_t a1, uint32_t a2, uint32_t a3,
+	    uint32_t a4, uint32_t a5)
+{
+	struct Ring *ring = (struct Ring *) RINGVA;
+	struct RingSqe *sqe;
+	int r;
+
+	if (ring_init() < 0) {
+		if ((r = ring_direct(op, a1, a2, a3, a4, a5)) < 0
+		    && ring_error == 0)
+			ring_error = r;
+		return 0;
+	}
+
+	while (ring->sq_tail - ring->sq_head == RING_NENTRIES) {
+		ring_reap();
+		sys_ring_enter();
+	}
+
+	sqe = &ring->sq[ring->sq_tail % RING_NENTRIES];
+	sqe->sqe_op = op;
+	sqe->sqe_tag = ring->sq_tail;
+	sqe->sqe_args[0] = a1;
+	sqe->sqe_args[1] = a2;
+	sqe->sqe_args[2] = a3;
+	sqe->sqe_args[3] = a4;
+	sqe->sqe_args[4] = a5;
+	// The entry must be complete before the kernel can see it.
+	__asm __volatile("" : : : "memory");
+	ring->sq_tail++;
+	return 0;
+}
+
+// Consume all posted completions, remembering the first error.
+static void
+ring_reap(void)
+{
+	struct Ring *ring = (struct Ring *) RINGVA;
+	struct RingCqe *cqe;
+
+	while (ring->cq_head != ring->cq_tail) {
+		cqe = &ring->cq[ring->cq_head % RING_NENTRIES];
+		if (cqe->cqe_result < 0 && ring_error == 0)
+			ring_error = cqe->cqe_result;
+		ring->cq_head++;
+	}
+}
+
+// Wait for all queued calls to finish.
+// Returns 0 if they all succeeded, otherwise the first error
+// any of them returned since the last ring_flush().
+int
+ring_flush(void)
+{
+	struct Ring *ring = (struct Ring *) RINGVA;
+	int r;
+
+	if (ring_owner != env->env_id)
+		goto out;
+
+	ring_reap();
+	while (ring->sq_head != ring->sq_tail) {
+		if ((r = sys_ring_enter()) < 0)
+			return r;
+		// With the completion queue empty, the kernel only
+		// refuses work if we scribbled on the ring.
+		if (r == 0)
+			return -E_INVAL;
+		ring_reap();
+	}
+
+out:
+	r = ring_error;
+	ring_error = 0;
+	return r;
+}
+
+int
+ring_page_alloc(envid_t envid, void *va, int perm)
+{
+	return ring_submit(SYS_page_alloc, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+ring_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	return ring_submit(SYS_page_map, srcenv, (uint32_t) srcva,
+			   dstenv, (uint32_t) dstva, perm);
+}
+
+int
+ring_page_unmap(envid_t envid, void *va)
+{
+	return ring_submit(SYS_page_unmap, envid, (uint32_t) va, 0, 0, 0);
+}
+
+int
+ring_env_set_status(envid_t envid, int status)
+{
+	return ring_submit(SYS_env_set_status, envid, status, 0, 0, 0);
+}
+
+int
+ring_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return ring_submit(SYS_ipc_try_send, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+// The kernel reads '*msg' when it runs the call, so it must stay
+// unchanged until ring_flush().
+int
+ring_ipc_post(envid_t envid, uint32_t value, void *srcva, int perm,
+	      const struct IpcMsg *msg)
+{
+	return ring_submit(SYS_ipc_post, envid, value, (uint32_t) srcva, perm,
+			   (uint32_t) msg);
+}
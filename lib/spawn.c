@@ -1,14 +1,27 @@
 #include <inc/lib.h>
 #include <inc/elf.h>
+#include <inc/pager.h>
 
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
 // Helper functions for spawn.
+static envid_t load_child(const char *prog, const char **argv);
+static envid_t load_image(int fd, struct Elf *elf, int libfd,
+			  struct Elf *libelf, const char **argv);
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int copy_shared_pages(envid_t child);
+static int open_elf(const char *path, struct Elf *elf);
+static int find_interp(int fd, struct Elf *elf, char *path);
+static uintptr_t find_upcall(int fd, struct Elf *elf);
+static void find_tls(int fd, struct Elf *elf, uintptr_t *start,
+		     uintptr_t *end);
+static int load_segments(int fd, struct Elf *elf, envid_t child,
+			 struct Pager *pager, int file);
 static int load_elf_to_child(int fd, struct Proghdr *ph, envid_t child);
+static int load_tail_page(int fd, struct Proghdr *ph, envid_t child);
+static int start_pager(int fd, int libfd, envid_t child, uintptr_t upcall);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -18,36 +31,102 @@ static int load_elf_to_child(int fd, struct Proghdr *ph, envid_t child);
 int
 spawn(const char *prog, const char **argv)
 {
-	struct Trapframe child_tf;
 	envid_t child;
-	struct Elf elf;
-	struct Proghdr ph;
-	int r, i, pn;
-	int fd;
-	uintptr_t esp;
+	int r;
+
+	if ((child = load_child(prog, argv)) < 0)
+		return child;
+
+	//   - Start the child process running with sys_env_set_status().
+	if ((r = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
+		return r;
+
+	return child;
+}
+
+// Spawn, taking command-line arguments array directly on the stack.
+int
+spawnl(const char *prog, const char *arg0, ...)
+{
+	return spawn(prog, &arg0);
+}
+
+// Replace the current program with 'prog', run with arguments 'argv'
+// as spawn would run it.  The environment keeps its envid, and the new
+// program gets the same file descriptors a spawned child would.
+// Does not return on success; returns < 0 on failure.
+int
+exec(const char *prog, const char **argv)
+{
+	envid_t child;
+	int r;
+
+	// Build the new program in a child, then take over its address space.
+	if ((child = load_child(prog, argv)) < 0)
+		return child;
+
+	r = sys_env_exec(child);
+	sys_env_destroy(child);
+	return r;
+}
+
+// Exec, taking command-line arguments array directly on the stack.
+int
+execl(const char *prog, const char *arg0, ...)
+{
+	return exec(prog, &arg0);
+}
+
+// Create a child environment and load program 'prog' into it with
+// arguments 'argv', ready to run but not yet runnable.
+// Returns child envid on success, < 0 on failure.
+static envid_t
+load_child(const char *prog, const char **argv)
+{
+	struct Elf elf, libelf;
+	char interp[MAXNAMELEN];
+	int fd, libfd, r;
 
 	// Insert your code, following approximately this procedure:
 	//
 	//   - Open the program file.
-	if ((fd = open(prog, O_RDONLY)) < 0)
-		return fd;
 	//
 	//   - Read the ELF header, as you have before, and sanity check its
 	//     magic number.  (Check out your load_icode!)
-	if (read(fd, (void *)&elf, sizeof(elf)) != sizeof(elf)) {
-		close(fd);
-		return -E_INVAL;
-	}
-	if (elf.e_magic != ELF_MAGIC) {
-		close(fd);
-		return -E_INVAL;
-	}
+	if ((fd = open_elf(prog, &elf)) < 0)
+		return fd;
+
+	// A program linked against the shared library names the library
+	// in its interpreter segment (see user/dyn.ld).  The library gets
+	// loaded along with the program, and starts it.
+	libfd = -1;
+	if ((r = find_interp(fd, &elf, interp)) > 0)
+		r = libfd = open_elf(interp, &libelf);
+	if (r >= 0)
+		r = load_image(fd, &elf, libfd, &libelf, argv);
+
+	close(fd);
+	if (libfd >= 0)
+		close(libfd);
+	return r;
+}
+
+// Create the child for load_child from the open program file 'fd' and,
+// if 'libfd' is not -1, the shared library file 'libfd'.
+static envid_t
+load_image(int fd, struct Elf *elf, int libfd, struct Elf *libelf,
+	   const char **argv)
+{
+	struct Trapframe child_tf;
+	envid_t child;
+	struct Pager *pager;
+	int r, pn;
+	uintptr_t esp, upcall, tls, etls;
+
 	//
 	//   - Use sys_exofork() to create a new environment.
-	if ((child = sys_exofork()) < 0) {
-		close(fd);
+	if ((child = sys_exofork()) < 0)
 		return child;
-	}
 	//
 	//   - Set child_tf to an initial struct Trapframe for the child.
 	//     Hint: The sys_exofork() system call has already created
@@ -57,65 +136,53 @@ spawn(const char *prog, const char **argv)
 	//
 	//   - Call the init_stack() function above to set up
 	//     the initial stack page for the child environment.
-	if ((r = init_stack(child, argv, &esp)) < 0) {
-		close(fd);
+	if ((r = init_stack(child, argv, &esp)) < 0)
 		return r;
-	}
 	child_tf = envs[ENVX(child)].env_tf;
-	child_tf.tf_eip = elf.e_entry;
+	if (libfd >= 0) {
+		// The library's entry point finds the program's in %eax,
+		// and its thread-local pages in %edx and %ecx
+		// (see _dynstart in lib/entry.S).
+		find_tls(fd, elf, &tls, &etls);
+		child_tf.tf_eip = libelf->e_entry;
+		child_tf.tf_regs.reg_eax = elf->e_entry;
+		child_tf.tf_regs.reg_edx = tls;
+		child_tf.tf_regs.reg_ecx = etls;
+	} else
+		child_tf.tf_eip = elf->e_entry;
 	child_tf.tf_esp = esp;
 	//
 	//   - Map all of the program's segments that are of p_type
 	//     ELF_PROG_LOAD into the new environment's address space.
-	//     Use the p_flags field in the Proghdr for each segment
-	//     to determine how to map the segment:
-	//
-	//	* If the ELF flags do not include ELF_PROG_FLAG_WRITE,
-	//	  then the segment contains text and read-only data.
-	//	  Use read_map() to read the contents of this segment,
-	//	  and map the pages it returns directly into the child
-	//        so that multiple instances of the same program
-	//	  will share the same copy of the program text.
-	//        Be sure to map the program text read-only in the child.
-	//        Read_map is like read but returns a pointer to the data in
-	//        *blk rather than copying the data into another buffer.
-	//
-	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
-	//	  then the segment contains read/write data and bss.
-	//	  As with load_icode() in Lab 3, such an ELF segment
-	//	  occupies p_memsz bytes in memory, but only the FIRST
-	//	  p_filesz bytes of the segment are actually loaded
-	//	  from the executable file - you must clear the rest to zero.
-	//        For each page to be mapped for a read/write segment,
-	//        allocate a page in the parent temporarily at UTEMP,
-	//        read() the appropriate portion of the file into that page
-	//	  and/or use memset() to zero non-loaded portions.
-	//	  (You can avoid calling memset(), if you like, if
-	//	  page_alloc() returns zeroed pages already.)
-	//        Then insert the page mapping into the child.
-	//        Look at init_stack() for inspiration.
-	//        Be sure you understand why you can't use read_map() here.
+	//     (See load_segments below.)
 	//
-	//     Note: None of the segment addresses or lengths above
-	//     are guaranteed to be page-aligned, so you must deal with
-	//     these non-page-aligned values appropriately.
-	//     The ELF linker does, however, guarantee that no two segments
-	//     will overlap on the same page; and it guarantees that
-	//     PGOFF(ph->p_offset) == PGOFF(ph->p_va).
-	for (i = 0; i < elf.e_phnum; i++) {
-		seek(fd, elf.e_phoff + sizeof(struct Proghdr) * i);
-		read(fd, &ph, sizeof(struct Proghdr));
+	//     Text segments are loaded on demand instead, if the
+	//     program or its library has a pager segment (see
+	//     inc/pager.h): they go in the pager table we build at UTEMP2,
+	//     and the child's page fault upcall maps their pages as it
+	//     first touches them.
+	if (libfd >= 0)
+		upcall = find_upcall(libfd, libelf);
+	else
+		upcall = find_upcall(fd, elf);
 
-		if (ph.p_type == ELF_PROG_LOAD) {
-			r = load_elf_to_child(fd, &ph, child);
-			if (r < 0) {
-				cprintf("load elf error: %e", r);
-				close(fd);
-				return r;
-			}
-		}
+	pager = NULL;
+	if (upcall) {
+		pager = (struct Pager *) UTEMP2;
+		if ((r = sys_page_alloc(0, pager, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
 	}
-	close(fd);
+
+	r = load_segments(fd, elf, child, pager, 0);
+	if (r >= 0 && libfd >= 0)
+		r = load_segments(libfd, libelf, child, pager, 1);
+	if (r >= 0 && pager && pager->pg_nsegs > 0)
+		r = start_pager(fd, libfd, child, upcall);
+	if (pager)
+		sys_page_unmap(0, pager);
+	if (r < 0)
+		return r;
+
 	// loop through all the page table entries
 	pn = UTOP / PGSIZE - 1;
 	while (--pn >= 0)
@@ -123,32 +190,177 @@ spawn(const char *prog, const char **argv)
 			pn = (pn >> 10) << 10;
 		else if ((vpt[pn] & PTE_P) && (vpt[pn] & PTE_SHARE)) {
 			// propagate the PTE_SHARE pages
-			r = sys_page_map(0, (void *)(pn*PGSIZE),
-					 child, (void *)(pn*PGSIZE),
-					 vpt[pn] & PTE_USER);
+			r = ring_page_map(0, (void *)(pn*PGSIZE),
+					  child, (void *)(pn*PGSIZE),
+					  vpt[pn] & PTE_USER);
 			if (r < 0)
 				return r;
 		}
+	if ((r = ring_flush()) < 0)
+		return r;
 	//
 	//   - Call sys_env_set_trapframe(child, &child_tf) to set up the
 	//     correct initial eip and esp values in the child.
 	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
 		return r;
-	//
-	//   - Start the child process running with sys_env_set_status().
-	if ((r = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
-		return r;
 
 	return child;
 }
 
-// Spawn, taking command-line arguments array directly on the stack.
-int
-spawnl(const char *prog, const char *arg0, ...)
+
+// Open the ELF file 'path' and read its header into *elf.
+// Returns the file descriptor on success, < 0 on failure.
+static int
+open_elf(const char *path, struct Elf *elf)
 {
-	return spawn(prog, &arg0);
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fd;
+	if (readn(fd, elf, sizeof(*elf)) != sizeof(*elf)
+	    || elf->e_magic != ELF_MAGIC) {
+		close(fd);
+		return -E_INVAL;
+	}
+	return fd;
+}
+
+// Copy the path in the interpreter segment of ELF file 'fd', if it has
+// one, to 'path', which has room for MAXNAMELEN bytes.
+// Returns 1 if there is one, 0 if not, < 0 on error.
+static int
+find_interp(int fd, struct Elf *elf, char *path)
+{
+	struct Proghdr ph;
+	int i;
+
+	for (i = 0; i < elf->e_phnum; i++) {
+		seek(fd, elf->e_phoff + sizeof(struct Proghdr) * i);
+		if (readn(fd, &ph, sizeof(ph)) != sizeof(ph))
+			return -E_INVAL;
+		if (ph.p_type != ELF_PROG_INTERP)
+			continue;
+		if (ph.p_filesz == 0 || ph.p_filesz > MAXNAMELEN)
+			return -E_INVAL;
+		seek(fd, ph.p_offset);
+		if (readn(fd, path, ph.p_filesz) != ph.p_filesz
+		    || path[ph.p_filesz - 1] != '\0')
+			return -E_INVAL;
+		return 1;
+	}
+	return 0;
+}
+
+// Return the address of the pager segment of ELF file 'fd', where its
+// page fault upcall starts, or 0 if it has none.
+static uintptr_t
+find_upcall(int fd, struct Elf *elf)
+{
+	struct Proghdr ph;
+	int i;
+
+	for (i = 0; i < elf->e_phnum; i++) {
+		seek(fd, elf->e_phoff + sizeof(struct Proghdr) * i);
+		read(fd, &ph, sizeof(struct Proghdr));
+		if (ph.p_type == ELF_PROG_LOAD
+		    && (ph.p_flags & ELF_PROG_FLAG_EAGER))
+			return ph.p_va;
+	}
+	return 0;
 }
 
+// Find the thread-local segment of ELF file 'fd', and store the bounds
+// of its pages in *start and *end; both are 0 if it has none.
+static void
+find_tls(int fd, struct Elf *elf, uintptr_t *start, uintptr_t *end)
+{
+	struct Proghdr ph;
+	int i;
+
+	*start = *end = 0;
+	for (i = 0; i < elf->e_phnum; i++) {
+		seek(fd, elf->e_phoff + sizeof(struct Proghdr) * i);
+		read(fd, &ph, sizeof(struct Proghdr));
+		if (ph.p_type == ELF_PROG_LOAD
+		    && (ph.p_flags & ELF_PROG_FLAG_TLS)) {
+			*start = ROUNDDOWN(ph.p_va, PGSIZE);
+			*end = ROUNDUP(ph.p_va + ph.p_memsz, PGSIZE);
+			return;
+		}
+	}
+}
+
+// Map the ELF_PROG_LOAD segments of ELF file 'fd' into the child.
+// Use the p_flags field in the Proghdr for each segment
+// to determine how to map the segment:
+//
+//	* If the ELF flags do not include ELF_PROG_FLAG_WRITE,
+//	  then the segment contains text and read-only data.
+//	  Use read_map() to read the contents of this segment,
+//	  and map the pages it returns directly into the child
+//	  so that multiple instances of the same program
+//	  will share the same copy of the program text.
+//	  Be sure to map the program text read-only in the child.
+//	  Read_map is like read but returns a pointer to the data in
+//	  *blk rather than copying the data into another buffer.
+//
+//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
+//	  then the segment contains read/write data and bss.
+//	  As with load_icode() in Lab 3, such an ELF segment
+//	  occupies p_memsz bytes in memory, but only the FIRST
+//	  p_filesz bytes of the segment are actually loaded
+//	  from the executable file - you must clear the rest to zero.
+//	  For each page to be mapped for a read/write segment,
+//	  allocate a page in the parent temporarily at UTEMP,
+//	  read() the appropriate portion of the file into that page
+//	  and/or use memset() to zero non-loaded portions.
+//	  Then insert the page mapping into the child.
+//
+// None of the segment addresses or lengths above are guaranteed to be
+// page-aligned, so we must deal with non-page-aligned values.
+// The ELF linker does, however, guarantee that no two segments
+// will overlap on the same page; and it guarantees that
+// PGOFF(ph->p_offset) == PGOFF(ph->p_va).
+//
+// If 'pager' is nonnull, text segments other than the pager segment
+// go in it as segments of pager file 'file' instead, all but the page
+// where the file part ends, if the segment goes on past it.
+static int
+load_segments(int fd, struct Elf *elf, envid_t child, struct Pager *pager,
+	      int file)
+{
+	struct Proghdr ph;
+	struct PagerSeg *ps;
+	int i, r;
+
+	for (i = 0; i < elf->e_phnum; i++) {
+		seek(fd, elf->e_phoff + sizeof(struct Proghdr) * i);
+		read(fd, &ph, sizeof(struct Proghdr));
+
+		if (ph.p_type != ELF_PROG_LOAD)
+			continue;
+		if (pager && (ph.p_flags & ELF_PROG_FLAG_EXEC)
+		    && !(ph.p_flags & (ELF_PROG_FLAG_WRITE | ELF_PROG_FLAG_EAGER))
+		    && pager->pg_nsegs < PAGER_MAXSEGS) {
+			if (ph.p_memsz > ph.p_filesz
+			    && (ph.p_va + ph.p_filesz) % PGSIZE != 0
+			    && (r = load_tail_page(fd, &ph, child)) < 0)
+				return r;
+			ps = &pager->pg_segs[pager->pg_nsegs++];
+			ps->ps_file = file;
+			ps->ps_va = ph.p_va;
+			ps->ps_memsz = ph.p_memsz;
+			ps->ps_filesz = ph.p_filesz;
+			ps->ps_offset = ph.p_offset;
+			continue;
+		}
+		if ((r = load_elf_to_child(fd, &ph, child)) < 0) {
+			cprintf("load elf error: %e", r);
+			return r;
+		}
+	}
+	return 0;
+}
 
 // Set up the initial stack page for the new child process with envid 'child'
 // using the arguments array pointed to by 'argv',
@@ -248,6 +460,33 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 	return 0;
 }
 
+// Give the child the pager table built at UTEMP2 and the struct Fds of
+// the program file 'fd' and library file 'libfd' (if not -1), which
+// keep the files open for the pager, and set up its page fault upcall
+// at 'upcall' with an exception stack.
+static int
+start_pager(int fd, int libfd, envid_t child, uintptr_t upcall)
+{
+	int fds[PAGER_NFILES] = { fd, libfd };
+	struct Fd *fdp;
+	int i, r;
+
+	if ((r = sys_page_map(0, UTEMP2, child, (void *) PAGERVA,
+			      PTE_P | PTE_U)) < 0)
+		return r;
+	for (i = 0; i < PAGER_NFILES && fds[i] >= 0; i++) {
+		if ((r = fd_lookup(fds[i], &fdp)) < 0)
+			return r;
+		if ((r = sys_page_map(0, fdp, child, (void *) PAGERFD(i),
+				      PTE_P | PTE_U)) < 0)
+			return r;
+	}
+	if ((r = sys_page_alloc(child, (void *) (UXSTACKTOP - PGSIZE),
+				PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	return sys_env_set_pgfault_upcall(child, (void *) upcall);
+}
+
 static int load_elf_to_child(int fd, struct Proghdr *ph, envid_t child)
 {
 	uint32_t offset, cur_va;
@@ -260,6 +499,30 @@ static int load_elf_to_child(int fd, struct Proghdr *ph, envid_t child)
 		cur_va = ph->p_va;
 
 		while (cur_va < ph->p_va + ph->p_filesz) {
+			// Whole pages of file data are a snapshot of the
+			// file server's page, which stays as it is when the
+			// file is written, mapped copy-on-write; the child
+			// makes its own copy on first write (see cow_init).
+			// While the file is open for writing there is no
+			// snapshot, and the page is read in below instead.
+			if (cur_va % PGSIZE == 0
+			    && cur_va + PGSIZE <= ph->p_va + ph->p_filesz) {
+				r = read_snapshot(fd, offset, UTEMP);
+				if (r < 0 && r != -E_BUSY)
+					return r;
+				if (r == 0) {
+					if ((r = sys_page_map(0, UTEMP, child,
+							      (void *)cur_va,
+							      PTE_P |PTE_U |PTE_COW)) < 0)
+						return r;
+					if ((r = sys_page_unmap(0, UTEMP)) < 0)
+						return r;
+					offset += PGSIZE;
+					cur_va += PGSIZE;
+					continue;
+				}
+			}
+
 			// calculate 'size', if it exceeds p_filesz,
 			// then, adjust the 'size'.
 			size = PGSIZE - (offset & 0xfff);
@@ -323,18 +586,58 @@ static int load_elf_to_child(int fd, struct Proghdr *ph, envid_t child)
 		while (cur_va < ph->p_va + ph->p_filesz) {
 			size = PGSIZE - (offset & 0xfff);
 
-			if ((r = read_map(fd, offset, &blk)) < 0)
-				return r;
-			if ((r = sys_page_map(0,
-					      ROUNDDOWN(blk, PGSIZE),
-					      child,
-					      (void *)ROUNDDOWN(cur_va, PGSIZE),
-					      PTE_P |PTE_U)) < 0)
-				return r;
+			// The file server's page holds whatever follows the
+			// segment in the file, so a page the segment goes on
+			// past gets a copy with the rest zeroed.
+			if (cur_va + size > ph->p_va + ph->p_filesz
+			    && ph->p_memsz > ph->p_filesz) {
+				if ((r = load_tail_page(fd, ph, child)) < 0)
+					return r;
+			} else {
+				if ((r = read_map(fd, offset, &blk)) < 0)
+					return r;
+				if ((r = sys_page_map(0,
+						      ROUNDDOWN(blk, PGSIZE),
+						      child,
+						      (void *)ROUNDDOWN(cur_va, PGSIZE),
+						      PTE_P |PTE_U)) < 0)
+					return r;
+			}
 
 			offset += size;
 			cur_va += size;
 		}
+		// the rest of the segment is zero
+		cur_va = ROUNDUP(cur_va, PGSIZE);
+		while (cur_va < ph->p_va + ph->p_memsz) {
+			if ((r = sys_page_alloc(child, (void *)cur_va,
+						PTE_P |PTE_U)) < 0)
+				return r;
+			cur_va += PGSIZE;
+		}
 	}
 	return 0;
 }
+
+// Map into 'child' a private copy of the page of read-only segment 'ph'
+// where its file part ends, with the rest of the page zeroed.
+static int
+load_tail_page(int fd, struct Proghdr *ph, envid_t child)
+{
+	uintptr_t va, start;
+	int r;
+
+	va = ROUNDDOWN(ph->p_va + ph->p_filesz, PGSIZE);
+	start = MAX(va, ph->p_va);
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if ((r = seek(fd, ph->p_offset + (start - ph->p_va))) < 0
+	    || (r = readn(fd, UTEMP + (start - va),
+			  ph->p_va + ph->p_filesz - start)) < 0
+	    || (r = sys_page_map(0, UTEMP, child, (void *) va,
+				 PTE_P|PTE_U)) < 0) {
+		sys_page_unmap(0, UTEMP);
+		return r;
+	}
+	return sys_page_unmap(0, UTEMP);
+}
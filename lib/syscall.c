@@ -2,12 +2,45 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether to enter the kernel with sysenter instead of int T_SYSCALL:
+// 1 if so, -1 if not, 0 until the first system call finds out (see
+// cpu_has_sysenter).  Starting at 0 keeps it in .bss, which spawn()
+// never maps copy-on-write, so system calls work before cow_init().
+static int use_sysenter;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+	if (use_sysenter == 0)
+		use_sysenter = cpu_has_sysenter() ? 1 : -1;
+
+	// Fast path: sysenter has no room for a fifth argument, because
+	// we pass the return address in SI and the stack pointer in BP
+	// (the kernel hands them back to sysexit in DX and CX).
+	// The kernel passes 0 for the fifth argument on this path.
+	if (use_sysenter > 0 && a5 == 0) {
+		asm volatile("pushl %%ebp\n\t"
+			     "movl %%esp, %%ebp\n\t"
+			     "leal 1f, %%esi\n\t"
+			     "sysenter\n"
+			     "1:\tpopl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "0" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "esi", "cc", "memory");
+
+		if (check && ret > 0)
+			panic("syscall %d returned %d (> 0)", num, ret);
+		return ret;
+	}
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -73,6 +106,18 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+int
+sys_page_alloc_contig(envid_t envid, void *va, unsigned npages, int perm)
+{
+	return syscall(SYS_page_alloc_contig, 1, envid, (uint32_t) va, npages, perm, 0);
+}
+
+int
+sys_page_table_share(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_table_share, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
@@ -105,6 +150,12 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_exec(envid_t envid)
+{
+	return syscall(SYS_env_exec, 1, envid, 0, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
@@ -117,8 +168,96 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm, unsigned timeout)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, timeout);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_call_msg(envid_t envid, uint32_t value, const struct IpcMsg *msg,
+		 void *dstva, unsigned dstnpages)
+{
+	return syscall(SYS_ipc_call_msg, 0, envid, value, (uint32_t) msg, (uint32_t) dstva, dstnpages);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_waitv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+		    int nsegs, void *dstva)
+{
+	return syscall(SYS_ipc_reply_waitv, 0, envid, value, (uint32_t) segs, nsegs, (uint32_t) dstva);
+}
+
+int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+		  int nsegs)
+{
+	return syscall(SYS_ipc_try_sendv, 0, envid, value, (uint32_t) segs, nsegs, 0);
+}
+
+int
+sys_ipc_mbox_setup(unsigned n)
+{
+	return syscall(SYS_ipc_mbox_setup, 1, n, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_post(envid_t envid, uint32_t value, void *srcva, int perm,
+	     const struct IpcMsg *msg)
+{
+	return syscall(SYS_ipc_post, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) msg);
+}
+
+int
+sys_ipc_poll(void *dstva)
+{
+	return syscall(SYS_ipc_poll, 0, (uint32_t) dstva, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_alarm(unsigned ms)
+{
+	return syscall(SYS_ipc_alarm, 0, ms, 0, 0, 0, 0);
+}
+
+int
+sys_irq_attach(int irq)
+{
+	return syscall(SYS_irq_attach, 1, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(void)
+{
+	return syscall(SYS_irq_wait, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_phy_page(envid_t envid, void *va)
 {
 	return syscall(SYS_phy_page, 0, (uint32_t)envid, (uint32_t)va, 0, 0, 0);
 }
+
+int
+sys_ring_setup(void *va)
+{
+	return syscall(SYS_ring_setup, 1, (uint32_t)va, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(void)
+{
+	return syscall(SYS_ring_enter, 0, 0, 0, 0, 0, 0);
+}
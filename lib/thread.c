@@ -0,0 +1,285 @@
+// User-level threads.
+//
+// Each thread is an environment made by sfork(), so threads share all
+// the memory that was mapped when they were created, except for their
+// stacks and thread-local variables (see __threadlocal in inc/lib.h),
+// and all the memory malloc() maps later.  Other memory mapped later,
+// with sys_page_alloc() for instance, is private to the thread that
+// mapped it.
+//
+// Threads that must wait block in the kernel instead of spinning:
+// a waiting thread puts itself on a wait queue and receives from its
+// IPC mailbox, and whoever wakes it posts THREAD_WAKEUP there.
+// The mailbox holds on to a wakeup that comes before its thread starts
+// receiving, so none are lost.  A thread should not expect other IPC
+// while it may be waiting for a mutex, condition variable or join.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define THREAD_WAKEUP	0x74687264	// IPC value that wakes a thread
+#define THREAD_MBOX	4		// Mailbox size for each thread
+
+// Values of t_state in struct uthread
+#define THREAD_FREE	0
+#define THREAD_RUNNING	1
+#define THREAD_DONE	2
+
+struct uthread {
+	int t_state;			// THREAD_*
+	envid_t t_envid;		// Environment running the thread
+	void *t_result;			// Value passed to thread_exit
+	struct uthread *t_joiner;	// Thread waiting in thread_join, if any
+	struct uthread *t_next;		// Next thread on the same wait queue
+};
+
+// Shared by all threads; threads_guard protects it.
+static struct uthread threads[NTHREAD];
+static volatile uint32_t threads_guard;
+
+// The calling thread's entry in threads[], or NULL if this environment
+// has not used threads yet.
+static struct uthread *curthread __threadlocal;
+
+// Short-term lock for the fields of a thread object.
+// Nobody holds one across a blocking call, so yielding until it is
+// free does not take long.
+static void
+guard_acquire(volatile uint32_t *guard)
+{
+	while (xchg(guard, 1) != 0)
+		sys_yield();
+}
+
+static void
+guard_release(volatile uint32_t *guard)
+{
+	xchg(guard, 0);
+}
+
+// Take a free entry in threads[] and mark it running.
+// Returns NULL if there is none.
+static struct uthread *
+thread_alloc(void)
+{
+	struct uthread *t;
+
+	guard_acquire(&threads_guard);
+	for (t = threads; t < threads + NTHREAD; t++)
+		if (t->t_state == THREAD_FREE) {
+			memset(t, 0, sizeof(*t));
+			t->t_state = THREAD_RUNNING;
+			break;
+		}
+	guard_release(&threads_guard);
+	return t < threads + NTHREAD ? t : NULL;
+}
+
+// Make the calling environment a thread, if it is not one already.
+static void
+thread_init(void)
+{
+	int r;
+
+	if (curthread)
+		return;
+	if ((curthread = thread_alloc()) == NULL)
+		panic("thread_init: too many threads");
+	curthread->t_envid = env->env_id;
+	if ((r = sys_ipc_mbox_setup(THREAD_MBOX)) < 0)
+		panic("sys_ipc_mbox_setup: %e", r);
+}
+
+// Block until somebody calls thread_wake on us.
+static void
+thread_wait(void)
+{
+	while (ipc_recv(0, 0, 0) != THREAD_WAKEUP)
+		/* not for us */;
+}
+
+static void
+thread_wake(struct uthread *t)
+{
+	int r;
+
+	if ((r = ipc_post(t->t_envid, THREAD_WAKEUP, 0, 0)) < 0)
+		panic("thread_wake %08x: %e", t->t_envid, r);
+}
+
+static void
+waitq_push(struct uthread **head, struct uthread **tail, struct uthread *t)
+{
+	t->t_next = NULL;
+	if (*head)
+		(*tail)->t_next = t;
+	else
+		*head = t;
+	*tail = t;
+}
+
+static struct uthread *
+waitq_pop(struct uthread **head)
+{
+	struct uthread *t;
+
+	if ((t = *head) != NULL)
+		*head = t->t_next;
+	return t;
+}
+
+// Start a thread running func(arg), and store its id in *tid.
+// The thread ends when func returns, or calls thread_exit.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if there are already NTHREAD threads
+//		or no environment is free.
+//	-E_NO_MEM if there is not enough memory.
+int
+thread_create(thread_t *tid, void *(*func)(void *), void *arg)
+{
+	struct uthread *t;
+	envid_t envid;
+	int r;
+
+	thread_init();
+	if ((t = thread_alloc()) == NULL)
+		return -E_NO_FREE_ENV;
+
+	if ((envid = sfork()) < 0) {
+		t->t_state = THREAD_FREE;
+		return envid;
+	}
+
+	if (envid == 0) {
+		curthread = t;
+		t->t_envid = env->env_id;
+		if ((r = sys_ipc_mbox_setup(THREAD_MBOX)) < 0)
+			panic("sys_ipc_mbox_setup: %e", r);
+		thread_exit(func(arg));
+	}
+
+	t->t_envid = envid;
+	*tid = t - threads;
+	return 0;
+}
+
+// End the calling thread, handing 'result' to thread_join.
+// Open files stay open for the other threads.
+void
+thread_exit(void *result)
+{
+	struct uthread *t = curthread;
+
+	if (t) {
+		guard_acquire(&threads_guard);
+		t->t_result = result;
+		t->t_state = THREAD_DONE;
+		if (t->t_joiner)
+			thread_wake(t->t_joiner);
+		guard_release(&threads_guard);
+	}
+	sys_env_destroy(0);
+	panic("thread_exit: still here");
+}
+
+// Wait for thread 'tid' to end, and store the value it passed to
+// thread_exit in *result_store, if result_store is nonnull.
+// Returns 0 on success, -E_INVAL if tid is not a thread that can be
+// joined (say, it is already being joined).
+int
+thread_join(thread_t tid, void **result_store)
+{
+	struct uthread *t;
+
+	if (tid < 0 || tid >= NTHREAD)
+		return -E_INVAL;
+	t = &threads[tid];
+	thread_init();
+
+	guard_acquire(&threads_guard);
+	if (t->t_state == THREAD_FREE || t->t_joiner || t == curthread) {
+		guard_release(&threads_guard);
+		return -E_INVAL;
+	}
+	if (t->t_state != THREAD_DONE) {
+		t->t_joiner = curthread;
+		guard_release(&threads_guard);
+		thread_wait();
+		guard_acquire(&threads_guard);
+	}
+	if (result_store)
+		*result_store = t->t_result;
+	t->t_state = THREAD_FREE;
+	guard_release(&threads_guard);
+	return 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	thread_init();
+
+	guard_acquire(&m->m_guard);
+	if (!m->m_locked) {
+		m->m_locked = 1;
+		guard_release(&m->m_guard);
+		return;
+	}
+	waitq_push(&m->m_waiters, &m->m_waiters_tail, curthread);
+	guard_release(&m->m_guard);
+	// mutex_unlock hands the mutex straight to us
+	thread_wait();
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	struct uthread *t;
+
+	guard_acquire(&m->m_guard);
+	if ((t = waitq_pop(&m->m_waiters)) != NULL)
+		thread_wake(t);
+	else
+		m->m_locked = 0;
+	guard_release(&m->m_guard);
+}
+
+// Release 'm', wait for cond_signal or cond_broadcast on 'c',
+// then take 'm' again.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	thread_init();
+
+	guard_acquire(&c->c_guard);
+	waitq_push(&c->c_waiters, &c->c_waiters_tail, curthread);
+	guard_release(&c->c_guard);
+
+	mutex_unlock(m);
+	thread_wait();
+	mutex_lock(m);
+}
+
+// Wake the thread that has waited longest on 'c', if any.
+void
+cond_signal(struct cond *c)
+{
+	struct uthread *t;
+
+	guard_acquire(&c->c_guard);
+	if ((t = waitq_pop(&c->c_waiters)) != NULL)
+		thread_wake(t);
+	guard_release(&c->c_guard);
+}
+
+// Wake every thread waiting on 'c'.
+void
+cond_broadcast(struct cond *c)
+{
+	struct uthread *t;
+
+	guard_acquire(&c->c_guard);
+	while ((t = waitq_pop(&c->c_waiters)) != NULL)
+		thread_wake(t);
+	guard_release(&c->c_guard);
+}
@@ -0,0 +1,51 @@
+// Reading the clock without entering the kernel.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Store the current time of clock 'clockid' in *ts.
+// CLOCK_MONOTONIC counts from boot; CLOCK_REALTIME adds the RTC time
+// the kernel read at boot.  Between timer ticks, the time stamp counter
+// fills in the nanoseconds, if the kernel could calibrate it.
+//
+// Returns 0 on success, -E_INVAL if 'clockid' is not a known clock.
+int
+clock_gettime(int clockid, struct timespec *ts)
+{
+	uint32_t seq, hz, boot_sec, tsc_per_tick, tsc_mult, tsc_shift;
+	uint64_t ticks, tsc, cycles, ns;
+
+	if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)
+		return -E_INVAL;
+
+	// Take a consistent snapshot of the clock page.
+	do {
+		seq = timepage.tp_seq;
+		asm volatile("" : : : "memory");
+		hz = timepage.tp_hz;
+		ticks = timepage.tp_ticks;
+		tsc = timepage.tp_tsc;
+		tsc_per_tick = timepage.tp_tsc_per_tick;
+		tsc_mult = timepage.tp_tsc_mult;
+		tsc_shift = timepage.tp_tsc_shift;
+		boot_sec = timepage.tp_boot_sec;
+		cycles = read_tsc();
+		asm volatile("" : : : "memory");
+	} while ((seq & 1) || seq != timepage.tp_seq);
+
+	ns = ticks * (NSEC_PER_SEC / hz);
+	if (tsc_per_tick) {
+		// Never run past the next tick, so time stays monotonic
+		// even if a timer interrupt is late.
+		cycles -= tsc;
+		if (cycles > tsc_per_tick)
+			cycles = tsc_per_tick;
+		ns += (cycles * tsc_mult) >> tsc_shift;
+	}
+
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+	if (clockid == CLOCK_REALTIME)
+		ts->tv_sec += boot_sec;
+	return 0;
+}
@@ -191,6 +191,15 @@ runit:
 		cprintf("\n");
 	}
 
+	// Unless we have to wait for the right-hand side of a pipe
+	// afterwards, become the command: we are already a forked copy
+	// of the shell, so there is no need for another environment.
+	if (!pipe_child) {
+		r = exec(argv[0], (const char**) argv);
+		cprintf("exec %s: %e\n", argv[0], r);
+		exit();
+	}
+
 	// Spawn the command!
 	if ((r = spawn(argv[0], (const char**) argv)) < 0)
 		cprintf("spawn %s: %e\n", argv[0], r);
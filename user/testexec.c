@@ -0,0 +1,31 @@
+// Test exec: the new program runs in the same environment.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	char buf[16];
+	envid_t child;
+	int r;
+
+	if (argc > 1) {
+		if (strtol(argv[1], 0, 16) != env->env_id)
+			panic("exec changed envid %s to %08x", argv[1], env->env_id);
+		cprintf("exec keeps the envid\n");
+		return;
+	}
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		snprintf(buf, sizeof(buf), "%x", env->env_id);
+		r = execl("/testexec", "testexec", buf, 0);
+		panic("execl: %e", r);
+	}
+	wait(child);
+
+	if ((r = execl("/no-such-program", "no-such-program", 0)) != -E_NOT_FOUND)
+		panic("execl of a missing program returned %e", r);
+	cprintf("exec of a missing program fails\n");
+}
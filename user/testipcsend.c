@@ -0,0 +1,73 @@
+// Test blocking IPC sends: FIFO order and timeouts, and calls whose
+// reply cannot be delivered.
+
+#include <inc/lib.h>
+
+#define NSENDERS	3
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent, who[NSENDERS], from;
+	int i, r, value;
+	struct timespec t0, t1;
+	struct IpcSeg seg;
+
+	// senders block in our queue, in the order they were created
+	parent = sys_getenvid();
+	for (i = 0; i < NSENDERS; i++) {
+		if ((who[i] = fork()) < 0)
+			panic("fork: %e", who[i]);
+		if (who[i] == 0) {
+			ipc_send(parent, i, 0, 0);
+			exit();
+		}
+		// let it block before making the next one
+		while (envs[ENVX(who[i])].env_status != ENV_NOT_RUNNABLE)
+			sys_yield();
+	}
+	for (i = 0; i < NSENDERS; i++) {
+		value = ipc_recv(&from, 0, 0);
+		if (value != i || from != who[i])
+			panic("got %d from %08x, wanted %d from %08x",
+			      value, from, i, who[i]);
+	}
+	cprintf("blocked senders are served in order\n");
+
+	// nobody receives from the child, so its send times out
+	if ((who[0] = fork()) < 0)
+		panic("fork: %e", who[0]);
+	if (who[0] == 0) {
+		r = ipc_send_timeout(parent, 0, 0, 0, 50);
+		ipc_send(parent, r, 0, 0);
+		exit();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		sys_yield();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+	} while (t1.tv_sec - t0.tv_sec < 1);
+	r = ipc_recv(0, 0, 0);
+	if (r != -E_IPC_NOT_RECV)
+		panic("ipc_send_timeout returned %e", r);
+	cprintf("ipc_send_timeout times out\n");
+
+	// the child replies to our first call with a page it does not
+	// have, which fails the call, and goes on to answer the second
+	if ((who[0] = fork()) < 0)
+		panic("fork: %e", who[0]);
+	if (who[0] == 0) {
+		seg.seg_va = (uintptr_t) UTEMP;
+		seg.seg_npages = 1;
+		seg.seg_perm = PTE_P | PTE_U;
+		value = ipc_reply_waitv(0, 0, NULL, 0, &from, 0, 0);
+		value = ipc_reply_waitv(from, value, &seg, 1, &from, 0, 0);
+		sys_ipc_try_send(from, value + 1, 0, 0);
+		exit();
+	}
+	if ((r = ipc_call(who[0], 1, 0, 0, UTEMP, 0)) != -E_INVAL)
+		panic("call with a bad reply returned %e", r);
+	if ((r = ipc_call(who[0], 2, 0, 0, 0, 0)) != 3)
+		panic("call after a bad reply returned %e", r);
+	cprintf("undeliverable replies fail the call\n");
+}
@@ -0,0 +1,71 @@
+// Test IPC mailboxes: sys_ipc_post and sys_ipc_poll.
+
+#include <inc/lib.h>
+
+#define NPOST	4
+#define PAGE	((char *) 0xA00000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent, child, from;
+	uint32_t value;
+	int i, r, perm;
+
+	if ((r = sys_ipc_mbox_setup(NPOST)) < 0)
+		panic("sys_ipc_mbox_setup: %e", r);
+	if ((r = ipc_poll(0, 0, 0, 0)) != 0)
+		panic("ipc_poll on an empty mailbox returned %d", r);
+
+	// the child posts while we are not receiving, then goes away;
+	// the last post does not fit
+	parent = sys_getenvid();
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = sys_page_alloc(0, PAGE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		strcpy(PAGE, "hello from the mailbox");
+		for (i = 0; i < NPOST; i++)
+			if ((r = ipc_post(parent, i, i == 1 ? PAGE : 0,
+					  PTE_P|PTE_U|PTE_W)) < 0)
+				panic("ipc_post %d: %e", i, r);
+		if ((r = ipc_post(parent, NPOST, 0, 0)) != -E_IPC_NOT_RECV)
+			panic("ipc_post to a full mailbox returned %d", r);
+		cprintf("full mailbox refuses posts\n");
+		exit();
+	}
+	wait(child);
+
+	for (i = 0; i < NPOST; i++) {
+		if ((r = ipc_poll(&from, &value, PAGE, &perm)) != 1)
+			panic("ipc_poll %d returned %d", i, r);
+		if (value != i || from != child)
+			panic("got %d from %08x, wanted %d from %08x",
+			      value, from, i, child);
+		if (i == 1 && (!perm || strcmp(PAGE, "hello from the mailbox") != 0))
+			panic("page did not come through the mailbox");
+		if (i != 1 && perm)
+			panic("message %d came with a page", i);
+	}
+	cprintf("posted messages arrive in order\n");
+
+	if ((r = ipc_poll(0, 0, 0, 0)) != 0)
+		panic("ipc_poll after draining returned %d", r);
+	cprintf("drained mailbox is empty\n");
+
+	// ipc_recv takes posted messages before blocking
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < 2; i++)
+			if ((r = ipc_post(parent, 100 + i, 0, 0)) < 0)
+				panic("ipc_post: %e", r);
+		exit();
+	}
+	wait(child);
+	for (i = 0; i < 2; i++)
+		if ((r = ipc_recv(0, 0, 0)) != 100 + i)
+			panic("ipc_recv returned %d, wanted %d", r, 100 + i);
+	cprintf("ipc_recv drains the mailbox\n");
+}
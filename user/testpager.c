@@ -0,0 +1,38 @@
+// Test demand loading: spawn leaves read-only pages for the pager.
+
+#include <inc/lib.h>
+
+#define NPAGES	6
+
+// Read-only data spanning several pages; only the last page is
+// nonzero.  Faulting in earlier pages never fetches the last one,
+// since fault-around fetches fewer than NPAGES - 1 pages.
+static const char far[NPAGES * PGSIZE] = { [(NPAGES-1) * PGSIZE] = 42 };
+
+static bool
+mapped(const void *va)
+{
+	return (vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *last = &far[(NPAGES-1) * PGSIZE];
+	int r;
+
+	if (argc == 0) {
+		if ((r = spawnl("/testpager", "testpager", "child", 0)) < 0)
+			panic("spawn: %e", r);
+		wait(r);
+		return;
+	}
+
+	if (mapped(last))
+		panic("page was loaded before it was touched");
+	if (*last != 42)
+		panic("demand-loaded page holds %d, not 42", *last);
+	if (!mapped(last))
+		panic("page is not mapped after it was touched");
+	cprintf("read-only pages are loaded on demand\n");
+}
@@ -0,0 +1,37 @@
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define NPAGES	100
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	// more pages than fit in the ring at once
+	for (i = 0; i < NPAGES; i++)
+		if ((r = ring_page_alloc(0, VA + i*PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("ring_page_alloc: %e", r);
+	if ((r = ring_flush()) < 0)
+		panic("ring_flush: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		VA[i*PGSIZE] = i;
+	for (i = 0; i < NPAGES; i++)
+		if (VA[i*PGSIZE] != i)
+			panic("page %d lost its contents", i);
+	cprintf("ring allocated %d pages\n", NPAGES);
+
+	for (i = 0; i < NPAGES; i++)
+		ring_page_unmap(0, VA + i*PGSIZE);
+	if ((r = ring_flush()) < 0)
+		panic("ring_flush: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if (vpt[VPN(VA + i*PGSIZE)] & PTE_P)
+			panic("page %d still mapped", i);
+	cprintf("ring unmapped %d pages\n", NPAGES);
+
+	ring_page_alloc(0, VA + 1, PTE_P|PTE_U|PTE_W);
+	if ((r = ring_flush()) != -E_INVAL)
+		panic("ring_flush returned %e, not -E_INVAL", r);
+	cprintf("ring reports errors\n");
+}
@@ -0,0 +1,115 @@
+// Test sfork-based threads, mutexes and condition variables.
+
+#include <inc/lib.h>
+
+#define NTHREADS	4
+#define NROUNDS		50
+#define NITEMS		20
+
+static struct mutex lock;
+static struct cond nonempty, nonfull;
+static volatile int counter;
+static int slot, full;
+static int *volatile shared;
+
+static void *
+adder(void *arg)
+{
+	int i, n;
+
+	for (i = 0; i < NROUNDS; i++) {
+		mutex_lock(&lock);
+		// let the others run while we hold the lock
+		n = counter;
+		sys_yield();
+		counter = n + 1;
+		mutex_unlock(&lock);
+	}
+	return arg;
+}
+
+static void *
+producer(void *arg)
+{
+	int i;
+
+	for (i = 1; i <= NITEMS; i++) {
+		mutex_lock(&lock);
+		while (full)
+			cond_wait(&nonfull, &lock);
+		slot = i;
+		full = 1;
+		cond_signal(&nonempty);
+		mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+// Allocate memory after the threads were made, and hand it over.
+static void *
+allocator(void *arg)
+{
+	int *p;
+
+	if ((p = malloc(sizeof(int))) == NULL)
+		panic("malloc failed");
+	*p = (int) arg;
+	shared = p;
+	return p;
+}
+
+void
+umain(int argc, char **argv)
+{
+	thread_t tid[NTHREADS];
+	void *result;
+	int *mine;
+	int i, r;
+
+	for (i = 0; i < NTHREADS; i++)
+		if ((r = thread_create(&tid[i], adder, (void *) i)) < 0)
+			panic("thread_create: %e", r);
+	for (i = 0; i < NTHREADS; i++) {
+		if ((r = thread_join(tid[i], &result)) < 0)
+			panic("thread_join: %e", r);
+		if ((int) result != i)
+			panic("thread %d returned %d", i, (int) result);
+	}
+	if (counter != NTHREADS * NROUNDS)
+		panic("counter is %d, wanted %d", counter, NTHREADS * NROUNDS);
+	cprintf("threads share memory and the mutex works\n");
+
+	if ((r = thread_create(&tid[0], producer, 0)) < 0)
+		panic("thread_create: %e", r);
+	for (i = 1; i <= NITEMS; i++) {
+		mutex_lock(&lock);
+		while (!full)
+			cond_wait(&nonempty, &lock);
+		if (slot != i)
+			panic("got item %d, wanted %d", slot, i);
+		full = 0;
+		cond_signal(&nonfull);
+		mutex_unlock(&lock);
+	}
+	if ((r = thread_join(tid[0], 0)) < 0)
+		panic("thread_join: %e", r);
+	cprintf("condition variables work\n");
+
+	// Both threads' allocations must land on different memory, and
+	// each must see what the other wrote.
+	if ((r = thread_create(&tid[0], allocator, (void *) 42)) < 0)
+		panic("thread_create: %e", r);
+	if ((r = thread_join(tid[0], &result)) < 0)
+		panic("thread_join: %e", r);
+	if (result != shared || *shared != 42)
+		panic("memory malloc'd by a thread is not shared");
+	mine = malloc(sizeof(int));
+	if (mine == NULL || mine == shared)
+		panic("malloc handed out %08x twice", mine);
+	*mine = 7;
+	if (*shared != 42)
+		panic("malloc'd memory overlaps");
+	free(mine);
+	free(shared);
+	cprintf("threads share memory from malloc\n");
+}
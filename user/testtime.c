@@ -0,0 +1,28 @@
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct timespec t0, t1, wall;
+	int i, r;
+
+	if ((r = clock_gettime(CLOCK_MONOTONIC, &t0)) < 0)
+		panic("clock_gettime: %e", r);
+	for (i = 0; i < 50; i++)
+		sys_yield();
+	if ((r = clock_gettime(CLOCK_MONOTONIC, &t1)) < 0)
+		panic("clock_gettime: %e", r);
+	if (t1.tv_sec < t0.tv_sec
+	    || (t1.tv_sec == t0.tv_sec && t1.tv_nsec < t0.tv_nsec))
+		panic("monotonic clock went backwards: %u.%09u -> %u.%09u",
+		      t0.tv_sec, t0.tv_nsec, t1.tv_sec, t1.tv_nsec);
+	cprintf("monotonic clock is monotonic\n");
+
+	if ((r = clock_gettime(CLOCK_REALTIME, &wall)) < 0)
+		panic("clock_gettime: %e", r);
+	cprintf("realtime clock %s\n", wall.tv_sec > t1.tv_sec ? "is set" : "is not set");
+
+	if (clock_gettime(-1, &wall) != -E_INVAL)
+		panic("clock_gettime accepted a bad clock id");
+	cprintf("clock_gettime rejects bad clock ids\n");
+}